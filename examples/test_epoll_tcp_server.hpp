@@ -15,8 +15,10 @@ void recv_cb(EpollTCPServer &s, int32_t fd, const string &addr, uint16_t port, c
     string content(str, data_size);
     cout << "From - " << addr << ":" << port << " fd:" << fd << "\n"
          << content << flush;
-    string ret = "Recv - " + content;
-    s.send(fd, reinterpret_cast<const uint8_t *>(ret.c_str()), ret.size());
+    // header and body in one syscall, without joining them
+    static const char header[] = "Recv - ";
+    iovec iov[2] = {{const_cast<char *>(header), sizeof(header) - 1}, {const_cast<void *>(data), data_size}};
+    s.sendv(fd, iov, 2);
 }
 
 void conn_cb(EpollTCPServer &s, int32_t fd, const string &addr, uint16_t port)
@@ -29,6 +31,22 @@ void disconn_cb(EpollTCPServer &s, const string &addr, uint16_t port)
     cout << addr << ":" << port << " disconnected " << endl;
 }
 
+// backpressure: output of a slow client piles up in the server
+void high_watermark_cb(EpollTCPServer &s, int32_t fd, size_t buffered)
+{
+    cout << "fd:" << fd << " slow, " << buffered << " bytes buffered" << endl;
+}
+
+void low_watermark_cb(EpollTCPServer &s, int32_t fd, size_t buffered)
+{
+    cout << "fd:" << fd << " drained to " << buffered << " bytes" << endl;
+}
+
+void timeout_cb(EpollTCPServer &s, int32_t fd, EpollTCPServer::TimeoutType type)
+{
+    cout << "fd:" << fd << (EpollTCPServer::IDLE_TIMEOUT == type ? " idle" : " missed a deadline") << ", closing" << endl;
+}
+
 void send_msg(EpollTCPServer &s)
 {
     string input;
@@ -119,10 +137,22 @@ int main(int argc, char *argv[])
     string addr = "0.0.0.0";
     uint16_t port = 10000;
 
-    EpollTCPServer s(addr, port);
+    // multi reactor: one event loop per core, each with its own SO_REUSEPORT listener; io_uring if the kernel has it
+    EpollTCPServer s(addr, port, thread::hardware_concurrency(), EpollTCPServer::BACKEND_IO_URING);
     s.set_callback_on_recv(recv_cb);
     s.set_callback_on_conn(conn_cb);
+    // keep each event loop on its own CPU, named for profilers
+    s.set_loop_placement(ThreadPlacement(ThreadPlacement::PER_CPU, {}, "epoll-loop"));
     s.set_callback_on_disconn(disconn_cb);
+    s.set_callback_on_high_watermark(high_watermark_cb);
+    s.set_callback_on_low_watermark(low_watermark_cb);
+    // broadcasts to a client above the high watermark replace its queued ones, it only gets the latest
+    s.set_broadcast_policy(EpollTCPServer::BROADCAST_COALESCE);
+    // one recv callback per burst instead of one per read
+    s.set_recv_batch(true);
+    // clients silent for 10 minutes are dropped
+    s.set_callback_on_timeout(timeout_cb);
+    s.set_idle_timeout(10 * 60 * 1000);
     s.start();
 
     thread t(send_msg, ref(s));
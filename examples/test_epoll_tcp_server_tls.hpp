@@ -63,6 +63,11 @@ void send_msg(EpollTCPServer &s)
             s.start();
             cout << "started" << endl;
         }
+        else if (input == "stats")
+        {
+            // clients, and full vs resumed handshakes
+            cout << s;
+        }
         else if (input == "shutdown")
         {
             s.stop();
@@ -96,6 +101,14 @@ int main(int argc, char *argv[])
     s.set_callback_on_conn(conn_cb);
     s.set_callback_on_disconn(disconn_cb);
     s.set_crt_key("/workspace/crt/server.crt", "/workspace/crt/server.key");
+    // tickets rotated every 10 minutes, resumption also for clients without ticket support
+    s.set_session_tickets(true, 600);
+    s.set_session_cache(10000);
+    // at most 2 handshake threads and 256 connections in handshake, more wait in the listen backlog
+    s.set_handshake_limit(2, 256, EpollTCPServer::HANDSHAKE_DEFER);
+    s.set_handshake_timeout(5000);
+    // record crypto in the kernel if the tls module is loaded, user space otherwise
+    s.set_ktls(true);
     s.start();
 
     thread t(send_msg, ref(s));
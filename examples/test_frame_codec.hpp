@@ -0,0 +1,67 @@
+#include <iostream>
+#include <thread>
+#include "../src/network/frame_codec.hpp"
+#include "../src/network/epoll_tcp_server.hpp"
+
+using namespace std;
+using namespace soda;
+
+// encode messages into one stream, then feed it in small pieces as reads would arrive
+void split_stream(shared_ptr<const FrameCodec> codec, const vector<string> &msgs, size_t piece)
+{
+    string stream;
+    for (auto &&msg : msgs)
+    {
+        uint8_t header[FrameCodec::MAX_HEADER_SIZE];
+        iovec iov[3];
+        int cnt = codec->encode(msg.data(), msg.size(), header, iov);
+        for (int i = 0; i < cnt; ++i)
+        {
+            stream.append(reinterpret_cast<const char *>(iov[i].iov_base), iov[i].iov_len);
+        }
+    }
+
+    FrameReceiver receiver(codec);
+    for (size_t pos = 0; pos < stream.size(); pos += piece)
+    {
+        receiver.feed(3, "127.0.0.1", 10001, stream.data() + pos, min(piece, stream.size() - pos), [](const Frame *frames, size_t frame_size)
+                      {
+            cout << "batch of " << frame_size << ":";
+            for (size_t i = 0; i < frame_size; ++i)
+            {
+                cout << " [" << string(reinterpret_cast<const char *>(frames[i].data), frames[i].size) << "]";
+            }
+            cout << endl; });
+    }
+}
+
+int main()
+{
+    vector<string> msgs{"hello", "", "frames split across reads", string(130, 'x'), "bye"};
+    split_stream(make_shared<LengthCodec>(LengthCodec::VARINT), msgs, 3);
+    split_stream(make_shared<LengthCodec>(LengthCodec::U16), msgs, 64);
+    split_stream(make_shared<DelimiterCodec>("\r\n"), msgs, 7);
+
+    // line protocol server, try with telnet: every complete line is echoed, lines of one read come in one batch
+    shared_ptr<const FrameCodec> codec = make_shared<DelimiterCodec>("\r\n", 1024);
+    shared_ptr<FrameReceiver> receiver = make_shared<FrameReceiver>(codec);
+    EpollTCPServer s("0.0.0.0", 10001, 2);
+    s.set_callback_on_recv(FrameReceiver::recv_callback<EpollTCPServer>(receiver, [codec](EpollTCPServer &s, int32_t fd, const string &addr, uint16_t port, const Frame *frames, size_t frame_size)
+                                                                        {
+        for (size_t i = 0; i < frame_size; ++i)
+        {
+            uint8_t header[FrameCodec::MAX_HEADER_SIZE];
+            iovec iov[3];
+            int cnt = codec->encode(frames[i].data, frames[i].size, header, iov);
+            s.sendv(fd, iov, cnt);
+        } }));
+    s.set_callback_on_conn([receiver](EpollTCPServer &s, int32_t fd, const string &addr, uint16_t port)
+                           { receiver->reset(fd); });
+    s.start();
+
+    while (1)
+    {
+        this_thread::sleep_for(chrono::seconds(10));
+    }
+    return 0;
+}
@@ -1,5 +1,6 @@
 
 #include <iostream>
+#include <unistd.h>
 #include "../src/buffer/ring_buffer.hpp"
 
 using namespace std;
@@ -39,5 +40,44 @@ int main()
     cout << rb << endl;
     rb.write(arr, 5);
     cout << rb << endl;
+
+    // zero copy: readv into the ring, parse in place, writev out of the ring
+    RingBuffer zrb{16};
+    int fds[2];
+    pipe(fds);
+    const char msg[] = "hello, ring buffer";
+    write(fds[1], msg, sizeof(msg) - 1);
+
+    zrb.commit(10);
+    zrb.consume(10);
+    iovec iov[2];
+    int cnt = zrb.reserve_iov(iov);
+    ssize_t n = readv(fds[0], iov, cnt);
+    zrb.commit(n);
+    cout << zrb << "iovcnt: " << cnt << " readv: " << n << endl;
+
+    RingBufferSpans spans = zrb.peek();
+    cout << string(reinterpret_cast<char *>(spans.first), spans.first_size) << "|"
+         << string(reinterpret_cast<char *>(spans.second), spans.second_size) << endl;
+    zrb.consume(7);
+
+    cnt = zrb.peek_iov(iov);
+    n = writev(STDOUT_FILENO, iov, cnt);
+    zrb.consume(n);
+    cout << endl
+         << zrb << endl;
+
+    // mirrored: a message across the end is still one contiguous region
+    RingBuffer mrb{16, true};
+    cout << mrb << endl;
+    mrb.commit(mrb.free_size() - 4);
+    mrb.consume(mrb.size());
+    mrb.write(msg, sizeof(msg) - 1);
+    spans = mrb.peek();
+    cout << string(reinterpret_cast<char *>(spans.first), spans.first_size) << " second_size: " << spans.second_size << endl;
+    cout << mrb << endl;
+
+    close(fds[0]);
+    close(fds[1]);
     return 0;
 }
\ No newline at end of file
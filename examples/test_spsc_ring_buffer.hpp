@@ -0,0 +1,73 @@
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include "../src/buffer/atomic_ring_buffer.hpp"
+#include "../src/buffer/spsc_ring_buffer.hpp"
+
+using namespace std;
+using namespace soda;
+
+// one producer thread, one consumer thread, return GB/s
+template <typename RB>
+double bench(size_t capacity, size_t chunk, size_t total)
+{
+    RB rb(capacity);
+    vector<uint8_t> src(chunk, 'x');
+
+    auto start = chrono::steady_clock::now();
+    thread producer([&]
+                    {
+        size_t written = 0;
+        while (written < total)
+        {
+            if (0 == rb.write(src.data(), chunk))
+            {
+                this_thread::yield();
+                continue;
+            }
+            written += chunk;
+        } });
+
+    vector<uint8_t> dst(chunk);
+    size_t read = 0;
+    while (read < total)
+    {
+        size_t ret = rb.read(dst.data(), dst.size());
+        if (0 == ret)
+        {
+            this_thread::yield();
+        }
+        read += ret;
+    }
+    producer.join();
+
+    double sec = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return total / sec / (1024.0 * 1024 * 1024);
+}
+
+int main()
+{
+    // correctness: wrap around and partial read
+    SPSCRingBuffer rb{8};
+    int arr[]{1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    rb.write(arr, 6);
+    cout << rb << endl;
+    uint8_t r_arr[16];
+    cout << "read " << rb.read(r_arr, 4) << endl;
+    cout << "write " << rb.write(reinterpret_cast<uint8_t *>(arr) + 6, 6) << endl;
+    cout << rb << endl;
+    cout << "read " << rb.read(r_arr, 16) << endl;
+    cout << rb << endl;
+
+    const size_t capacity = 64 * 1024;
+    const size_t total = 1024 * 1024 * 1024;
+    for (size_t chunk : {64, 512, 4096})
+    {
+        cout << "chunk " << chunk << "B -"
+             << " mutex: " << bench<AtomicRingBuffer>(capacity, chunk, total) << " GB/s"
+             << " spsc: " << bench<SPSCRingBuffer>(capacity, chunk, total) << " GB/s"
+             << endl;
+    }
+    return 0;
+}
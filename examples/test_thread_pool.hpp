@@ -0,0 +1,241 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <functional>
+
+#include "../src/thread/thread_pool.hpp"
+
+using namespace std;
+using namespace soda;
+
+// count heap allocations of the whole process; not inlined, or gcc pairs malloc with operator delete and warns
+static atomic_size_t g_alloc_size(0);
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    g_alloc_size.fetch_add(1, memory_order_relaxed);
+    if (void *ptr = malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+// allocations per task in steady state, tasks inserted from outside and from inside workers
+void count_alloc(ThreadPool &tp, size_t task_size)
+{
+    atomic_size_t done(0);
+    auto insert = [&]
+    {
+        for (size_t i = 0; i < task_size; ++i)
+        {
+            tp.insert_task_normal([&done]
+                                  { done.fetch_add(1, memory_order_relaxed); });
+        }
+        tp.insert_task_normal([&tp, &done, task_size]
+                              {
+            for (size_t i = 0; i < task_size; ++i)
+            {
+                tp.insert_task_normal([&done]
+                                      { done.fetch_add(1, memory_order_relaxed); });
+            } });
+        while (done < task_size * 2)
+        {
+            this_thread::yield();
+        }
+        done = 0;
+    };
+
+    // warm up pools and queues
+    insert();
+    size_t before = g_alloc_size;
+    insert();
+    cout << "allocations per task: " << double(g_alloc_size - before) / (task_size * 2) << endl;
+}
+
+// tasks per second; tiny tasks inserted from outside the pool
+double bench_external(ThreadPool &tp, size_t task_size)
+{
+    atomic_size_t done(0);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < task_size; ++i)
+    {
+        tp.insert_task_normal([&done]
+                              { done.fetch_add(1, memory_order_relaxed); });
+    }
+    while (done < task_size)
+    {
+        this_thread::yield();
+    }
+    return task_size / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// tasks per second; every root task inserts its children from inside a worker
+double bench_spawn(ThreadPool &tp, size_t root_size, size_t child_size)
+{
+    atomic_size_t done(0);
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < root_size; ++i)
+    {
+        tp.insert_task_normal([&tp, &done, child_size]
+                              {
+            for (size_t j = 0; j < child_size; ++j)
+            {
+                tp.insert_task_normal([&done]
+                                      { done.fetch_add(1, memory_order_relaxed); });
+            } });
+    }
+    size_t task_size = root_size * child_size;
+    while (done < task_size)
+    {
+        this_thread::yield();
+    }
+    return task_size / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// tasks per second; the same tiny tasks inserted as one batch
+double bench_bulk(ThreadPool &tp, size_t task_size)
+{
+    atomic_size_t done(0);
+    vector<function<void()>> funcs(task_size, [&done]
+                                   { done.fetch_add(1, memory_order_relaxed); });
+    auto start = chrono::steady_clock::now();
+    tp.insert_tasks(make_move_iterator(funcs.begin()), make_move_iterator(funcs.end())).get();
+    return task_size / chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void wait_workers(ThreadPool &tp, size_t size)
+{
+    while (tp.size() < size)
+    {
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+int main()
+{
+    // priority: with one busy worker, HIGH runs before NORMAL before LOW
+    {
+        ThreadPool tp(1, 1, true);
+        wait_workers(tp, 1);
+        atomic_bool hold(true);
+        tp.insert_task_normal([&hold]
+                              { while (hold) this_thread::yield(); });
+        this_thread::sleep_for(chrono::milliseconds(10));
+        auto low = tp.insert_task_low([]
+                                      { cout << "LOW" << endl; });
+        auto normal = tp.insert_task_normal([]
+                                            { cout << "NORMAL" << endl; });
+        auto high = tp.insert_task_high([]
+                                        { cout << "HIGH" << endl; });
+        hold = false;
+        low.get();
+    }
+
+    // placement: workers pinned one per CPU, round robin across NUMA nodes, named for profilers
+    {
+        ThreadPlacement placement(ThreadPlacement::PER_CPU, {}, "soda-worker");
+        cout << "numa nodes: " << ThreadPlacement::numa_nodes().size()
+             << " cpu groups: " << placement.groups().size() << endl;
+        ThreadPool tp(2, 2, false, placement);
+        wait_workers(tp, 2);
+        vector<function<void()>> funcs(2, []
+                                       {
+            char name[16] = {};
+            pthread_getname_np(pthread_self(), name, sizeof(name));
+            cout << name << " on cpu " << sched_getcpu() << endl; });
+        tp.insert_tasks(funcs.begin(), funcs.end()).get();
+    }
+
+    // scaling: a burst grows the pool at once, idle workers are closed after the idle timeout
+    {
+        ThreadPool tp(1, 8);
+        tp.set_idle_timeout(200);
+        wait_workers(tp, 1);
+        auto start = chrono::steady_clock::now();
+        vector<function<void()>> funcs(8, []
+                                       { this_thread::sleep_for(chrono::milliseconds(50)); });
+        auto burst = tp.insert_tasks(funcs.begin(), funcs.end());
+        wait_workers(tp, 8);
+        cout << "grown to " << tp.size() << " in "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+        burst.get();
+        while (tp.size() > 1)
+        {
+            this_thread::sleep_for(chrono::milliseconds(10));
+        }
+        cout << "shrunk to " << tp.size() << " in "
+             << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+    }
+
+    {
+        ThreadPool global_tp(1, 1);
+        ThreadPool ws_tp(1, 1, true);
+        wait_workers(global_tp, 1);
+        wait_workers(ws_tp, 1);
+        count_alloc(global_tp, 10000);
+        count_alloc(ws_tp, 10000);
+    }
+
+    // bulk: one future for the whole batch, the first exception is reported
+    {
+        ThreadPool tp(4, 4);
+        wait_workers(tp, 4);
+        vector<size_t> values(100000, 1);
+        atomic_size_t sum(0);
+        tp.parallel_for(size_t(0), values.size(), size_t(1000), [&](size_t first, size_t last)
+                        {
+            size_t local = 0;
+            for (size_t i = first; i < last; ++i)
+            {
+                local += values[i];
+            }
+            sum += local; })
+            .get();
+        cout << "parallel_for sum: " << sum << endl;
+
+        vector<function<void()>> funcs{[] {}, []
+                                       { throw runtime_error("batch failed"); },
+                                       [] {}};
+        try
+        {
+            tp.insert_tasks(funcs.begin(), funcs.end()).get();
+        }
+        catch (const exception &e)
+        {
+            cout << "insert_tasks: " << e.what() << endl;
+        }
+    }
+
+    const size_t task_size = 200000;
+    for (size_t threads : {1, 2, 4, 8, 16, 32, 64})
+    {
+        ThreadPool global_tp(threads, threads);
+        ThreadPool ws_tp(threads, threads, true);
+        wait_workers(global_tp, threads);
+        wait_workers(ws_tp, threads);
+
+        cout << threads << " threads -"
+             << " external global: " << bench_external(global_tp, task_size)
+             << " ws: " << bench_external(ws_tp, task_size)
+             << " | spawn global: " << bench_spawn(global_tp, threads, task_size / threads)
+             << " ws: " << bench_spawn(ws_tp, threads, task_size / threads)
+             << " | bulk global: " << bench_bulk(global_tp, task_size)
+             << " ws: " << bench_bulk(ws_tp, task_size)
+             << " (tasks/s)" << endl;
+    }
+    return 0;
+}
@@ -32,6 +32,8 @@ int main(int argc, char *argv[])
 
     // UDPServer c("127.0.0.1", 10002);
     c.set_callback_on_recv(recv_cb);
+    // up to 64 datagrams per recvmmsg, GRO coalesced flows are split back before the callback
+    c.set_batch(64, 2048, true);
     c.start();
 
     while (1)
@@ -77,13 +77,14 @@ namespace soda
     // return the actual written length
     size_t AtomicRingBuffer::write(const void *src, size_t size)
     {
-        if (size > free_size())
+        std::lock_guard<std::mutex> lock(m_mtx);
+
+        // check under the same lock, free_size() would lock again and race with other writers
+        if (size > m_capacity - (m_write_pos - m_read_pos))
         {
             return 0;
         }
 
-        std::lock_guard<std::mutex> lock(m_mtx);
-
         // obtain the writable space at the tail. If the space at the tail is insufficient, twice write is required. The minimum value is the length of the first write
         size_t write_size = std::min(size, m_capacity - real_write_pos());
         // the write point may be behind the read point, write twice
@@ -99,15 +100,14 @@ namespace soda
     // return the actual read length
     size_t AtomicRingBuffer::read(void *dst, size_t size)
     {
-        if (empty())
-        {
-            return 0;
-        }
-
         std::lock_guard<std::mutex> lock(m_mtx);
 
         // total readable quantity first time
         size_t read_size_sum = std::min(size, m_write_pos - m_read_pos);
+        if (0 == read_size_sum)
+        {
+            return 0;
+        }
 
         // get the readable length of the tail. If it is insufficient, it needs to be read twice. The minimum value is the read length of the tail
         size_t read_size_tail = std::min(read_size_sum, m_capacity - real_read_pos());
@@ -116,7 +116,7 @@ namespace soda
 
         m_read_pos += read_size_sum;
 
-        return 0;
+        return read_size_sum;
     }
 
     bool AtomicRingBuffer::full() const
@@ -0,0 +1,134 @@
+#pragma once
+
+// buffer pool - slabs of 4 KiB up to 1 MiB in power of two classes, e.g. receive buffers borrowed for one read burst
+// a SizeClassPool whose thread caches and central list are limited in bytes per class
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "../general/util.hpp"
+#include "../general/pool_allocator.hpp"
+
+namespace soda
+{
+    struct BufferClasses
+    {
+        static const size_t MIN_BUFFER_SIZE = 4 * 1024;
+        static const size_t CLASS_SIZE = 9;
+        static const size_t MAX_SIZE = MIN_BUFFER_SIZE << (CLASS_SIZE - 1);
+        // bytes of one class kept by a thread cache / the central list, surplus is freed
+        static const size_t CACHE_BYTES = 1024 * 1024;
+        static const size_t CENTRAL_BYTES = 16 * 1024 * 1024;
+
+        static inline size_t class_of(size_t size);
+
+        static size_t size_of(size_t cls) { return MIN_BUFFER_SIZE << cls; }
+
+        static size_t batch_size(size_t cls) { return cache_size(cls) / 2; }
+
+        // at least 2 blocks of a class
+        static inline size_t cache_size(size_t cls);
+        static inline size_t central_size(size_t cls);
+    };
+
+    class BufferPool : public SizeClassPool<BufferClasses>
+    {
+    public:
+        static const size_t MIN_BUFFER_SIZE = BufferClasses::MIN_BUFFER_SIZE;
+        static const size_t MAX_BUFFER_SIZE = BufferClasses::MAX_SIZE;
+
+        // size rounded up to what allocate() gives
+        static size_t capacity_of(size_t size);
+    };
+
+    // a buffer from BufferPool, given back when destroyed
+    class PooledBuffer : Noncopyable
+    {
+    public:
+        PooledBuffer() : m_data(nullptr), m_capacity(0) {}
+
+        explicit PooledBuffer(size_t size) : m_data(nullptr), m_capacity(0) { reset(size); }
+
+        ~PooledBuffer() { reset(0); }
+
+        uint8_t *data() const { return m_data; }
+
+        size_t capacity() const { return m_capacity; }
+
+        // a new buffer of at least size bytes, 0 to give it back; contents are lost
+        void reset(size_t size);
+
+        // at least size bytes, the first keep bytes are copied over
+        void grow(size_t size, size_t keep);
+
+    private:
+        uint8_t *m_data;
+        size_t m_capacity;
+    };
+
+    inline size_t BufferClasses::class_of(size_t size)
+    {
+        size_t cls = 0;
+        while ((MIN_BUFFER_SIZE << cls) < size)
+        {
+            ++cls;
+        }
+        return cls;
+    }
+
+    inline size_t BufferClasses::cache_size(size_t cls)
+    {
+        size_t size = CACHE_BYTES / (MIN_BUFFER_SIZE << cls);
+        return size > 2 ? size : 2;
+    }
+
+    inline size_t BufferClasses::central_size(size_t cls)
+    {
+        size_t size = CENTRAL_BYTES / (MIN_BUFFER_SIZE << cls);
+        return size > 2 ? size : 2;
+    }
+
+    size_t BufferPool::capacity_of(size_t size)
+    {
+        if (size > MAX_BUFFER_SIZE)
+        {
+            return size;
+        }
+        return BufferClasses::size_of(BufferClasses::class_of(size));
+    }
+
+    void PooledBuffer::reset(size_t size)
+    {
+        if (m_data)
+        {
+            BufferPool::deallocate(m_data, m_capacity);
+            m_data = nullptr;
+            m_capacity = 0;
+        }
+        if (size > 0)
+        {
+            m_capacity = BufferPool::capacity_of(size);
+            m_data = reinterpret_cast<uint8_t *>(BufferPool::allocate(m_capacity));
+        }
+    }
+
+    void PooledBuffer::grow(size_t size, size_t keep)
+    {
+        if (size <= m_capacity)
+        {
+            return;
+        }
+
+        size_t capacity = BufferPool::capacity_of(size);
+        uint8_t *data = reinterpret_cast<uint8_t *>(BufferPool::allocate(capacity));
+        if (m_data)
+        {
+            memcpy(data, m_data, keep < m_capacity ? keep : m_capacity);
+            BufferPool::deallocate(m_data, m_capacity);
+        }
+        m_data = data;
+        m_capacity = capacity;
+    }
+
+} // namespace soda
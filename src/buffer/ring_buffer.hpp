@@ -1,18 +1,36 @@
 #pragma once
 
-// Ring buffer - heap memory, non-thread safe, default 16*1024BYTES
+// Ring buffer - heap memory or mirrored virtual memory, non-thread safe, default 16*1024BYTES
 
 #include <iostream>
 #include <cstring>
+#include <cstdint>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "../general/util.hpp"
 
 namespace soda
 {
+    // a region inside the ring; split in two segments if it crosses the end of the buffer, second_size is 0 otherwise
+    // always one segment for a mirrored ring
+    struct RingBufferSpans
+    {
+        uint8_t *first;
+        size_t first_size;
+        uint8_t *second;
+        size_t second_size;
+
+        size_t size() const { return first_size + second_size; }
+    };
+
     class RingBuffer : Noncopyable
     {
     public:
-        RingBuffer(size_t capacity = 16 * 1024);
+        // mirrored: map the same memory twice back-to-back so every region is contiguous; capacity is rounded up to page size.
+        // falls back to heap memory if mapping fails
+        RingBuffer(size_t capacity = 16 * 1024, bool mirrored = false);
         ~RingBuffer();
 
         // returns the number of bytes written
@@ -21,6 +39,24 @@ namespace soda
         // returns the number of bytes read
         size_t read(void *dst, size_t size);
 
+        // zero copy write: writable region of at most size bytes, fill it and then commit()
+        RingBufferSpans reserve(size_t size = SIZE_MAX);
+
+        // make the first size bytes of the reserved region readable; returns the number of bytes committed
+        size_t commit(size_t size);
+
+        // zero copy read: all readable bytes in place, parse them and then consume()
+        RingBufferSpans peek() const;
+
+        // drop size bytes from the readable region; returns the number of bytes consumed
+        size_t consume(size_t size);
+
+        // reserve() as iovec for readv/recvmsg; returns iovcnt, 0 if full
+        int reserve_iov(iovec *iov, size_t size = SIZE_MAX);
+
+        // peek() as iovec for writev/sendmsg; returns iovcnt, 0 if empty
+        int peek_iov(iovec *iov) const;
+
         bool full() const;
 
         bool empty() const;
@@ -29,11 +65,16 @@ namespace soda
 
         size_t free_size() const;
 
+        size_t capacity() const;
+
         void clear();
 
+        bool mirrored() const;
+
         friend std::ostream &operator<<(std::ostream &os, const RingBuffer &rb)
         {
             return os << "capacity: " << rb.m_capacity
+                      << " mirrored: " << rb.m_mirrored
                       << " free_size: " << rb.free_size()
                       << " r_pos: " << rb.real_read_pos()
                       << " w_pos: " << rb.real_write_pos()
@@ -46,17 +87,34 @@ namespace soda
         size_t m_write_pos;
         size_t m_read_pos;
         uint8_t *m_buffer;
+        // m_buffer is 2 * m_capacity of virtual memory, the second half maps the first
+        bool m_mirrored;
 
     private:
+        // -1 if failed
+        int init_mirror();
+
         inline size_t real_read_pos() const;
         inline size_t real_write_pos() const;
+
+        // region of size bytes starting at real position pos
+        inline RingBufferSpans get_spans(size_t pos, size_t size) const;
+
+        // returns iovcnt
+        static inline int to_iov(const RingBufferSpans &spans, iovec *iov);
     };
 
-    RingBuffer::RingBuffer(size_t capacity) : m_capacity(roundup_pow_of_two(capacity)),
-                                              m_write_pos(0),
-                                              m_read_pos(0),
-                                              m_buffer(new uint8_t[m_capacity]{0})
+    RingBuffer::RingBuffer(size_t capacity, bool mirrored) : m_capacity(roundup_pow_of_two(capacity)),
+                                                             m_write_pos(0),
+                                                             m_read_pos(0),
+                                                             m_buffer(nullptr),
+                                                             m_mirrored(false)
     {
+        if (!mirrored || -1 == init_mirror())
+        {
+            m_buffer = new uint8_t[m_capacity]{0};
+        }
+
         if (!m_buffer)
         {
             ERROR_PRINT("ringbuffer init failed");
@@ -65,13 +123,65 @@ namespace soda
 
     RingBuffer::~RingBuffer()
     {
-        if (m_buffer)
+        if (m_buffer && m_mirrored)
+        {
+            munmap(m_buffer, m_capacity * 2);
+            m_buffer = nullptr;
+        }
+        else if (m_buffer)
         {
             delete[] m_buffer;
             m_buffer = nullptr;
         }
     }
 
+    int RingBuffer::init_mirror()
+    {
+        // page size is 2^n, so the capacity stays 2^n
+        size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t capacity = std::max(m_capacity, page_size);
+
+        int fd = memfd_create("soda_ring_buffer", MFD_CLOEXEC);
+        if (-1 == fd)
+        {
+            perror("ringbuffer memfd_create failed");
+            return -1;
+        }
+        if (-1 == ftruncate(fd, capacity))
+        {
+            perror("ringbuffer ftruncate failed");
+            close(fd);
+            return -1;
+        }
+
+        // reserve 2 * capacity of address space, then map the same file into both halves
+        void *base = mmap(nullptr, capacity * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == base)
+        {
+            perror("ringbuffer mmap reserve failed");
+            close(fd);
+            return -1;
+        }
+
+        uint8_t *addr = reinterpret_cast<uint8_t *>(base);
+        if (MAP_FAILED == mmap(addr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) ||
+            MAP_FAILED == mmap(addr + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0))
+        {
+            perror("ringbuffer mmap mirror failed");
+            munmap(base, capacity * 2);
+            close(fd);
+            return -1;
+        }
+
+        // the mappings keep the memory alive
+        close(fd);
+
+        m_capacity = capacity;
+        m_buffer = addr;
+        m_mirrored = true;
+        return 0;
+    }
+
     // return the actual written length
     size_t RingBuffer::write(const void *src, size_t size)
     {
@@ -80,12 +190,10 @@ namespace soda
             return 0;
         }
 
-        // obtain the writable space at the tail. If the space at the tail is insufficient, twice write is required. The minimum value is the length of the first write
-        size_t write_size = std::min(size, m_capacity - real_write_pos());
-        // the write point may be behind the read point, write twice
-        memcpy(m_buffer + real_write_pos(), src, write_size);
-        // The second write, if not needed, the last parameter is 0
-        memcpy(m_buffer, reinterpret_cast<const uint8_t*>(src) + write_size, size - write_size);
+        // the write point may be behind the read point, write twice; the second write, if not needed, the last parameter is 0
+        RingBufferSpans spans = get_spans(real_write_pos(), size);
+        memcpy(spans.first, src, spans.first_size);
+        memcpy(spans.second, reinterpret_cast<const uint8_t *>(src) + spans.first_size, spans.second_size);
 
         m_write_pos += size;
 
@@ -100,17 +208,48 @@ namespace soda
             return 0;
         }
 
-        // total readable quantity first time
-        size_t read_size_sum = std::min(size, this->size());
+        // total readable quantity first time; if the tail is insufficient, it needs to be read twice
+        RingBufferSpans spans = get_spans(real_read_pos(), std::min(size, this->size()));
+        memcpy(dst, spans.first, spans.first_size);
+        memcpy(reinterpret_cast<uint8_t *>(dst) + spans.first_size, spans.second, spans.second_size);
+
+        m_read_pos += spans.size();
 
-        // get the readable length of the tail. If it is insufficient, it needs to be read twice. The minimum value is the read length of the tail
-        size_t read_size_tail = std::min(read_size_sum, m_capacity - real_read_pos());
-        memcpy(dst, m_buffer + real_read_pos(), read_size_tail);
-        memcpy(reinterpret_cast<uint8_t*>(dst) + read_size_tail, m_buffer, read_size_sum - read_size_tail);
+        return spans.size();
+    }
 
-        m_read_pos += read_size_sum;
+    RingBufferSpans RingBuffer::reserve(size_t size)
+    {
+        return get_spans(real_write_pos(), std::min(size, free_size()));
+    }
 
-        return 0;
+    size_t RingBuffer::commit(size_t size)
+    {
+        size = std::min(size, free_size());
+        m_write_pos += size;
+        return size;
+    }
+
+    RingBufferSpans RingBuffer::peek() const
+    {
+        return get_spans(real_read_pos(), size());
+    }
+
+    size_t RingBuffer::consume(size_t size)
+    {
+        size = std::min(size, this->size());
+        m_read_pos += size;
+        return size;
+    }
+
+    int RingBuffer::reserve_iov(iovec *iov, size_t size)
+    {
+        return to_iov(reserve(size), iov);
+    }
+
+    int RingBuffer::peek_iov(iovec *iov) const
+    {
+        return to_iov(peek(), iov);
     }
 
     bool RingBuffer::full() const
@@ -138,6 +277,16 @@ namespace soda
         m_read_pos = m_write_pos = 0;
     }
 
+    bool RingBuffer::mirrored() const
+    {
+        return m_mirrored;
+    }
+
+    size_t RingBuffer::capacity() const
+    {
+        return m_capacity;
+    }
+
     inline size_t RingBuffer::real_read_pos() const
     {
         return m_read_pos & (m_capacity - 1);
@@ -147,4 +296,35 @@ namespace soda
     {
         return m_write_pos & (m_capacity - 1);
     }
+
+    inline RingBufferSpans RingBuffer::get_spans(size_t pos, size_t size) const
+    {
+        if (m_mirrored)
+        {
+            // bytes past the end are the beginning of the buffer again
+            return {m_buffer + pos, size, m_buffer, 0};
+        }
+
+        // the tail part first, then the rest from the beginning of the buffer
+        size_t first_size = std::min(size, m_capacity - pos);
+        return {m_buffer + pos, first_size, m_buffer, size - first_size};
+    }
+
+    inline int RingBuffer::to_iov(const RingBufferSpans &spans, iovec *iov)
+    {
+        int cnt = 0;
+        if (spans.first_size)
+        {
+            iov[cnt].iov_base = spans.first;
+            iov[cnt].iov_len = spans.first_size;
+            ++cnt;
+        }
+        if (spans.second_size)
+        {
+            iov[cnt].iov_base = spans.second;
+            iov[cnt].iov_len = spans.second_size;
+            ++cnt;
+        }
+        return cnt;
+    }
 } // namespace soda
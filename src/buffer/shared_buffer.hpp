@@ -0,0 +1,54 @@
+#pragma once
+
+// Shared buffer - immutable bytes filled once and shared by reference count, e.g. one broadcast message queued on many connections
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <sys/uio.h>
+
+#include "../general/util.hpp"
+
+namespace soda
+{
+    class SharedBuffer : Noncopyable
+    {
+    public:
+        using ptr = std::shared_ptr<const SharedBuffer>;
+
+        SharedBuffer(const void *src, size_t size);
+
+        // the spans joined in order
+        SharedBuffer(const iovec *iov, int iovcnt);
+
+        static ptr make(const void *src, size_t size) { return std::make_shared<SharedBuffer>(src, size); }
+
+        static ptr make(const iovec *iov, int iovcnt) { return std::make_shared<SharedBuffer>(iov, iovcnt); }
+
+        const uint8_t *data() const { return m_data.data(); }
+
+        size_t size() const { return m_data.size(); }
+
+    private:
+        std::vector<uint8_t> m_data;
+    };
+
+    SharedBuffer::SharedBuffer(const void *src, size_t size) : m_data(reinterpret_cast<const uint8_t *>(src),
+                                                                      reinterpret_cast<const uint8_t *>(src) + size) {}
+
+    SharedBuffer::SharedBuffer(const iovec *iov, int iovcnt)
+    {
+        size_t size = 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            size += iov[i].iov_len;
+        }
+        m_data.reserve(size);
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            const uint8_t *base = reinterpret_cast<const uint8_t *>(iov[i].iov_base);
+            m_data.insert(m_data.end(), base, base + iov[i].iov_len);
+        }
+    }
+
+} // namespace soda
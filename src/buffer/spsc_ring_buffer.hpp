@@ -0,0 +1,187 @@
+#pragma once
+
+// Ring buffer - heap memory; lock free, single producer single consumer; default 16*1024 BYTES
+// ! ! ! write() must be called from one thread only, read() from one (other) thread only
+
+#include <iostream>
+#include <atomic>
+#include <cstring>
+
+#include "../general/util.hpp"
+
+namespace soda
+{
+    class SPSCRingBuffer : Noncopyable
+    {
+    public:
+        SPSCRingBuffer(size_t capacity = 16 * 1024);
+        ~SPSCRingBuffer();
+
+        // producer side; return the number of bytes written, 0 if there is not enough space
+        size_t write(const void *src, size_t size);
+
+        // consumer side; return the number of bytes read
+        size_t read(void *dst, size_t size);
+
+        bool full() const;
+
+        bool empty() const;
+
+        size_t size() const;
+
+        size_t free_size() const;
+
+        // not thread safe, only when neither producer nor consumer is running
+        void clear();
+
+        friend std::ostream &operator<<(std::ostream &os, const SPSCRingBuffer &rb)
+        {
+            return os << "capacity: " << rb.m_capacity
+                      << " free_size: " << rb.free_size()
+                      << " r_pos: " << rb.real_read_pos()
+                      << " w_pos: " << rb.real_write_pos()
+                      << std::endl;
+        }
+
+    private:
+        // padded so producer and consumer fields never share a cache line
+
+        // written by producer; read pos is cached so the consumer's line is touched only when the ring looks full
+        std::atomic_size_t m_write_pos;
+        size_t m_read_pos_cache;
+        uint8_t m_pad0[CACHE_LINE_SIZE - sizeof(std::atomic_size_t) - sizeof(size_t)];
+
+        // written by consumer; write pos is cached so the producer's line is touched only when the ring looks empty
+        std::atomic_size_t m_read_pos;
+        size_t m_write_pos_cache;
+        uint8_t m_pad1[CACHE_LINE_SIZE - sizeof(std::atomic_size_t) - sizeof(size_t)];
+
+        // capacity 2^n Bytes; read only after construction
+        size_t m_capacity;
+        uint8_t *m_buffer;
+
+    private:
+        inline size_t real_read_pos() const;
+        inline size_t real_write_pos() const;
+    };
+
+    SPSCRingBuffer::SPSCRingBuffer(size_t capacity) : m_write_pos(0),
+                                                      m_read_pos_cache(0),
+                                                      m_pad0{},
+                                                      m_read_pos(0),
+                                                      m_write_pos_cache(0),
+                                                      m_pad1{},
+                                                      m_capacity(roundup_pow_of_two(capacity)),
+                                                      m_buffer(new uint8_t[m_capacity]{0})
+    {
+        if (!m_buffer)
+        {
+            ERROR_PRINT("SPSCRingBuffer init failed");
+        }
+    }
+
+    SPSCRingBuffer::~SPSCRingBuffer()
+    {
+        if (m_buffer)
+        {
+            delete[] m_buffer;
+            m_buffer = nullptr;
+        }
+    }
+
+    // return the actual written length
+    size_t SPSCRingBuffer::write(const void *src, size_t size)
+    {
+        size_t w_pos = m_write_pos.load(std::memory_order_relaxed);
+        if (size > m_capacity - (w_pos - m_read_pos_cache))
+        {
+            // acquire pairs with the consumer's release, the bytes it freed are no longer read
+            m_read_pos_cache = m_read_pos.load(std::memory_order_acquire);
+            if (size > m_capacity - (w_pos - m_read_pos_cache))
+            {
+                return 0;
+            }
+        }
+
+        size_t real_w_pos = w_pos & (m_capacity - 1);
+        // obtain the writable space at the tail. If the space at the tail is insufficient, twice write is required
+        size_t write_size = std::min(size, m_capacity - real_w_pos);
+        memcpy(m_buffer + real_w_pos, src, write_size);
+        // The second write, if not needed, the last parameter is 0
+        memcpy(m_buffer, reinterpret_cast<const uint8_t *>(src) + write_size, size - write_size);
+
+        // publish the data to the consumer
+        m_write_pos.store(w_pos + size, std::memory_order_release);
+
+        return size;
+    }
+
+    // return the actual read length
+    size_t SPSCRingBuffer::read(void *dst, size_t size)
+    {
+        size_t r_pos = m_read_pos.load(std::memory_order_relaxed);
+        if (size > m_write_pos_cache - r_pos)
+        {
+            // acquire pairs with the producer's release, the bytes it published are visible
+            m_write_pos_cache = m_write_pos.load(std::memory_order_acquire);
+            if (m_write_pos_cache == r_pos)
+            {
+                return 0;
+            }
+        }
+
+        // total readable quantity first time
+        size_t read_size_sum = std::min(size, m_write_pos_cache - r_pos);
+
+        size_t real_r_pos = r_pos & (m_capacity - 1);
+        // get the readable length of the tail. If it is insufficient, it needs to be read twice
+        size_t read_size_tail = std::min(read_size_sum, m_capacity - real_r_pos);
+        memcpy(dst, m_buffer + real_r_pos, read_size_tail);
+        memcpy(reinterpret_cast<uint8_t *>(dst) + read_size_tail, m_buffer, read_size_sum - read_size_tail);
+
+        // hand the space back to the producer
+        m_read_pos.store(r_pos + read_size_sum, std::memory_order_release);
+
+        return read_size_sum;
+    }
+
+    bool SPSCRingBuffer::full() const
+    {
+        return 0 == free_size();
+    }
+
+    bool SPSCRingBuffer::empty() const
+    {
+        return 0 == size();
+    }
+
+    // a snapshot, exact only when called from producer or consumer
+    size_t SPSCRingBuffer::size() const
+    {
+        size_t r_pos = m_read_pos.load(std::memory_order_acquire);
+        size_t w_pos = m_write_pos.load(std::memory_order_acquire);
+        return w_pos - r_pos;
+    }
+
+    size_t SPSCRingBuffer::free_size() const
+    {
+        return m_capacity - size();
+    }
+
+    void SPSCRingBuffer::clear()
+    {
+        m_read_pos.store(0, std::memory_order_relaxed);
+        m_write_pos.store(0, std::memory_order_relaxed);
+        m_read_pos_cache = m_write_pos_cache = 0;
+    }
+
+    inline size_t SPSCRingBuffer::real_read_pos() const
+    {
+        return m_read_pos.load(std::memory_order_relaxed) & (m_capacity - 1);
+    }
+
+    inline size_t SPSCRingBuffer::real_write_pos() const
+    {
+        return m_write_pos.load(std::memory_order_relaxed) & (m_capacity - 1);
+    }
+} // namespace soda
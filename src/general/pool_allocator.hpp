@@ -0,0 +1,253 @@
+#pragma once
+
+// size class pool - thread local caches refilled/drained in batches from a central list, shared by SmallObjectPool and BufferPool
+// small object pool - size classes of 64 bytes up to 512 bytes
+// no allocation in steady state even if objects are freed on another thread than they were allocated on
+
+#include <mutex>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+#include "util.hpp"
+
+namespace soda
+{
+    // Classes gives CLASS_SIZE and MAX_SIZE, class_of(size) for 0 < size <= MAX_SIZE and per class:
+    // size_of - bytes of a block, batch_size - blocks moved between a thread cache and the central list at once,
+    // cache_size - blocks a thread cache keeps before handing over, central_size - blocks the central list keeps, surplus is freed
+    template <typename Classes>
+    class SizeClassPool : Noncopyable
+    {
+    public:
+        // the largest size served by the pool, larger ones go to operator new
+        static const size_t MAX_SIZE = Classes::MAX_SIZE;
+
+        static void *allocate(size_t size);
+
+        // size as given to allocate()
+        static void deallocate(void *ptr, size_t size);
+
+    private:
+        struct Block
+        {
+            Block *next;
+        };
+
+        struct FreeList
+        {
+            Block *head;
+            size_t size;
+        };
+
+        struct Central
+        {
+            FreeList lists[Classes::CLASS_SIZE];
+            std::mutex mtx;
+        };
+
+        struct ThreadCache
+        {
+            FreeList lists[Classes::CLASS_SIZE];
+
+            ThreadCache();
+            // give everything back so other threads can reuse it
+            ~ThreadCache();
+        };
+
+        // never destroyed, thread caches may be destroyed after static objects at exit
+        static Central &central();
+
+        static ThreadCache &thread_cache();
+
+        // blocks the central list of cls can still take
+        static size_t room_of(Central &c, size_t cls);
+
+        // move up to num blocks from src to dst
+        static void transfer(FreeList &src, FreeList &dst, size_t num);
+
+        static void release(FreeList &list, size_t num);
+    };
+
+    struct SmallObjectClasses
+    {
+        static const size_t SLOT_SIZE = 64;
+        static const size_t CLASS_SIZE = 8;
+        static const size_t MAX_SIZE = SLOT_SIZE * CLASS_SIZE;
+        static const size_t BATCH_SIZE = 32;
+
+        static size_t class_of(size_t size) { return (size + SLOT_SIZE - 1) / SLOT_SIZE - 1; }
+
+        static size_t size_of(size_t cls) { return (cls + 1) * SLOT_SIZE; }
+
+        static size_t batch_size(size_t) { return BATCH_SIZE; }
+
+        static size_t cache_size(size_t) { return BATCH_SIZE * 2 - 1; }
+
+        // small objects are kept for reuse, never freed
+        static size_t central_size(size_t) { return SIZE_MAX; }
+    };
+
+    using SmallObjectPool = SizeClassPool<SmallObjectClasses>;
+
+    template <typename Classes>
+    typename SizeClassPool<Classes>::Central &SizeClassPool<Classes>::central()
+    {
+        static Central *c = new Central{};
+        return *c;
+    }
+
+    template <typename Classes>
+    typename SizeClassPool<Classes>::ThreadCache &SizeClassPool<Classes>::thread_cache()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    template <typename Classes>
+    SizeClassPool<Classes>::ThreadCache::ThreadCache() : lists{} {}
+
+    template <typename Classes>
+    SizeClassPool<Classes>::ThreadCache::~ThreadCache()
+    {
+        Central &c = central();
+        std::lock_guard<std::mutex> lock(c.mtx);
+        for (size_t i = 0; i < Classes::CLASS_SIZE; ++i)
+        {
+            transfer(lists[i], c.lists[i], room_of(c, i));
+            release(lists[i], lists[i].size);
+        }
+    }
+
+    template <typename Classes>
+    size_t SizeClassPool<Classes>::room_of(Central &c, size_t cls)
+    {
+        size_t size = Classes::central_size(cls);
+        return size > c.lists[cls].size ? size - c.lists[cls].size : 0;
+    }
+
+    template <typename Classes>
+    void SizeClassPool<Classes>::transfer(FreeList &src, FreeList &dst, size_t num)
+    {
+        for (size_t i = 0; i < num && src.head; ++i)
+        {
+            Block *block = src.head;
+            src.head = block->next;
+            --src.size;
+            block->next = dst.head;
+            dst.head = block;
+            ++dst.size;
+        }
+    }
+
+    template <typename Classes>
+    void SizeClassPool<Classes>::release(FreeList &list, size_t num)
+    {
+        for (size_t i = 0; i < num && list.head; ++i)
+        {
+            Block *block = list.head;
+            list.head = block->next;
+            --list.size;
+            ::operator delete(block);
+        }
+    }
+
+    template <typename Classes>
+    void *SizeClassPool<Classes>::allocate(size_t size)
+    {
+        if (0 == size || size > Classes::MAX_SIZE)
+        {
+            return ::operator new(size);
+        }
+
+        size_t cls = Classes::class_of(size);
+        FreeList &list = thread_cache().lists[cls];
+        if (!list.head)
+        {
+            Central &c = central();
+            std::lock_guard<std::mutex> lock(c.mtx);
+            transfer(c.lists[cls], list, Classes::batch_size(cls));
+        }
+
+        if (!list.head)
+        {
+            return ::operator new(Classes::size_of(cls));
+        }
+
+        Block *block = list.head;
+        list.head = block->next;
+        --list.size;
+        return block;
+    }
+
+    template <typename Classes>
+    void SizeClassPool<Classes>::deallocate(void *ptr, size_t size)
+    {
+        if (!ptr)
+        {
+            return;
+        }
+
+        if (0 == size || size > Classes::MAX_SIZE)
+        {
+            ::operator delete(ptr);
+            return;
+        }
+
+        size_t cls = Classes::class_of(size);
+        FreeList &list = thread_cache().lists[cls];
+        Block *block = reinterpret_cast<Block *>(ptr);
+        block->next = list.head;
+        list.head = block;
+        ++list.size;
+
+        // a thread that frees more than it allocates hands the surplus over, what the central list cannot keep is freed
+        if (list.size > Classes::cache_size(cls))
+        {
+            size_t num = Classes::batch_size(cls);
+            Central &c = central();
+            std::lock_guard<std::mutex> lock(c.mtx);
+            size_t room = room_of(c, cls);
+            transfer(list, c.lists[cls], num < room ? num : room);
+            if (list.size > Classes::cache_size(cls))
+            {
+                release(list, list.size - num);
+            }
+        }
+    }
+
+    // stateless allocator on top of SmallObjectPool, e.g. for std::promise shared states
+    template <typename T>
+    struct PoolAllocator
+    {
+        using value_type = T;
+
+        PoolAllocator() noexcept {}
+
+        template <typename U>
+        PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+        template <typename U>
+        struct rebind
+        {
+            using other = PoolAllocator<U>;
+        };
+
+        T *allocate(size_t n)
+        {
+            return static_cast<T *>(SmallObjectPool::allocate(n * sizeof(T)));
+        }
+
+        void deallocate(T *ptr, size_t n)
+        {
+            SmallObjectPool::deallocate(ptr, n * sizeof(T));
+        }
+    };
+
+    template <typename T, typename U>
+    bool operator==(const PoolAllocator<T> &, const PoolAllocator<U> &) { return true; }
+
+    template <typename T, typename U>
+    bool operator!=(const PoolAllocator<T> &, const PoolAllocator<U> &) { return false; }
+
+} // namespace soda
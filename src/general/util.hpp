@@ -49,6 +49,9 @@
 
 namespace soda
 {
+    // Bytes, keep independently written atomics on separate lines to avoid false sharing
+    constexpr size_t CACHE_LINE_SIZE = 64;
+
     // whether it is a power of 2
     bool is_pow_of_two(uint64_t num)
     {
@@ -3,6 +3,8 @@
 
 // #include "../examples/test_atomic_ring_buffer.hpp"
 
+// #include "../examples/test_spsc_ring_buffer.hpp"
+
 // #include "../examples/test_ring_buffer.hpp"
 
 // #include "../examples/test_select_tcp_server.hpp"
@@ -13,6 +15,8 @@
 
 // #include "../examples/test_epoll_tcp_server_tls.hpp"
 
+// #include "../examples/test_frame_codec.hpp"
+
 // #include "../examples/test_tcp_server.hpp"
 
 // #include "../examples/test_tcp_client.hpp"
@@ -29,3 +33,5 @@
 
 // #include "../examples/test_simple_thread_pool.hpp"
 
+// #include "../examples/test_thread_pool.hpp"
+
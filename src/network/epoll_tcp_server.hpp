@@ -1,18 +1,93 @@
 #pragma once
 
 // epoll TCP server - multi-threading event processing; callback processes conn, msg, disconn; non-blocking IO; IPv4/IPv6
+// default: one loop dispatches events to a thread pool; multi reactor: N loops each with its own SO_REUSEPORT listener,
+// Epoller and connections, callbacks run on the loop owning the connection
+// send() never blocks: what the socket does not take is kept in the connection's output buffer and flushed on EPOLLOUT
+// scatter lists go out with one sendmsg; send_zerocopy() lends large buffers to the kernel with MSG_ZEROCOPY
+// broadcast: one shared buffer is queued on every connection by the loop owning it, slow consumers follow BroadcastPolicy
+// receive: a pooled buffer sized from the connection's recent reads plus a stack spill, filled by readv
+// io_uring backend for the loops: multishot accept and recv into a provided buffer ring, sends stay direct, a oneshot
+// poll replaces EPOLLOUT; epoll is used where the kernel lacks it
+// timeouts: idle and read/write deadlines on a timer wheel per loop, the epoll_wait timeout drives it; reads and writes only
+// store a time, the one timer of a connection rechecks when it fires
 
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <poll.h>
 
 #include "socket_util.hpp"
 #include "epoller.hpp"
+#include "timer_wheel.hpp"
+#include "io_uring.hpp"
+#include "../buffer/ring_buffer.hpp"
+#include "../buffer/shared_buffer.hpp"
+#include "../buffer/buffer_pool.hpp"
 #include "../thread/thread_pool.hpp"
 
 namespace soda
 {
     class EpollTCPServer
     {
+    public:
+        enum TimeoutType
+        {
+            // nothing read or written for the idle timeout
+            IDLE_TIMEOUT,
+            // no data before the read deadline
+            READ_TIMEOUT,
+            // output still pending at the write deadline
+            WRITE_TIMEOUT
+        };
+
+        enum EventBackend
+        {
+            BACKEND_EPOLL,
+            // completions instead of readiness: no epoll_wait, recv and rearm per read
+            BACKEND_IO_URING
+        };
+
+    private:
+        // initial output buffer, doubled as needed
+        static const size_t OUTPUT_BUFFER_SIZE = 16 * 1024;
+        static const size_t DEFAULT_HIGH_WATERMARK = 4 * 1024 * 1024;
+        static const size_t DEFAULT_LOW_WATERMARK = 1024 * 1024;
+        static const size_t DEFAULT_OUTPUT_LIMIT = 64 * 1024 * 1024;
+        // spans passed to one sendmsg
+        static const int SEND_IOV_SIZE = 64;
+        // connections per broadcast task in the thread pool mode
+        static const size_t BROADCAST_GRAIN = 64;
+        // second readv span on the stack, taken over into a larger buffer when used
+        static const size_t RECV_SPILL_SIZE = 64 * 1024;
+        // a batched recv callback gets at most this much
+        static const size_t RECV_BATCH_LIMIT = BufferPool::MAX_BUFFER_SIZE;
+        // below this, pinning pages and the completion cost more than copying
+        static const size_t ZEROCOPY_MIN_SIZE = 16 * 1024;
+        // ms; a closed connection with lent buffers keeps its fd, checked this often for the completions,
+        // reset once the timeout passes
+        static const uint64_t ZEROCOPY_LINGER_INTERVAL = 10;
+        static const uint64_t ZEROCOPY_LINGER_TIMEOUT = 10000;
+        // provided receive buffers of an io_uring loop, shared by its connections and given back after each callback
+        static const uint16_t URING_BUFFER_COUNT = 256;
+        static const uint32_t URING_BUFFER_SIZE = 16 * 1024;
+        static const uint16_t URING_BUFFER_GROUP = 0;
+
+        // what an io_uring completion is for, the low byte of its user_data
+        enum UringOp
+        {
+            URING_ACCEPT,
+            URING_WAKEUP,
+            URING_RECV,
+            URING_POLLOUT,
+            // cancelling the requests of a closed connection
+            URING_CANCEL
+        };
+
         // callback for conn /source, addr, port
         using conn_cb_t = std::function<void(EpollTCPServer &s, int32_t fd, const std::string &addr, uint16_t port)>;
 
@@ -27,51 +102,266 @@ namespace soda
         // callback for disconn /source, addr, port
         using disconn_cb_t = std::function<void(EpollTCPServer &s, const std::string &addr, uint16_t port)>;
 
+        // callback for output buffer watermarks /source, fd, buffered size
+        using watermark_cb_t = std::function<void(EpollTCPServer &s, int32_t fd, size_t buffered)>;
+
+        // callback before a connection is closed on timeout /source, fd, which one expired
+        using timeout_cb_t = std::function<void(EpollTCPServer &s, int32_t fd, TimeoutType type)>;
+
+        // called when the buffer lent to send_zerocopy() may be reused
+        using zerocopy_done_t = std::function<void()>;
+
         using conn_info_ptr = SocketUtil::conn_info_ptr;
 
+        // a shared buffer queued after pos bytes of the ring were written, sent from offset on
+        struct SharedSegment
+        {
+            SharedBuffer::ptr buffer;
+            size_t offset;
+            uint64_t pos;
+            // of the broadcast, for the sendmsg carrying it
+            int flags;
+        };
+
+        struct EventLoop;
+
+        struct Connection : Noncopyable
+        {
+            int32_t fd;
+            std::string addr;
+            uint16_t port;
+            // guards the output, sends and flushes of one connection are serialized
+            std::mutex mtx;
+            // nullptr until something has to wait
+            std::unique_ptr<RingBuffer> output;
+            // bytes ever written to / sent from the ring, positions the shared segments in the stream
+            uint64_t output_in;
+            uint64_t output_out;
+            // broadcasts waiting, referenced instead of copied
+            std::deque<SharedSegment> shared_output;
+            size_t shared_size;
+            // high watermark reported, low not yet
+            bool above_high;
+            // thread pool mode: process() runs, it rearms the fd when done; set and cleared by it, mtx held
+            bool busy;
+            // thread pool mode: events that came while busy, the running process() takes them over
+            uint32_t missed_events;
+            // 0 not asked yet, 1 SO_ZEROCOPY on, -1 unavailable or the kernel copies anyway
+            int zerocopy;
+            // number the kernel gives to the next MSG_ZEROCOPY send
+            uint32_t zerocopy_next;
+            // last send number of each lent buffer, in order
+            std::deque<std::pair<uint32_t, zerocopy_done_t>> zerocopy_pending;
+            // closed with lent buffers: the fd is closed by then at the latest
+            uint64_t linger_until;
+            // receive buffer size for the next read, follows the sizes seen; only the reading thread uses it
+            size_t recv_hint;
+            // the wheel of the loop owning it, times are its now()
+            TimerWheel *timers;
+            // last read or write progress
+            std::atomic<uint64_t> last_active;
+            // 0 for none; cleared when data comes / the output drains
+            std::atomic<uint64_t> read_deadline;
+            std::atomic<uint64_t> write_deadline;
+            // the timer for the earliest of them and when it fires, mtx held; 0 for none
+            TimerWheel::timer_id timer;
+            uint64_t timer_at;
+            // multi reactor: the owning loop; io_uring tells this connection from an earlier one on the same fd by gen
+            EventLoop *loop;
+            uint32_t gen;
+            // io_uring: a POLLOUT request is pending or posted, mtx held
+            bool pollout;
+
+            explicit Connection(const ConnInfo &info) : fd(info.fd),
+                                                        addr(info.addr),
+                                                        port(info.port),
+                                                        output_in(0),
+                                                        output_out(0),
+                                                        shared_size(0),
+                                                        above_high(false),
+                                                        busy(false),
+                                                        missed_events(0),
+                                                        zerocopy(0),
+                                                        zerocopy_next(0),
+                                                        linger_until(0),
+                                                        recv_hint(BufferPool::MIN_BUFFER_SIZE),
+                                                        timers(nullptr),
+                                                        last_active(0),
+                                                        read_deadline(0),
+                                                        write_deadline(0),
+                                                        timer(0),
+                                                        timer_at(0),
+                                                        loop(nullptr),
+                                                        gen(0),
+                                                        pollout(false) {}
+
+            // bytes waiting, copied and shared
+            size_t buffered() const { return (output ? output->size() : 0) + shared_size; }
+        };
+
+        using conn_ptr = std::shared_ptr<Connection>;
+
+        // multi reactor
+        struct EventLoop : Noncopyable
+        {
+            const EpollTCPServer *owner;
+            size_t index;
+            SocketUtil socket;
+            int32_t sockfd;
+            Epoller epoller;
+            TimerWheel timers;
+            // connections owned by this loop, locked for sends and closes from other threads
+            std::unordered_map<int32_t, conn_ptr> conns;
+            std::mutex mtx;
+            std::thread thread;
+            // run by the loop thread after a wakeup, e.g. broadcasts
+            std::vector<std::function<void()>> posted;
+            // nullptr for epoll; only the loop thread uses it
+            std::unique_ptr<IOUring> uring;
+            uint32_t next_gen;
+
+            EventLoop(const EpollTCPServer *server, size_t idx, const std::string &addr, uint16_t port) : owner(server),
+                                                                                                         index(idx),
+                                                                                                         socket(addr, port, SOCK_STREAM, 0),
+                                                                                                         sockfd(-1),
+                                                                                                         next_gen(0) {}
+        };
+
     private:
         SocketUtil m_socket;
         int32_t m_sockfd;
         ThreadPool m_tp;
         Epoller m_epoller;
-        std::unordered_map<int32_t, conn_info_ptr> m_conns;
+        // thread pool mode, driven by listen()
+        TimerWheel m_timers;
+        std::unordered_map<int32_t, conn_ptr> m_conns;
         std::mutex m_mtx;
+        // closed, their fds wait for the kernel to give lent buffers back; taken before a conn.mtx
+        std::unordered_set<conn_ptr> m_lingering;
+        std::mutex m_linger_mtx;
         conn_cb_t m_callback_on_conn;
         recv_cb_t m_callback_on_recv;
         disconn_cb_t m_callback_on_disconn;
+        watermark_cb_t m_callback_on_high_watermark;
+        watermark_cb_t m_callback_on_low_watermark;
+        timeout_cb_t m_callback_on_timeout;
+        size_t m_high_watermark;
+        size_t m_low_watermark;
+        size_t m_output_limit;
+        std::atomic<int> m_broadcast_policy;
+        std::atomic_bool m_recv_batch;
+        // ms, 0 for none
+        std::atomic<uint64_t> m_idle_timeout;
 
         std::atomic_bool m_stop;
+        ThreadPlacement m_loop_placement;
+
+        std::string m_addr;
+        uint16_t m_port;
+        // 0 for the thread pool mode
+        size_t m_loop_size;
+        std::vector<std::unique_ptr<EventLoop>> m_loops;
+        EventBackend m_backend;
 
     public:
-        EpollTCPServer(const std::string &addr, uint16_t port);
+        // what a broadcast does to a connection above the high watermark
+        enum BroadcastPolicy
+        {
+            // queue it anyway, up to the output limit
+            BROADCAST_QUEUE,
+            // skip the message for this connection
+            BROADCAST_DROP,
+            // replace the queued broadcasts not started yet, only the latest is kept
+            BROADCAST_COALESCE,
+            // disconnect the slow consumer
+            BROADCAST_CLOSE
+        };
+
+        // loop_size: 0 to dispatch events to a thread pool, otherwise the number of event loop threads
+        // backend: what the loops wait with; io_uring needs loops and linux 6.0, else epoll is used
+        EpollTCPServer(const std::string &addr, uint16_t port, size_t loop_size = 0, EventBackend backend = BACKEND_EPOLL);
         ~EpollTCPServer();
 
         void set_callback_on_conn(conn_cb_t cb);
         void set_callback_on_recv(recv_cb_t cb);
         void set_callback_on_disconn(disconn_cb_t cb);
 
+        // output of a connection grew to high watermark, stop producing for it
+        void set_callback_on_high_watermark(watermark_cb_t cb);
+        // output fell to low watermark after a high one, resume producing
+        void set_callback_on_low_watermark(watermark_cb_t cb);
+
+        // bytes; low < high
+        void set_output_watermark(size_t high, size_t low);
+
+        // bytes; send() fails instead of buffering more than this for one connection
+        void set_output_limit(size_t size);
+
+        // default BROADCAST_QUEUE
+        void set_broadcast_policy(BroadcastPolicy policy);
+
+        void set_callback_on_timeout(timeout_cb_t cb);
+
+        // ms without reads or writes before a connection is closed, 0 (default) for never; for connections accepted later
+        void set_idle_timeout(uint64_t ms);
+
+        // close fd unless data comes within ms, 0 to clear; -1 if fd does not exist
+        int set_read_deadline(int32_t fd, uint64_t ms);
+
+        // close fd if output is still pending after ms, 0 to clear; -1 if fd does not exist
+        int set_write_deadline(int32_t fd, uint64_t ms);
+
+        // false (default): a recv callback per readv; true: read until EAGAIN and pass the burst in one callback, cut at about 1 MiB
+        // io_uring loops always give one callback per filled provided buffer
+        void set_recv_batch(bool batch);
+
+        // affinity and name of the event loop threads (loop n is the n-th), takes effect on the next start()
+        void set_loop_placement(const ThreadPlacement &placement);
+
         // start service
         // return -1 on failure
         int start();
 
         void stop();
 
-        // -1 if failed; the amount of data sent, and will retry to send all the data
+        // -1 if failed or the output limit is exceeded; size on success, what the socket does not take now is buffered
+        // exceeding the limit after part of the message was sent closes the connection
+        // flags only apply to the part sent at once
         int send(uint32_t fd, const void *src, size_t size, int flags = 0);
 
-        // -1 if failed; the amount of data sent, and will retry to send all the data
+        // send() of a scatter list, e.g. header and body, with one syscall
+        int sendv(uint32_t fd, const iovec *iov, int iovcnt, int flags = 0);
+
+        // -1 if failed; size on success; src must stay unchanged until done() is called:
+        // once the kernel has sent it, at once if it was copied instead (small, behind buffered output, unsupported);
+        // a close keeps the fd until then, a peer not taking the data for ZEROCOPY_LINGER_TIMEOUT gets a reset
+        int send_zerocopy(uint32_t fd, const void *src, size_t size, zerocopy_done_t done);
+
+        // -1 if failed; the amount of data sent, short if buffered output is pending or the socket is full:
+        // the low watermark callback tells when to go on; short without it if srcfd ends first
         int sendfile(uint32_t dstfd, uint32_t srcfd, off_t *offset, size_t size);
 
-        // send message to all clients
+        // bytes waiting in the output buffer of fd
+        size_t output_size(int32_t fd);
+
+        // send message to all clients; copied once and shared, queued in order with send() and written by the loops or the pool
+        // flags go with the sendmsg that carries the message
         void send_to_all(const void *src, size_t size, int flags = 0);
 
-        friend std::ostream &operator<<(std::ostream &os, const EpollTCPServer &s)
+        // send_to_all() of a buffer built once, e.g. reused for several broadcasts
+        void broadcast(const SharedBuffer::ptr &buffer, int flags = 0);
+
+        size_t conn_size();
+
+        friend std::ostream &operator<<(std::ostream &os, EpollTCPServer &s)
         {
-            return os << "clients: " << s.m_conns.size()
+            return os << "clients: " << s.conn_size()
+                      << " loops: " << s.m_loop_size
                       << " running " << !s.m_stop
                       << std::endl;
         }
 
+        // multi reactor: done by the loop owning fd, after this returns if called from another thread
         void close(int32_t fd);
 
     private:
@@ -80,12 +370,145 @@ namespace soda
         void accept();
         void recv(int32_t fd);
 
+        // thread pool mode: flush on EPOLLOUT, recv on EPOLLIN, then rearm the oneshot fd
+        void process(int32_t fd, uint32_t events);
+
+        // -1 if failed or closed by the peer; reads until EAGAIN if until_eagain, else until a short read
+        int read_input(const conn_ptr &conn, bool until_eagain);
+
         // nullptr if not exists
-        conn_info_ptr get_conn(int32_t fd);
+        conn_ptr get_conn(int32_t fd);
+
+        // output, conn.mtx held
+
+        // -1 if failed; write buffered output until empty or the socket is full
+        int flush_output(Connection &conn);
+
+        // -1 if the output limit is exceeded
+        int append_output(Connection &conn, const void *src, size_t size);
+
+        // -1 if the output limit is exceeded; the buffer is queued from offset on
+        int append_shared(Connection &conn, const SharedBuffer::ptr &buffer, size_t offset, int flags);
+
+        // sendmsg of the queued output in stream order; -1 if failed, 0 if the socket is full, else bytes sent
+        int send_output(Connection &conn);
+
+        // drop sent bytes from the front of the queued output
+        void consume_output(Connection &conn, size_t size);
+
+        // -1 if failed; the amount written before the socket got full
+        int write_iov(Connection &conn, const iovec *iov, int iovcnt, size_t size, int flags);
+
+        // buffer iov after its first sent bytes; false if the output limit is exceeded, then nothing is buffered
+        bool buffer_iov(Connection &conn, const iovec *iov, int iovcnt, size_t size, size_t sent);
+
+        // after buffering: arm EPOLLOUT in the pool mode and report the high watermark, unlocks
+        void after_buffer(std::unique_lock<std::mutex> &lock, Connection &conn, bool was_empty);
+
+        // EPOLLERR: -1 if the socket failed, 0 if it only carried zerocopy completions
+        int handle_error(const conn_ptr &conn);
+
+        // conn.mtx held; the callbacks of lent buffers the kernel is done with go to done
+        // -1 if failed, else what the last recv_zerocopy() returned
+        int reap_zerocopy(Connection &conn, std::vector<zerocopy_done_t> &done);
+
+        // on close: close the fd, or shut it down and keep it until the kernel gives lent buffers back
+        void close_fd(const conn_ptr &conn, SocketUtil &socket);
+
+        // timer of a lingering connection
+        void check_linger(const conn_ptr &conn);
+
+        // on stop: close the lingering fds, their buffers are given back
+        void finish_lingering();
+
+        // timeouts
+
+        // make sure a timer fires by the earliest deadline of conn
+        void arm_timer(const conn_ptr &conn);
+
+        // on the thread driving the wheel: close conn if a deadline passed, else arm again
+        void on_timer(const conn_ptr &conn);
+
+        // report and close
+        void expire(const conn_ptr &conn, TimeoutType type);
+
+        // read or write progress
+        void touch(Connection &conn);
+
+        // queue a broadcast on one connection according to the policy; false if not queued
+        bool deliver(const conn_ptr &conn, const SharedBuffer::ptr &buffer, int flags);
+
+        // run fn on the loop thread
+        void post(EventLoop *loop, std::function<void()> fn);
+
+        void run_posted(EventLoop *loop);
+
+        // flush on EPOLLOUT, close on failure, report the low watermark
+        void handle_output(const conn_ptr &conn);
+
+        // multi reactor
+
+        // -1 if failed
+        int start_loops();
+
+        void stop_loops();
+
+        void loop_proc(EventLoop *loop);
+
+        void loop_accept(EventLoop *loop);
+
+        // take over an accepted connection
+        void loop_add(EventLoop *loop, const ConnInfo &info);
+
+        void loop_recv(EventLoop *loop, const conn_ptr &conn);
+
+        // from another thread the close is posted to the loop, it may be reading fd right now
+        void loop_close(EventLoop *loop, int32_t fd);
+
+        // loop thread, or the loops are stopped
+        void loop_close_now(EventLoop *loop, int32_t fd);
+
+        // nullptr if loop does not own fd
+        conn_ptr loop_conn(EventLoop *loop, int32_t fd);
+
+        // nullptr if no loop owns fd; the calling loop is checked first
+        EventLoop *find_loop(int32_t fd);
+
+        // the loop running on the calling thread
+        static EventLoop *&local_loop();
+
+        // io_uring
+
+        void uring_loop_proc(EventLoop *loop);
+
+        void uring_complete(EventLoop *loop, const io_uring_cqe &cqe);
+
+        void uring_recv(EventLoop *loop, const conn_ptr &conn, const io_uring_cqe &cqe);
+
+        // a oneshot POLLOUT for conn, loop thread only
+        void uring_poll_output(EventLoop *loop, const Connection &conn);
+
+        // nullptr if loop does not own fd or it is another connection than gen
+        conn_ptr uring_conn(EventLoop *loop, int32_t fd, uint32_t gen);
+
+        // user_data of a request: gen, fd, op
+        static uint64_t uring_data(UringOp op, int32_t fd, uint32_t gen);
     };
 
-    EpollTCPServer::conn_info_ptr EpollTCPServer::get_conn(int32_t fd)
+    EpollTCPServer::conn_ptr EpollTCPServer::get_conn(int32_t fd)
     {
+        if (m_loop_size > 0)
+        {
+            EventLoop *loop = find_loop(fd);
+            if (!loop)
+            {
+                return nullptr;
+            }
+            std::lock_guard<std::mutex> lock(loop->mtx);
+            auto conn_iter = loop->conns.find(fd);
+            return conn_iter == loop->conns.end() ? nullptr : conn_iter->second;
+        }
+
         std::lock_guard<std::mutex> lock(m_mtx);
 
         auto conn_iter = m_conns.find(fd);
@@ -96,10 +519,25 @@ namespace soda
         return conn_iter->second;
     }
 
-    EpollTCPServer::EpollTCPServer(const std::string &addr, uint16_t port) : m_socket(addr, port, SOCK_STREAM, 0),
-                                                                             m_sockfd(-1),
-                                                                             m_tp(2),
-                                                                             m_stop(true) {}
+    EpollTCPServer::EpollTCPServer(const std::string &addr, uint16_t port, size_t loop_size, EventBackend backend) : m_socket(addr, port, SOCK_STREAM, 0),
+                                                                                              m_sockfd(-1),
+                                                                                              // loops do not use the pool; otherwise listen() holds one worker for good
+                                                                                              m_tp(loop_size > 0 ? 0 : 2, std::max(2u, std::thread::hardware_concurrency())),
+                                                                                              m_high_watermark(DEFAULT_HIGH_WATERMARK),
+                                                                                              m_low_watermark(DEFAULT_LOW_WATERMARK),
+                                                                                              m_output_limit(DEFAULT_OUTPUT_LIMIT),
+                                                                                              m_broadcast_policy(BROADCAST_QUEUE),
+                                                                                              m_recv_batch(false),
+                                                                                              m_idle_timeout(0),
+                                                                                              m_stop(true),
+                                                                                              m_addr(addr),
+                                                                                              m_port(port),
+                                                                                              m_loop_size(loop_size),
+                                                                                              m_backend(loop_size > 0 ? backend : BACKEND_EPOLL)
+    {
+        // a timer due before the current epoll_wait ends cuts it short
+        m_timers.set_wakeup(std::bind(&Epoller::wakeup, &m_epoller));
+    }
 
     EpollTCPServer::~EpollTCPServer()
     {
@@ -108,9 +546,11 @@ namespace soda
 
     int EpollTCPServer::listen()
     {
+        // the loop borrows a pool thread, give it back as it was
+        ThreadPlacementGuard placement(m_loop_placement, 0);
         while (!m_stop)
         {
-            auto &&ret = m_epoller.check_once();
+            auto &&ret = m_epoller.check_once(m_timers.timeout());
             int size = std::get<0>(ret);
             if (size > 0)
             {
@@ -123,17 +563,18 @@ namespace soda
                     {
                         m_tp.insert_task_normal(std::bind(&EpollTCPServer::accept, this));
                     }
-                    else if (ev.events & EPOLLERR)
-                    {
-                        m_tp.insert_task_normal(std::bind(&EpollTCPServer::close, this, fd));
-                    }
                     else if (ev.data.fd > 0)
                     {
-                        m_tp.insert_task_normal(std::bind(&EpollTCPServer::recv, this, fd));
+                        // epoll_event is packed, copy before binding
+                        uint32_t ev_events = ev.events;
+                        m_tp.insert_task_normal(std::bind(&EpollTCPServer::process, this, fd, ev_events));
                     }
                 }
             }
+            // timeouts are checked here and the closes go to the pool
+            m_timers.advance();
         }
+        return 0;
     }
 
     void EpollTCPServer::accept()
@@ -152,10 +593,16 @@ namespace soda
             }
             // NIO
             m_socket.set_nonblocking(conn->fd);
-            std::lock_guard<std::mutex> lock(m_mtx);
-            m_conns.emplace(conn->fd, conn);
+            conn_ptr new_conn = std::make_shared<Connection>(*conn);
+            new_conn->timers = &m_timers;
+            new_conn->last_active = m_timers.now();
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_conns.emplace(conn->fd, new_conn);
+            }
             // Join the listening queue, edge trigger, use oneshot to avoid single descriptor multi-thread competition
             m_epoller.add_event(conn->fd, EPOLLIN | EPOLLET | EPOLLONESHOT);
+            arm_timer(new_conn);
             if (m_callback_on_conn)
             {
                 m_callback_on_conn(*this, conn->fd, conn->addr, conn->port);
@@ -167,43 +614,128 @@ namespace soda
 
     void EpollTCPServer::recv(int fd)
     {
-        if (!m_callback_on_recv)
+        conn_ptr conn = get_conn(fd);
+        if (!conn)
         {
             return;
         }
 
-        conn_info_ptr conn = get_conn(fd);
-        if (!conn)
+        // a short read is enough, rearming the oneshot fd reports what came since
+        if (-1 == read_input(conn, m_recv_batch))
         {
-            return;
+            close(fd);
         }
+    }
 
-        uint8_t buf[4096];
-        int ret = -1;
-        // NIO, read multiple times
+    int EpollTCPServer::read_input(const conn_ptr &conn, bool until_eagain)
+    {
+        // borrowed for this read only, idle connections hold no receive memory
+        PooledBuffer buf(conn->recv_hint);
+        uint8_t spill[RECV_SPILL_SIZE];
+        size_t size = 0;
+        int ret = 0;
         while (!m_stop)
         {
-            memset(buf, 0, sizeof(buf));
-            ret = m_socket.recv(fd, buf, sizeof(buf));
-            // if buffer is full, may need to read again
-            if (ret > 0)
+            size_t room = buf.capacity() - size;
+            iovec iov[2] = {{buf.data() + size, room}, {spill, sizeof(spill)}};
+            ret = m_socket.recvv(conn->fd, iov, 2);
+            if (ret <= 0)
+            {
+                break;
+            }
+            if (0 == size)
+            {
+                touch(*conn);
+                conn->read_deadline.store(0, std::memory_order_relaxed);
+            }
+
+            size_t len = ret;
+            if (len > room)
             {
-                m_callback_on_recv(*this, fd, conn->addr, conn->port, buf, ret);
+                buf.grow(size + len, size + room);
+                memcpy(buf.data() + size + room, spill, len - room);
+            }
+            size += len;
 
-                if (sizeof(buf) == ret)
+            bool drained = len < room + sizeof(spill);
+            if (!m_recv_batch || size >= RECV_BATCH_LIMIT || (drained && !until_eagain))
+            {
+                if (m_callback_on_recv)
                 {
-                    continue;
+                    m_callback_on_recv(*this, conn->fd, conn->addr, conn->port, buf.data(), size);
                 }
+                // a quarter of each new size, so one large message does not keep a large buffer
+                size_t hint = (conn->recv_hint * 3 + size) / 4;
+                conn->recv_hint = std::min(hint, size_t(BufferPool::MAX_BUFFER_SIZE));
+                size = 0;
+            }
+            if (drained && !until_eagain)
+            {
+                break;
+            }
+        }
+
+        // the rest of a batch, also before a close
+        if (size > 0 && m_callback_on_recv)
+        {
+            m_callback_on_recv(*this, conn->fd, conn->addr, conn->port, buf.data(), size);
+        }
+        return -1 == ret ? -1 : 0;
+    }
+
+    void EpollTCPServer::process(int32_t fd, uint32_t events)
+    {
+        conn_ptr conn = get_conn(fd);
+        if (!conn)
+        {
+            return;
+        }
+
+        {
+            // send() may have rearmed the fd before this ran, the second event is left to the first process()
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            if (conn->busy)
+            {
+                conn->missed_events |= events;
+                return;
             }
-            else if (-1 == ret)
+            conn->busy = true;
+        }
+
+        while (true)
+        {
+            // zerocopy completions come as EPOLLERR too
+            if ((events & EPOLLHUP) || ((events & EPOLLERR) && -1 == handle_error(conn)))
             {
                 close(fd);
                 return;
             }
-            break;
+            if (events & EPOLLOUT)
+            {
+                handle_output(conn);
+            }
+            if (events & (EPOLLIN | EPOLLRDHUP))
+            {
+                recv(fd);
+            }
+
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            if (conn->missed_events)
+            {
+                events = conn->missed_events;
+                conn->missed_events = 0;
+                continue;
+            }
+            // reactivate, with EPOLLOUT while output is pending or a low watermark is awaited, e.g. by sendfile();
+            // not if fd is another connection by now
+            conn->busy = false;
+            if (get_conn(fd) == conn)
+            {
+                bool pending = conn->buffered() > 0 || conn->above_high;
+                m_epoller.mod_event(fd, EPOLLIN | EPOLLET | EPOLLONESHOT | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u));
+            }
+            return;
         }
-        // reactivate
-        m_epoller.mod_event(fd, EPOLLIN | EPOLLET | EPOLLONESHOT);
     }
 
     void EpollTCPServer::stop()
@@ -214,21 +746,40 @@ namespace soda
         }
         m_stop = true;
 
+        if (m_loop_size > 0)
+        {
+            stop_loops();
+            return;
+        }
+
         for (auto iter = m_conns.begin(); iter != m_conns.end();)
         {
             close(iter->first);
             iter = m_conns.begin();
         }
-        std::lock_guard<std::mutex> lock(m_mtx);
-        m_conns.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_conns.clear();
+        }
         m_epoller.stop();
+        // workers still running may look a connection up
         m_tp.stop();
         m_socket.stop();
+        finish_lingering();
     }
 
     void EpollTCPServer::close(int fd)
     {
-        conn_info_ptr conn = get_conn(fd);
+        if (m_loop_size > 0)
+        {
+            if (EventLoop *loop = find_loop(fd))
+            {
+                loop_close(loop, fd);
+            }
+            return;
+        }
+
+        conn_ptr conn = get_conn(fd);
         if (!conn)
         {
             return;
@@ -238,10 +789,16 @@ namespace soda
         {
             m_callback_on_disconn(*this, conn->addr, conn->port);
         }
-        std::lock_guard<std::mutex> lock(m_mtx);
-        m_conns.erase(fd);
-        m_epoller.del_event(fd);
-        m_socket.close_conn(fd);
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_conns.erase(fd);
+            m_epoller.del_event(fd);
+        }
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            m_timers.cancel(conn->timer);
+        }
+        close_fd(conn, m_socket);
     }
 
     // -1 if failed
@@ -253,6 +810,11 @@ namespace soda
         }
         m_stop = false;
 
+        if (m_loop_size > 0)
+        {
+            return start_loops();
+        }
+
         if (-1 == m_socket.start_tcp_server())
         {
             return -1;
@@ -270,55 +832,1377 @@ namespace soda
 
     int EpollTCPServer::send(uint32_t fd, const void *src, size_t size, int flags)
     {
-        if (!get_conn(fd))
+        iovec iov{const_cast<void *>(src), size};
+        return sendv(fd, &iov, 1, flags);
+    }
+
+    int EpollTCPServer::sendv(uint32_t fd, const iovec *iov, int iovcnt, int flags)
+    {
+        conn_ptr conn = get_conn(fd);
+        if (!conn)
         {
             return -1;
         }
 
-        int ret = m_socket.send(fd, src, size, flags);
-        if (-1 == ret)
+        size_t size = 0;
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            size += iov[i].iov_len;
+        }
+
+        std::unique_lock<std::mutex> lock(conn->mtx);
+        bool was_empty = 0 == conn->buffered();
+        int sent = 0;
+        // keep the order, nothing goes directly while older data waits
+        if (was_empty && -1 == (sent = write_iov(*conn, iov, iovcnt, size, flags)))
         {
+            lock.unlock();
             close(fd);
+            return -1;
         }
-        return ret;
+
+        if (size == static_cast<size_t>(sent))
+        {
+            return size;
+        }
+        if (!buffer_iov(*conn, iov, iovcnt, size, sent))
+        {
+            DEBUG_PRINT("output limit exceeded");
+            if (sent > 0)
+            {
+                // the peer got part of the message, anything after it would corrupt the stream
+                lock.unlock();
+                close(fd);
+            }
+            return -1;
+        }
+        after_buffer(lock, *conn, was_empty);
+        return size;
     }
 
-    int EpollTCPServer::sendfile(uint32_t dstfd, uint32_t srcfd, off_t *offset, size_t size)
+    int EpollTCPServer::send_zerocopy(uint32_t fd, const void *src, size_t size, zerocopy_done_t done)
     {
-        if (!get_conn(dstfd))
+        conn_ptr conn = get_conn(fd);
+        if (!conn)
         {
             return -1;
         }
 
-        int ret = m_socket.sendfile(dstfd, srcfd, offset, size);
-        if (-1 == ret)
+        std::unique_lock<std::mutex> lock(conn->mtx);
+        bool was_empty = 0 == conn->buffered();
+        if (size >= ZEROCOPY_MIN_SIZE && was_empty && 0 == conn->zerocopy)
         {
-            DEBUG_PRINT("sendfile failed");
-            close(dstfd);
-            return -1;
+            conn->zerocopy = -1 == m_socket.set_zerocopy(fd) ? -1 : 1;
+        }
+
+        size_t sent = 0;
+        bool lent = false;
+        if (size >= ZEROCOPY_MIN_SIZE && was_empty && 1 == conn->zerocopy)
+        {
+            while (sent < size)
+            {
+                iovec iov{const_cast<uint8_t *>(reinterpret_cast<const uint8_t *>(src)) + sent, size - sent};
+                int ret = m_socket.sendv(fd, &iov, 1, MSG_ZEROCOPY);
+                if (-1 == ret)
+                {
+                    lock.unlock();
+                    close(fd);
+                    done();
+                    return -1;
+                }
+                if (0 == ret)
+                {
+                    break;
+                }
+                // every send taking data gets the next number
+                ++conn->zerocopy_next;
+                sent += ret;
+                lent = true;
+            }
+        }
+        else if (was_empty)
+        {
+            iovec iov{const_cast<void *>(src), size};
+            int ret = write_iov(*conn, &iov, 1, size, 0);
+            if (-1 == ret)
+            {
+                lock.unlock();
+                close(fd);
+                done();
+                return -1;
+            }
+            sent = ret;
+        }
+
+        if (lent)
+        {
+            conn->zerocopy_pending.emplace_back(conn->zerocopy_next - 1, std::move(done));
+        }
+
+        // the rest is copied, the kernel does not need src for it
+        int ret = size;
+        if (sent < size)
+        {
+            iovec iov{const_cast<void *>(src), size};
+            if (buffer_iov(*conn, &iov, 1, size, sent))
+            {
+                after_buffer(lock, *conn, was_empty);
+            }
+            else
+            {
+                DEBUG_PRINT("output limit exceeded");
+                ret = -1;
+            }
+        }
+        if (lock.owns_lock())
+        {
+            lock.unlock();
+        }
+        if (-1 == ret && sent > 0)
+        {
+            // cut in the middle of the message
+            close(fd);
+        }
+
+        if (!lent)
+        {
+            done();
         }
         return ret;
     }
 
-    void EpollTCPServer::send_to_all(const void *src, size_t size, int flags)
+    int EpollTCPServer::write_iov(Connection &conn, const iovec *iov, int iovcnt, size_t size, int flags)
     {
-        for (auto &&ele : m_conns)
+        size_t sent = 0;
+        int idx = 0;
+        size_t offset = 0;
+        while (sent < size)
         {
-            send(ele.first, src, size, flags);
+            // the unsent part, at most SEND_IOV_SIZE spans
+            iovec cur[SEND_IOV_SIZE];
+            int cnt = 0;
+            for (int i = idx; i < iovcnt && cnt < SEND_IOV_SIZE; ++i)
+            {
+                size_t skip = i == idx ? offset : 0;
+                if (iov[i].iov_len > skip)
+                {
+                    cur[cnt].iov_base = reinterpret_cast<uint8_t *>(iov[i].iov_base) + skip;
+                    cur[cnt].iov_len = iov[i].iov_len - skip;
+                    ++cnt;
+                }
+            }
+
+            int ret = m_socket.sendv(conn.fd, cur, cnt, flags);
+            if (-1 == ret)
+            {
+                return -1;
+            }
+            if (0 == ret)
+            {
+                // full, EPOLLOUT tells when to go on
+                break;
+            }
+
+            touch(conn);
+            sent += ret;
+            offset += ret;
+            while (idx < iovcnt && offset >= iov[idx].iov_len)
+            {
+                offset -= iov[idx].iov_len;
+                ++idx;
+            }
         }
+        return sent;
     }
 
-    void EpollTCPServer::set_callback_on_conn(conn_cb_t cb)
+    bool EpollTCPServer::buffer_iov(Connection &conn, const iovec *iov, int iovcnt, size_t size, size_t sent)
     {
-        m_callback_on_conn = std::move(cb);
-    }
-    void EpollTCPServer::set_callback_on_recv(recv_cb_t cb)
-    {
-        m_callback_on_recv = std::move(cb);
+        if (conn.buffered() + size - sent > m_output_limit)
+        {
+            return false;
+        }
+
+        for (int i = 0; i < iovcnt; ++i)
+        {
+            size_t skip = std::min(sent, iov[i].iov_len);
+            sent -= skip;
+            append_output(conn, reinterpret_cast<const uint8_t *>(iov[i].iov_base) + skip, iov[i].iov_len - skip);
+        }
+        return true;
     }
-    void EpollTCPServer::set_callback_on_disconn(disconn_cb_t cb)
+
+    void EpollTCPServer::after_buffer(std::unique_lock<std::mutex> &lock, Connection &conn, bool was_empty)
     {
-        m_callback_on_disconn = std::move(cb);
+        // epoll loops always wait for EPOLLOUT, the oneshot fd of the pool mode is rearmed with it unless process() will do
+        if (0 == m_loop_size && was_empty && !conn.busy)
+        {
+            m_epoller.mod_event(conn.fd, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLONESHOT);
+        }
+
+        // io_uring loops poll once per stall, requested by the loop thread
+        EventLoop *post_to = nullptr;
+        if (BACKEND_IO_URING == m_backend && !conn.pollout)
+        {
+            conn.pollout = true;
+            if (local_loop() == conn.loop)
+            {
+                uring_poll_output(conn.loop, conn);
+            }
+            else
+            {
+                post_to = conn.loop;
+            }
+        }
+
+        int32_t fd = conn.fd;
+        uint32_t gen = conn.gen;
+        size_t buffered = conn.buffered();
+        bool high = !conn.above_high && buffered >= m_high_watermark;
+        conn.above_high = conn.above_high || high;
+        lock.unlock();
+
+        if (post_to)
+        {
+            post(post_to, [this, post_to, fd, gen]
+                 {
+                if (conn_ptr conn = uring_conn(post_to, fd, gen))
+                {
+                    uring_poll_output(post_to, *conn);
+                } });
+        }
+
+        if (high && m_callback_on_high_watermark)
+        {
+            m_callback_on_high_watermark(*this, fd, buffered);
+        }
+    }
+
+    int EpollTCPServer::handle_error(const conn_ptr &conn)
+    {
+        std::vector<zerocopy_done_t> done;
+        int ret = 0;
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            ret = reap_zerocopy(*conn, done);
+        }
+
+        for (auto &&cb : done)
+        {
+            cb();
+        }
+
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (-1 == ret || -1 == getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) || 0 != err)
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    int EpollTCPServer::reap_zerocopy(Connection &conn, std::vector<zerocopy_done_t> &done)
+    {
+        int ret = 0;
+        uint32_t lo = 0;
+        uint32_t hi = 0;
+        bool copied = false;
+        while (1 == (ret = m_socket.recv_zerocopy(conn.fd, &lo, &hi, &copied)))
+        {
+            // completions are reported in order, hi covers everything before it
+            while (!conn.zerocopy_pending.empty() &&
+                   static_cast<int32_t>(conn.zerocopy_pending.front().first - hi) <= 0)
+            {
+                done.push_back(std::move(conn.zerocopy_pending.front().second));
+                conn.zerocopy_pending.pop_front();
+            }
+            if (copied)
+            {
+                // e.g. loopback or a device without scatter-gather, copying is cheaper than lending
+                conn.zerocopy = -1;
+            }
+        }
+        return ret;
+    }
+
+    void EpollTCPServer::close_fd(const conn_ptr &conn, SocketUtil &socket)
+    {
+        std::vector<zerocopy_done_t> done;
+        bool lent = false;
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            if (!conn->zerocopy_pending.empty())
+            {
+                reap_zerocopy(*conn, done);
+            }
+            lent = !conn->zerocopy_pending.empty();
+            conn->linger_until = conn->timers->now() + ZEROCOPY_LINGER_TIMEOUT;
+        }
+        for (auto &&cb : done)
+        {
+            cb();
+        }
+
+        if (!lent)
+        {
+            socket.close_conn(conn->fd);
+            return;
+        }
+
+        // the kernel still sends from lent pages: FIN after the queued data, the fd is closed once they are back
+        shutdown(conn->fd, SHUT_RDWR);
+        {
+            std::lock_guard<std::mutex> lock(m_linger_mtx);
+            m_lingering.insert(conn);
+        }
+        conn->timers->schedule(ZEROCOPY_LINGER_INTERVAL, [this, conn]
+                               { check_linger(conn); });
+    }
+
+    void EpollTCPServer::check_linger(const conn_ptr &conn)
+    {
+        std::vector<zerocopy_done_t> done;
+        bool finished = false;
+        {
+            std::lock_guard<std::mutex> lock(m_linger_mtx);
+            if (!m_lingering.count(conn))
+            {
+                // finished by stop()
+                return;
+            }
+            std::lock_guard<std::mutex> conn_lock(conn->mtx);
+            int ret = reap_zerocopy(*conn, done);
+            finished = -1 == ret || conn->zerocopy_pending.empty() || conn->timers->now() >= conn->linger_until;
+            if (finished)
+            {
+                if (!conn->zerocopy_pending.empty())
+                {
+                    // given up on the peer: a reset drops the queued data instead of sending it later
+                    struct linger lg = {1, 0};
+                    setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                }
+                for (auto &&ele : conn->zerocopy_pending)
+                {
+                    done.push_back(std::move(ele.second));
+                }
+                conn->zerocopy_pending.clear();
+                ::close(conn->fd);
+                m_lingering.erase(conn);
+            }
+        }
+        for (auto &&cb : done)
+        {
+            cb();
+        }
+
+        if (!finished)
+        {
+            conn->timers->schedule(ZEROCOPY_LINGER_INTERVAL, [this, conn]
+                                   { check_linger(conn); });
+        }
+    }
+
+    void EpollTCPServer::finish_lingering()
+    {
+        std::unordered_set<conn_ptr> lingering;
+        {
+            std::lock_guard<std::mutex> lock(m_linger_mtx);
+            lingering.swap(m_lingering);
+        }
+        for (auto &&conn : lingering)
+        {
+            std::deque<std::pair<uint32_t, zerocopy_done_t>> pending;
+            {
+                std::lock_guard<std::mutex> lock(conn->mtx);
+                pending.swap(conn->zerocopy_pending);
+            }
+            struct linger lg = {1, 0};
+            setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+            ::close(conn->fd);
+            for (auto &&ele : pending)
+            {
+                ele.second();
+            }
+        }
+    }
+
+    int EpollTCPServer::flush_output(Connection &conn)
+    {
+        while (conn.buffered() > 0)
+        {
+            int ret = send_output(conn);
+            if (-1 == ret)
+            {
+                return -1;
+            }
+            if (0 == ret)
+            {
+                break;
+            }
+            consume_output(conn, ret);
+            touch(conn);
+        }
+
+        if (0 == conn.buffered())
+        {
+            conn.write_deadline.store(0, std::memory_order_relaxed);
+        }
+        // give back memory grown for a burst
+        if (conn.output && conn.output->empty() && conn.output->capacity() > OUTPUT_BUFFER_SIZE)
+        {
+            conn.output.reset();
+        }
+        return 0;
+    }
+
+    int EpollTCPServer::append_output(Connection &conn, const void *src, size_t size)
+    {
+        if (conn.buffered() + size > m_output_limit)
+        {
+            return -1;
+        }
+
+        size_t buffered = conn.output ? conn.output->size() : 0;
+        if (!conn.output || conn.output->free_size() < size)
+        {
+            size_t capacity = buffered + size > OUTPUT_BUFFER_SIZE ? buffered + size : OUTPUT_BUFFER_SIZE;
+            std::unique_ptr<RingBuffer> output(new RingBuffer(capacity));
+            if (conn.output)
+            {
+                RingBufferSpans spans = conn.output->peek();
+                output->write(spans.first, spans.first_size);
+                output->write(spans.second, spans.second_size);
+            }
+            conn.output = std::move(output);
+        }
+        conn.output->write(src, size);
+        conn.output_in += size;
+        return 0;
+    }
+
+    int EpollTCPServer::append_shared(Connection &conn, const SharedBuffer::ptr &buffer, size_t offset, int flags)
+    {
+        size_t size = buffer->size() - offset;
+        if (conn.buffered() + size > m_output_limit)
+        {
+            return -1;
+        }
+        conn.shared_output.push_back({buffer, offset, conn.output_in, flags});
+        conn.shared_size += size;
+        return 0;
+    }
+
+    int EpollTCPServer::send_output(Connection &conn)
+    {
+        RingBufferSpans spans = conn.output ? conn.output->peek() : RingBufferSpans{nullptr, 0, nullptr, 0};
+        iovec iov[SEND_IOV_SIZE];
+        int iovcnt = 0;
+
+        // ring bytes [first, last) counted from the read position
+        auto add_ring = [&](size_t first, size_t last)
+        {
+            if (first < spans.first_size)
+            {
+                size_t end = last < spans.first_size ? last : spans.first_size;
+                iov[iovcnt++] = {spans.first + first, end - first};
+            }
+            if (last > spans.first_size)
+            {
+                size_t begin = first > spans.first_size ? first - spans.first_size : 0;
+                iov[iovcnt++] = {spans.second + begin, last - spans.first_size - begin};
+            }
+        };
+
+        // ring, segment, ring, segment, ... as they were queued
+        size_t ring_pos = 0;
+        bool all = true;
+        int flags = 0;
+        for (auto &&seg : conn.shared_output)
+        {
+            // room for two ring spans and the segment
+            if (iovcnt + 3 > SEND_IOV_SIZE)
+            {
+                all = false;
+                break;
+            }
+            size_t before = seg.pos - conn.output_out;
+            if (before > ring_pos)
+            {
+                add_ring(ring_pos, before);
+                ring_pos = before;
+            }
+            iov[iovcnt++] = {const_cast<uint8_t *>(seg.buffer->data()) + seg.offset, seg.buffer->size() - seg.offset};
+            flags |= seg.flags;
+        }
+        size_t ring_size = spans.size();
+        if (all && iovcnt + 2 <= SEND_IOV_SIZE && ring_size > ring_pos)
+        {
+            add_ring(ring_pos, ring_size);
+        }
+        return m_socket.sendv(conn.fd, iov, iovcnt, flags);
+    }
+
+    void EpollTCPServer::consume_output(Connection &conn, size_t size)
+    {
+        while (size > 0)
+        {
+            if (!conn.shared_output.empty() && conn.shared_output.front().pos == conn.output_out)
+            {
+                SharedSegment &seg = conn.shared_output.front();
+                size_t left = seg.buffer->size() - seg.offset;
+                size_t len = size < left ? size : left;
+                seg.offset += len;
+                conn.shared_size -= len;
+                size -= len;
+                if (seg.offset == seg.buffer->size())
+                {
+                    conn.shared_output.pop_front();
+                }
+                continue;
+            }
+
+            // ring bytes up to the next segment
+            size_t ring_size = conn.output->size();
+            size_t avail = conn.shared_output.empty() ? ring_size : conn.shared_output.front().pos - conn.output_out;
+            size_t len = size < avail ? size : avail;
+            conn.output->consume(len);
+            conn.output_out += len;
+            size -= len;
+        }
+    }
+
+    void EpollTCPServer::handle_output(const conn_ptr &conn)
+    {
+        std::unique_lock<std::mutex> lock(conn->mtx);
+        if (-1 == flush_output(*conn))
+        {
+            lock.unlock();
+            close(conn->fd);
+            return;
+        }
+
+        size_t buffered = conn->buffered();
+        bool low = conn->above_high && buffered <= m_low_watermark;
+        conn->above_high = conn->above_high && !low;
+        lock.unlock();
+
+        if (low && m_callback_on_low_watermark)
+        {
+            m_callback_on_low_watermark(*this, conn->fd, buffered);
+        }
+    }
+
+    size_t EpollTCPServer::output_size(int32_t fd)
+    {
+        conn_ptr conn = get_conn(fd);
+        if (!conn)
+        {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        return conn->buffered();
+    }
+
+    int EpollTCPServer::sendfile(uint32_t dstfd, uint32_t srcfd, off_t *offset, size_t size)
+    {
+        conn_ptr conn = get_conn(dstfd);
+        if (!conn)
+        {
+            return -1;
+        }
+
+        // the file must not overtake buffered output
+        std::unique_lock<std::mutex> lock(conn->mtx);
+        if (-1 == flush_output(*conn))
+        {
+            lock.unlock();
+            close(dstfd);
+            return -1;
+        }
+
+        // what the socket takes now, a full one is not waited for with the connection locked
+        size_t sent = 0;
+        bool full = conn->buffered() > 0;
+        while (!full && sent < size)
+        {
+            ssize_t ret = ::sendfile(dstfd, srcfd, offset, size - sent);
+            if (ret > 0)
+            {
+                sent += ret;
+            }
+            else if (0 == ret)
+            {
+                break;
+            }
+            else if (EAGAIN == errno || EWOULDBLOCK == errno)
+            {
+                full = true;
+            }
+            else if (EINTR != errno)
+            {
+                perror("sendfile failed");
+                lock.unlock();
+                close(dstfd);
+                return -1;
+            }
+        }
+
+        if (full)
+        {
+            // reported as low once the output drains, with EPOLLOUT armed if nothing else waits for it
+            conn->above_high = true;
+            if (0 == conn->buffered())
+            {
+                after_buffer(lock, *conn, true);
+            }
+        }
+        return sent;
+    }
+
+    void EpollTCPServer::send_to_all(const void *src, size_t size, int flags)
+    {
+        broadcast(SharedBuffer::make(src, size), flags);
+    }
+
+    void EpollTCPServer::broadcast(const SharedBuffer::ptr &buffer, int flags)
+    {
+        // queued here so a later send() cannot overtake it, the loops or the pool do the writes
+        if (m_loop_size > 0)
+        {
+            for (auto &&loop : m_loops)
+            {
+                // deliver() may close and erase, work on a snapshot
+                std::vector<conn_ptr> conns;
+                {
+                    std::lock_guard<std::mutex> lock(loop->mtx);
+                    conns.reserve(loop->conns.size());
+                    for (auto &&ele : loop->conns)
+                    {
+                        conns.push_back(ele.second);
+                    }
+                }
+                conns.erase(std::remove_if(conns.begin(), conns.end(), [&](const conn_ptr &conn)
+                                           { return !deliver(conn, buffer, flags); }),
+                            conns.end());
+                if (!conns.empty())
+                {
+                    std::shared_ptr<std::vector<conn_ptr>> flush = std::make_shared<std::vector<conn_ptr>>(std::move(conns));
+                    post(loop.get(), [this, flush]
+                         {
+                        for (auto &&conn : *flush)
+                        {
+                            handle_output(conn);
+                        } });
+                }
+            }
+            return;
+        }
+
+        std::shared_ptr<std::vector<conn_ptr>> conns = std::make_shared<std::vector<conn_ptr>>();
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            conns->reserve(m_conns.size());
+            for (auto &&ele : m_conns)
+            {
+                conns->push_back(ele.second);
+            }
+        }
+        conns->erase(std::remove_if(conns->begin(), conns->end(), [&](const conn_ptr &conn)
+                                    { return !deliver(conn, buffer, flags); }),
+                     conns->end());
+
+        // chunks of connections flushed across the pool, what the socket does not take waits for EPOLLOUT
+        m_tp.parallel_for(size_t(0), conns->size(), BROADCAST_GRAIN, [this, conns](size_t first, size_t last)
+                          {
+            for (size_t i = first; i < last; ++i)
+            {
+                const conn_ptr &conn = (*conns)[i];
+                handle_output(conn);
+                std::lock_guard<std::mutex> lock(conn->mtx);
+                if (conn->buffered() > 0 && !conn->busy && get_conn(conn->fd))
+                {
+                    m_epoller.mod_event(conn->fd, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLONESHOT);
+                }
+            } });
+    }
+
+    void EpollTCPServer::arm_timer(const conn_ptr &conn)
+    {
+        uint64_t due = 0;
+        uint64_t idle = m_idle_timeout;
+        uint64_t deadlines[3] = {idle > 0 ? conn->last_active + idle : 0, conn->read_deadline, conn->write_deadline};
+        for (uint64_t at : deadlines)
+        {
+            if (at > 0 && (0 == due || at < due))
+            {
+                due = at;
+            }
+        }
+        if (0 == due)
+        {
+            return;
+        }
+
+        // one timer per connection, only moved earlier; a later deadline is found when it fires
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        if (0 != conn->timer && conn->timer_at <= due)
+        {
+            return;
+        }
+        conn->timers->cancel(conn->timer);
+        uint64_t now = conn->timers->now();
+        std::weak_ptr<Connection> weak = conn;
+        conn->timer = conn->timers->schedule(due > now ? due - now : 0, [this, weak]
+                                             { on_timer(weak.lock()); });
+        conn->timer_at = due;
+    }
+
+    void EpollTCPServer::on_timer(const conn_ptr &conn)
+    {
+        // closed meanwhile, or fd is another connection by now
+        if (!conn || get_conn(conn->fd) != conn)
+        {
+            return;
+        }
+
+        uint64_t now = conn->timers->now();
+        uint64_t idle = m_idle_timeout;
+        int type = -1;
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            conn->timer = 0;
+            uint64_t read_deadline = conn->read_deadline;
+            uint64_t write_deadline = conn->write_deadline;
+            if (read_deadline > 0 && read_deadline <= now)
+            {
+                type = READ_TIMEOUT;
+            }
+            else if (write_deadline > 0 && write_deadline <= now && conn->buffered() > 0)
+            {
+                type = WRITE_TIMEOUT;
+            }
+            else if (idle > 0 && conn->last_active + idle <= now)
+            {
+                type = IDLE_TIMEOUT;
+            }
+        }
+
+        if (-1 == type)
+        {
+            arm_timer(conn);
+        }
+        else if (m_loop_size > 0)
+        {
+            expire(conn, static_cast<TimeoutType>(type));
+        }
+        else
+        {
+            // listen() drives the wheel, it must not wait for callbacks
+            m_tp.insert_task_normal(std::bind(&EpollTCPServer::expire, this, conn, static_cast<TimeoutType>(type)));
+        }
+    }
+
+    void EpollTCPServer::expire(const conn_ptr &conn, TimeoutType type)
+    {
+        if (m_callback_on_timeout)
+        {
+            m_callback_on_timeout(*this, conn->fd, type);
+        }
+        if (get_conn(conn->fd) == conn)
+        {
+            close(conn->fd);
+        }
+    }
+
+    void EpollTCPServer::touch(Connection &conn)
+    {
+        conn.last_active.store(conn.timers->now(), std::memory_order_relaxed);
+    }
+
+    bool EpollTCPServer::deliver(const conn_ptr &conn, const SharedBuffer::ptr &buffer, int flags)
+    {
+        std::unique_lock<std::mutex> lock(conn->mtx);
+        if (conn->above_high)
+        {
+            switch (m_broadcast_policy.load())
+            {
+            case BROADCAST_DROP:
+                return false;
+            case BROADCAST_COALESCE:
+                // a started one is partly on the wire, it has to be finished
+                for (auto iter = conn->shared_output.begin(); iter != conn->shared_output.end();)
+                {
+                    if (0 == iter->offset)
+                    {
+                        conn->shared_size -= iter->buffer->size();
+                        iter = conn->shared_output.erase(iter);
+                        continue;
+                    }
+                    ++iter;
+                }
+                break;
+            case BROADCAST_CLOSE:
+                lock.unlock();
+                DEBUG_PRINT("slow consumer closed");
+                close(conn->fd);
+                return false;
+            default:
+                break;
+            }
+        }
+
+        if (-1 == append_shared(*conn, buffer, 0, flags))
+        {
+            DEBUG_PRINT("output limit exceeded");
+            return false;
+        }
+        // the broadcast flush arms EPOLLOUT if needed
+        after_buffer(lock, *conn, false);
+        return true;
+    }
+
+    void EpollTCPServer::post(EventLoop *loop, std::function<void()> fn)
+    {
+        {
+            std::lock_guard<std::mutex> lock(loop->mtx);
+            loop->posted.push_back(std::move(fn));
+        }
+        loop->epoller.wakeup();
+    }
+
+    void EpollTCPServer::run_posted(EventLoop *loop)
+    {
+        std::vector<std::function<void()>> posted;
+        {
+            std::lock_guard<std::mutex> lock(loop->mtx);
+            posted.swap(loop->posted);
+        }
+        for (auto &&fn : posted)
+        {
+            fn();
+        }
+    }
+
+    size_t EpollTCPServer::conn_size()
+    {
+        if (0 == m_loop_size)
+        {
+            return m_conns.size();
+        }
+
+        size_t size = 0;
+        for (auto &&loop : m_loops)
+        {
+            std::lock_guard<std::mutex> lock(loop->mtx);
+            size += loop->conns.size();
+        }
+        return size;
+    }
+
+    EpollTCPServer::EventLoop *&EpollTCPServer::local_loop()
+    {
+        static thread_local EventLoop *loop = nullptr;
+        return loop;
+    }
+
+    EpollTCPServer::EventLoop *EpollTCPServer::find_loop(int32_t fd)
+    {
+        // replies from a callback go to the loop it runs on
+        EventLoop *local = local_loop();
+        if (local && this == local->owner)
+        {
+            std::lock_guard<std::mutex> lock(local->mtx);
+            if (local->conns.count(fd))
+            {
+                return local;
+            }
+        }
+
+        for (auto &&loop : m_loops)
+        {
+            if (loop.get() == local)
+            {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(loop->mtx);
+            if (loop->conns.count(fd))
+            {
+                return loop.get();
+            }
+        }
+        return nullptr;
+    }
+
+    int EpollTCPServer::start_loops()
+    {
+        if (BACKEND_IO_URING == m_backend && !IOUring::supported())
+        {
+            DEBUG_PRINT("io_uring unavailable, using epoll");
+            m_backend = BACKEND_EPOLL;
+        }
+
+        for (size_t i = 0; i < m_loop_size; ++i)
+        {
+            std::unique_ptr<EventLoop> loop(new EventLoop(this, i, m_addr, m_port));
+            if (BACKEND_IO_URING == m_backend)
+            {
+                loop->uring.reset(new IOUring());
+                if (!loop->uring->valid() || -1 == loop->uring->setup_buffers(URING_BUFFER_GROUP, URING_BUFFER_COUNT, URING_BUFFER_SIZE))
+                {
+                    m_loops.clear();
+                    m_stop = true;
+                    return -1;
+                }
+            }
+            // one listener per loop, the kernel spreads new connections among them
+            if (-1 == loop->socket.start_tcp_server(true))
+            {
+                m_loops.clear();
+                m_stop = true;
+                return -1;
+            }
+            loop->sockfd = loop->socket.get_sockfd();
+            // NIO
+            loop->socket.set_nonblocking(loop->sockfd);
+            // edge trigger, no oneshot: only this loop waits on its fds; io_uring accepts by itself
+            if (!loop->uring)
+            {
+                loop->epoller.add_event(loop->sockfd, EPOLLIN | EPOLLET);
+            }
+            loop->timers.set_wakeup(std::bind(&Epoller::wakeup, &loop->epoller));
+            m_loops.push_back(std::move(loop));
+        }
+
+        for (auto &&loop : m_loops)
+        {
+            loop->thread = std::thread(loop->uring ? &EpollTCPServer::uring_loop_proc : &EpollTCPServer::loop_proc, this, loop.get());
+        }
+        return 0;
+    }
+
+    void EpollTCPServer::stop_loops()
+    {
+        for (auto &&loop : m_loops)
+        {
+            loop->epoller.stop();
+            if (loop->thread.joinable())
+            {
+                loop->thread.join();
+            }
+        }
+
+        for (auto &&loop : m_loops)
+        {
+            while (true)
+            {
+                int32_t fd = -1;
+                {
+                    std::lock_guard<std::mutex> lock(loop->mtx);
+                    if (loop->conns.empty())
+                    {
+                        break;
+                    }
+                    fd = loop->conns.begin()->first;
+                }
+                loop_close_now(loop.get(), fd);
+            }
+            loop->socket.stop();
+        }
+        // the loop wheels drive the lingering ones, they go with the loops
+        finish_lingering();
+        m_loops.clear();
+    }
+
+    void EpollTCPServer::loop_proc(EventLoop *loop)
+    {
+        local_loop() = loop;
+        m_loop_placement.apply(loop->index);
+
+        while (!m_stop)
+        {
+            auto &&ret = loop->epoller.check_once(loop->timers.timeout());
+            int size = std::get<0>(ret);
+            auto &&events = std::get<1>(ret).get();
+            for (int i = 0; i < size; ++i)
+            {
+                auto &&ev = events[i];
+                int32_t fd = ev.data.fd;
+                if (loop->sockfd == fd)
+                {
+                    loop_accept(loop);
+                }
+                else if (-1 == fd)
+                {
+                    // wakeup
+                    run_posted(loop);
+                }
+                else if (conn_ptr conn = loop_conn(loop, fd))
+                {
+                    // zerocopy completions come as EPOLLERR too
+                    if ((ev.events & EPOLLHUP) || ((ev.events & EPOLLERR) && -1 == handle_error(conn)))
+                    {
+                        loop_close(loop, fd);
+                        continue;
+                    }
+                    if (ev.events & EPOLLOUT)
+                    {
+                        handle_output(conn);
+                    }
+                    if (ev.events & (EPOLLIN | EPOLLRDHUP))
+                    {
+                        loop_recv(loop, conn);
+                    }
+                }
+            }
+            loop->timers.advance();
+        }
+        local_loop() = nullptr;
+    }
+
+    void EpollTCPServer::loop_accept(EventLoop *loop)
+    {
+        // edge trigger, accept until EAGAIN
+        while (!m_stop)
+        {
+            conn_info_ptr conn = loop->socket.accept();
+            if (!conn || -1 == conn->fd)
+            {
+                break;
+            }
+            // NIO
+            loop->socket.set_nonblocking(conn->fd);
+            loop_add(loop, *conn);
+        }
+    }
+
+    void EpollTCPServer::loop_add(EventLoop *loop, const ConnInfo &info)
+    {
+        conn_ptr conn = std::make_shared<Connection>(info);
+        conn->timers = &loop->timers;
+        conn->last_active = loop->timers.now();
+        conn->loop = loop;
+        conn->gen = ++loop->next_gen;
+        {
+            std::lock_guard<std::mutex> lock(loop->mtx);
+            loop->conns.emplace(info.fd, conn);
+        }
+        if (loop->uring)
+        {
+            // completions of MSG_ZEROCOPY come as EPOLLERR, nothing waits for those here
+            conn->zerocopy = -1;
+            loop->uring->recv_multishot(info.fd, URING_BUFFER_GROUP, uring_data(URING_RECV, info.fd, conn->gen));
+        }
+        else
+        {
+            // EPOLLOUT edges only come when a full socket gets room, no rearm needed to flush
+            loop->epoller.add_event(info.fd, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP);
+        }
+        arm_timer(conn);
+        if (m_callback_on_conn)
+        {
+            m_callback_on_conn(*this, info.fd, info.addr, info.port);
+        }
+    }
+
+    void EpollTCPServer::loop_recv(EventLoop *loop, const conn_ptr &conn)
+    {
+        // edge trigger, read until EAGAIN; no rearm needed
+        if (-1 == read_input(conn, true))
+        {
+            loop_close(loop, conn->fd);
+        }
+    }
+
+    EpollTCPServer::conn_ptr EpollTCPServer::loop_conn(EventLoop *loop, int32_t fd)
+    {
+        std::lock_guard<std::mutex> lock(loop->mtx);
+        auto conn_iter = loop->conns.find(fd);
+        return conn_iter == loop->conns.end() ? nullptr : conn_iter->second;
+    }
+
+    void EpollTCPServer::loop_close(EventLoop *loop, int32_t fd)
+    {
+        if (local_loop() == loop)
+        {
+            loop_close_now(loop, fd);
+            return;
+        }
+
+        // closed on the loop, the fd number is not reused while the loop still reads it;
+        // stop_loops() closes what is left once the loops are joined
+        conn_ptr conn = loop_conn(loop, fd);
+        if (conn)
+        {
+            post(loop, [this, loop, conn]
+                 {
+                if (loop_conn(loop, conn->fd) == conn)
+                {
+                    loop_close_now(loop, conn->fd);
+                } });
+        }
+    }
+
+    void EpollTCPServer::loop_close_now(EventLoop *loop, int32_t fd)
+    {
+        conn_ptr conn;
+        {
+            std::lock_guard<std::mutex> lock(loop->mtx);
+            auto conn_iter = loop->conns.find(fd);
+            if (conn_iter == loop->conns.end())
+            {
+                return;
+            }
+            conn = conn_iter->second;
+            loop->conns.erase(conn_iter);
+        }
+
+        if (m_callback_on_disconn)
+        {
+            m_callback_on_disconn(*this, conn->addr, conn->port);
+        }
+        bool pollout = false;
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
+            loop->timers.cancel(conn->timer);
+            pollout = conn->pollout;
+        }
+        if (loop->uring)
+        {
+            // the ring holds the file while they are queued, a half-open peer would never be released
+            loop->uring->cancel(uring_data(URING_RECV, fd, conn->gen), uring_data(URING_CANCEL, fd, conn->gen));
+            if (pollout)
+            {
+                loop->uring->poll_remove(uring_data(URING_POLLOUT, fd, conn->gen), uring_data(URING_CANCEL, fd, conn->gen));
+            }
+        }
+        else
+        {
+            loop->epoller.del_event(fd);
+        }
+        close_fd(conn, loop->socket);
+    }
+
+    void EpollTCPServer::uring_loop_proc(EventLoop *loop)
+    {
+        local_loop() = loop;
+        m_loop_placement.apply(loop->index);
+
+        IOUring &ring = *loop->uring;
+        ring.accept_multishot(loop->sockfd, uring_data(URING_ACCEPT, loop->sockfd, 0));
+        // post(), timers and stop() still write the eventfd of the epoller
+        ring.poll(loop->epoller.wakeup_fd(), POLLIN, true, uring_data(URING_WAKEUP, -1, 0));
+        while (!m_stop)
+        {
+            // one syscall submits the rearms and sends of the last round and waits for the next
+            ring.submit_and_wait(loop->timers.timeout());
+            ring.for_each_cqe([this, loop](const io_uring_cqe &cqe)
+                              { uring_complete(loop, cqe); });
+            loop->timers.advance();
+        }
+        local_loop() = nullptr;
+    }
+
+    void EpollTCPServer::uring_complete(EventLoop *loop, const io_uring_cqe &cqe)
+    {
+        UringOp op = static_cast<UringOp>(cqe.user_data & 0xff);
+        int32_t fd = static_cast<int32_t>(static_cast<uint32_t>(cqe.user_data >> 8));
+        uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 40);
+        // multishot requests stay armed while the kernel says so
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+
+        switch (op)
+        {
+        case URING_ACCEPT:
+        {
+            if (cqe.res >= 0)
+            {
+                AddrInfo ai;
+                if (-1 == loop->socket.get_peer(cqe.res, &ai))
+                {
+                    ::close(cqe.res);
+                }
+                else
+                {
+                    loop_add(loop, ConnInfo{cqe.res, ai.addr, ai.port});
+                }
+            }
+            if (!more && !m_stop)
+            {
+                loop->uring->accept_multishot(loop->sockfd, cqe.user_data);
+            }
+            break;
+        }
+        case URING_WAKEUP:
+        {
+            eventfd_t val;
+            eventfd_read(loop->epoller.wakeup_fd(), &val);
+            run_posted(loop);
+            if (!more && !m_stop)
+            {
+                loop->uring->poll(loop->epoller.wakeup_fd(), POLLIN, true, cqe.user_data);
+            }
+            break;
+        }
+        case URING_RECV:
+            uring_recv(loop, uring_conn(loop, fd, gen), cqe);
+            break;
+        case URING_CANCEL:
+            // the cancelled requests complete with -ECANCELED, their gen no longer matches
+            break;
+        case URING_POLLOUT:
+            if (conn_ptr conn = uring_conn(loop, fd, gen))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(conn->mtx);
+                    conn->pollout = false;
+                }
+                handle_output(conn);
+                // still stalled: wait again, unless it was closed meanwhile
+                if (!uring_conn(loop, fd, gen))
+                {
+                    break;
+                }
+                std::lock_guard<std::mutex> lock(conn->mtx);
+                if (!conn->pollout && conn->buffered() > 0)
+                {
+                    conn->pollout = true;
+                    uring_poll_output(loop, *conn);
+                }
+            }
+            break;
+        }
+    }
+
+    void EpollTCPServer::uring_recv(EventLoop *loop, const conn_ptr &conn, const io_uring_cqe &cqe)
+    {
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (conn && cqe.res > 0)
+            {
+                touch(*conn);
+                conn->read_deadline.store(0, std::memory_order_relaxed);
+                if (m_callback_on_recv)
+                {
+                    m_callback_on_recv(*this, conn->fd, conn->addr, conn->port, loop->uring->buffer(bid), cqe.res);
+                }
+            }
+            // the callback is done with it
+            loop->uring->recycle_buffer(bid);
+        }
+
+        // an earlier connection on this fd, or closed by the callback
+        if (!conn || loop_conn(loop, conn->fd) != conn)
+        {
+            return;
+        }
+        if (0 == cqe.res || (cqe.res < 0 && -ENOBUFS != cqe.res))
+        {
+            loop_close(loop, conn->fd);
+        }
+        else if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            // out of buffers or stopped by the kernel, the ones above are back now
+            loop->uring->recv_multishot(conn->fd, URING_BUFFER_GROUP, cqe.user_data);
+        }
+    }
+
+    void EpollTCPServer::uring_poll_output(EventLoop *loop, const Connection &conn)
+    {
+        loop->uring->poll(conn.fd, POLLOUT, false, uring_data(URING_POLLOUT, conn.fd, conn.gen));
+    }
+
+    EpollTCPServer::conn_ptr EpollTCPServer::uring_conn(EventLoop *loop, int32_t fd, uint32_t gen)
+    {
+        conn_ptr conn = loop_conn(loop, fd);
+        return conn && (conn->gen & 0xffffff) == gen ? conn : nullptr;
+    }
+
+    uint64_t EpollTCPServer::uring_data(UringOp op, int32_t fd, uint32_t gen)
+    {
+        return (static_cast<uint64_t>(gen & 0xffffff) << 40) | (static_cast<uint64_t>(static_cast<uint32_t>(fd)) << 8) | op;
+    }
+
+    void EpollTCPServer::set_callback_on_conn(conn_cb_t cb)
+    {
+        m_callback_on_conn = std::move(cb);
+    }
+    void EpollTCPServer::set_callback_on_recv(recv_cb_t cb)
+    {
+        m_callback_on_recv = std::move(cb);
+    }
+    void EpollTCPServer::set_callback_on_disconn(disconn_cb_t cb)
+    {
+        m_callback_on_disconn = std::move(cb);
+    }
+
+    void EpollTCPServer::set_callback_on_high_watermark(watermark_cb_t cb)
+    {
+        m_callback_on_high_watermark = std::move(cb);
+    }
+
+    void EpollTCPServer::set_callback_on_low_watermark(watermark_cb_t cb)
+    {
+        m_callback_on_low_watermark = std::move(cb);
+    }
+
+    void EpollTCPServer::set_output_watermark(size_t high, size_t low)
+    {
+        m_high_watermark = high;
+        m_low_watermark = std::min(low, high);
+    }
+
+    void EpollTCPServer::set_output_limit(size_t size)
+    {
+        m_output_limit = size;
+    }
+
+    void EpollTCPServer::set_broadcast_policy(BroadcastPolicy policy)
+    {
+        m_broadcast_policy = policy;
+    }
+
+    void EpollTCPServer::set_callback_on_timeout(timeout_cb_t cb)
+    {
+        m_callback_on_timeout = std::move(cb);
+    }
+
+    void EpollTCPServer::set_idle_timeout(uint64_t ms)
+    {
+        m_idle_timeout = ms;
+    }
+
+    int EpollTCPServer::set_read_deadline(int32_t fd, uint64_t ms)
+    {
+        conn_ptr conn = get_conn(fd);
+        if (!conn)
+        {
+            return -1;
+        }
+        conn->read_deadline = ms > 0 ? conn->timers->now() + ms : 0;
+        arm_timer(conn);
+        return 0;
+    }
+
+    int EpollTCPServer::set_write_deadline(int32_t fd, uint64_t ms)
+    {
+        conn_ptr conn = get_conn(fd);
+        if (!conn)
+        {
+            return -1;
+        }
+        conn->write_deadline = ms > 0 ? conn->timers->now() + ms : 0;
+        arm_timer(conn);
+        return 0;
+    }
+
+    void EpollTCPServer::set_recv_batch(bool batch)
+    {
+        m_recv_batch = batch;
+    }
+
+    void EpollTCPServer::set_loop_placement(const ThreadPlacement &placement)
+    {
+        m_loop_placement = placement;
     }
 
 } // namespace soda
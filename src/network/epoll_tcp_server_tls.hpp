@@ -1,9 +1,15 @@
 #pragma once
 
 // epoll TCP server - tls version; multi-threading event processing; callback processes conn, msg, disconn; non-blocking IO; IPv4/IPv6
+// handshakes run on their own bounded pool, a flood of new connections does not hold up established ones
+// optional kTLS: the kernel encrypts records after the handshake and sendfile is zero copy
+// a read hands all records of one socket read to the callback, what it sends is flushed in one writev after it
 
 #include <unordered_map>
+#include <memory>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 
 #include "socket_util.hpp"
 #include "epoller.hpp"
@@ -13,17 +19,33 @@
 namespace soda
 {
 
-    struct SSLConnInfo
+    struct SSLConnInfo : Noncopyable
     {
         int32_t fd;
         std::string addr;
         uint16_t port;
         bool ssl_connected;
         TLSUtil::ssl_ptr ssl;
+        // set once by close(), tasks still holding the connection leave it alone
+        std::atomic_bool closed;
+        // the handshake timed out, the next handshake task closes it
+        std::atomic_bool expired;
+        // a task runs on it, m_mtx held
+        bool busy;
+
+        SSLConnInfo(int32_t fd, const std::string &addr, uint16_t port);
+        // the fd is closed with the last reference, after the ssl wrote its close_notify to it
+        ~SSLConnInfo();
     };
 
     class EpollTCPServer
     {
+        static const size_t DEFAULT_SESSION_CACHE_SIZE = 20480;
+        static const size_t DEFAULT_HANDSHAKE_PENDING = 1024;
+        static const uint32_t DEFAULT_HANDSHAKE_TIMEOUT = 10000;
+        // how often handshakes are checked for timeout, ms
+        static const int HANDSHAKE_SWEEP_INTERVAL = 1000;
+
         // callback for conn /source, addr, port
         using conn_cb_t = std::function<void(EpollTCPServer &s, int32_t fd, const std::string &addr, uint16_t port)>;
 
@@ -38,12 +60,32 @@ namespace soda
         // callback for disconn /source, addr, port
         using disconn_cb_t = std::function<void(EpollTCPServer &s, const std::string &addr, uint16_t port)>;
 
+    public:
+        // new connections while the pending handshakes are at the limit
+        enum HandshakeOverflow
+        {
+            // stop accepting, they wait in the listen backlog until a handshake is done
+            HANDSHAKE_DEFER,
+            // accept and close them at once
+            HANDSHAKE_REJECT
+        };
+
     private:
         SocketUtil m_socket;
         int32_t m_sockfd;
         ThreadPool m_tp;
+        // handshakes only
+        ThreadPool m_hs_tp;
         Epoller m_epoller;
-        std::unordered_map<int32_t, SSLConnInfo> m_conns;
+        // tasks hold a reference, close() may remove a connection while one runs
+        std::unordered_map<int32_t, std::shared_ptr<SSLConnInfo>> m_conns;
+        // connections in handshake and when they time out, m_mtx held
+        std::unordered_map<int32_t, std::chrono::steady_clock::time_point> m_handshakes;
+        size_t m_hs_pending;
+        HandshakeOverflow m_hs_overflow;
+        uint32_t m_hs_timeout;
+        // the listener is not re-armed until a handshake is done
+        std::atomic_bool m_accept_deferred;
 
         conn_cb_t m_callback_on_conn;
         recv_cb_t m_callback_on_recv;
@@ -67,15 +109,39 @@ namespace soda
         bool set_CA(const std::string &crt) const;
         void set_if_verify_peer_crt(bool verify) const;
 
+        // resumption, see TLSUtil; tickets rotated hourly and a cache of DEFAULT_SESSION_CACHE_SIZE sessions are on by default
+        bool set_session_tickets(bool enable, uint32_t rotate_seconds = 3600);
+        void set_session_cache(size_t capacity, uint32_t timeout_seconds = 300);
+
+        // full vs resumed handshakes
+        TLSHandshakeStats get_handshake_stats() const;
+
+        // handshakes run on their own pool of at most threads; at most pending connections are in handshake at a time
+        void set_handshake_limit(size_t threads, size_t pending, HandshakeOverflow overflow = HANDSHAKE_DEFER);
+
+        // a connection still in handshake after timeout_ms is shut down, the handshake task then closes it
+        void set_handshake_timeout(uint32_t timeout_ms);
+
         // start service
         // return -1 on failure
         int start();
 
         void stop();
 
-        // -1 if failed; the amount of data sent, and will retry to send all the data
+        // -1 if failed; the amount of data sent, what a full socket does not take goes out once it is writable
+        // sends from the recv callback of fd are coalesced into full records and go out when it returns
         int send(uint32_t fd, const void *src, size_t size);
 
+        // -1 if failed; size bytes of srcfd from *offset, which is advanced; zero copy if the connection uses kTLS
+        // and the socket takes it, the rest is buffered as send() does
+        int sendfile(uint32_t fd, int srcfd, off_t *offset, size_t size);
+
+        // call before start(); record crypto in the kernel for new connections where supported, user space otherwise
+        void set_ktls(bool enable) const;
+
+        // the kernel encrypts what is sent on fd
+        bool is_ktls(uint32_t fd);
+
         // send message to all clients
         void send_to_all(const void *src, size_t size);
 
@@ -83,8 +149,10 @@ namespace soda
 
         friend std::ostream &operator<<(std::ostream &os, const EpollTCPServer &s)
         {
+            TLSHandshakeStats stats = s.m_tls.get_handshake_stats();
             return os << "clients: " << s.m_conns.size()
                       << " running " << !s.m_stop
+                      << " handshakes full " << stats.full << " resumed " << stats.resumed << " failed " << stats.failed
                       << std::endl;
         }
 
@@ -92,13 +160,49 @@ namespace soda
         // -1 if failed
         int listen();
         void accept();
-        void recv(int32_t fd);
+        void recv(std::shared_ptr<SSLConnInfo> conn);
 
-        void ssl_accept(SSLConnInfo *conn);
-        SSLConnInfo *get_conn(int32_t fd);
+        void ssl_accept(const std::shared_ptr<SSLConnInfo> &conn);
+        std::shared_ptr<SSLConnInfo> get_conn(int32_t fd);
+
+        void close_conn(const std::shared_ptr<SSLConnInfo> &conn);
+
+        // false if a task already runs on conn, it re-arms conn when done
+        bool enter(const std::shared_ptr<SSLConnInfo> &conn);
+
+        // wait for the next event on conn unless it is closed, for output too if records wait for a full socket
+        void rearm(const std::shared_ptr<SSLConnInfo> &conn);
+
+        // a send outside of a task on conn left records for a full socket
+        void arm_output(const std::shared_ptr<SSLConnInfo> &conn);
+
+        bool in_handshake(int32_t fd) const;
+
+        // re-arm the listener if it waits for a handshake slot
+        void resume_accept();
+
+        // shut down connections whose handshake timed out, a handshake task may be running on them
+        void sweep_handshakes();
     };
 
-    SSLConnInfo *EpollTCPServer::get_conn(int32_t fd)
+    SSLConnInfo::SSLConnInfo(int32_t fd, const std::string &addr, uint16_t port) : fd(fd),
+                                                                                   addr(addr),
+                                                                                   port(port),
+                                                                                   ssl_connected(false),
+                                                                                   closed(false),
+                                                                                   expired(false),
+                                                                                   busy(false) {}
+
+    SSLConnInfo::~SSLConnInfo()
+    {
+        ssl.reset();
+        if (-1 == ::close(fd))
+        {
+            perror("close sockfd failed");
+        }
+    }
+
+    std::shared_ptr<SSLConnInfo> EpollTCPServer::get_conn(int32_t fd)
     {
         std::lock_guard<std::mutex> lock(m_mtx);
 
@@ -107,7 +211,7 @@ namespace soda
         {
             return nullptr;
         }
-        return &(conn_iter->second);
+        return conn_iter->second;
     }
 
     void EpollTCPServer::set_if_verify_peer_crt(bool verify) const
@@ -127,9 +231,78 @@ namespace soda
 
     EpollTCPServer::EpollTCPServer(const std::string &addr, uint16_t port) : m_socket(addr, port, SOCK_STREAM, 0),
                                                                              m_sockfd(-1),
-                                                                             m_tp(2),
+                                                                             m_tp(2, std::max(2u, std::thread::hardware_concurrency())),
+                                                                             m_hs_tp(1, std::max(1u, std::thread::hardware_concurrency())),
+                                                                             m_hs_pending(DEFAULT_HANDSHAKE_PENDING),
+                                                                             m_hs_overflow(HANDSHAKE_DEFER),
+                                                                             m_hs_timeout(DEFAULT_HANDSHAKE_TIMEOUT),
+                                                                             m_accept_deferred(false),
                                                                              m_tls(true),
-                                                                             m_stop(true) {}
+                                                                             m_stop(true)
+    {
+        m_tls.set_session_tickets(true);
+        m_tls.set_session_cache(DEFAULT_SESSION_CACHE_SIZE);
+    }
+
+    bool EpollTCPServer::set_session_tickets(bool enable, uint32_t rotate_seconds)
+    {
+        return m_tls.set_session_tickets(enable, rotate_seconds);
+    }
+
+    void EpollTCPServer::set_session_cache(size_t capacity, uint32_t timeout_seconds)
+    {
+        m_tls.set_session_cache(capacity, timeout_seconds);
+    }
+
+    TLSHandshakeStats EpollTCPServer::get_handshake_stats() const
+    {
+        return m_tls.get_handshake_stats();
+    }
+
+    void EpollTCPServer::set_handshake_limit(size_t threads, size_t pending, HandshakeOverflow overflow)
+    {
+        m_hs_tp.set_max_size(threads > 0 ? threads : 1);
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_hs_pending = pending > 0 ? pending : 1;
+        m_hs_overflow = overflow;
+    }
+
+    void EpollTCPServer::set_handshake_timeout(uint32_t timeout_ms)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_hs_timeout = timeout_ms;
+    }
+
+    bool EpollTCPServer::in_handshake(int32_t fd) const
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_handshakes.find(fd) != m_handshakes.end();
+    }
+
+    void EpollTCPServer::resume_accept()
+    {
+        if (m_accept_deferred.exchange(false))
+        {
+            m_epoller.mod_event(m_sockfd, EPOLLIN | EPOLLET | EPOLLONESHOT);
+        }
+    }
+
+    void EpollTCPServer::sweep_handshakes()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto now = std::chrono::steady_clock::now();
+        for (auto &&ele : m_handshakes)
+        {
+            auto conn_iter = m_conns.find(ele.first);
+            if (ele.second > now || conn_iter == m_conns.end() || conn_iter->second->expired.exchange(true))
+            {
+                continue;
+            }
+            DEBUG_PRINT("handshake timeout, fd " << ele.first);
+            // wakes the connection up, the handshake task sees it expired and closes it
+            shutdown(ele.first, SHUT_RDWR);
+        }
+    }
 
     EpollTCPServer::~EpollTCPServer()
     {
@@ -138,9 +311,16 @@ namespace soda
 
     int EpollTCPServer::listen()
     {
+        auto sweep_at = std::chrono::steady_clock::now();
         while (!m_stop)
         {
-            auto &&ret = m_epoller.check_once();
+            // wakes up at least once per sweep interval to time out stuck handshakes
+            auto &&ret = m_epoller.check_once(HANDSHAKE_SWEEP_INTERVAL);
+            if (std::chrono::steady_clock::now() >= sweep_at)
+            {
+                sweep_handshakes();
+                sweep_at = std::chrono::steady_clock::now() + std::chrono::milliseconds(int(HANDSHAKE_SWEEP_INTERVAL));
+            }
             int size = std::get<0>(ret);
             if (size > 0)
             {
@@ -153,17 +333,33 @@ namespace soda
                     {
                         m_tp.insert_task_normal(std::bind(&EpollTCPServer::accept, this));
                     }
-                    else if (ev.events & EPOLLERR)
+                    else if (ev.data.fd <= 0)
                     {
-                        m_tp.insert_task_normal(std::bind(&EpollTCPServer::close, this, fd));
+                        continue;
                     }
-                    else if (ev.data.fd > 0)
+                    // the task gets the connection itself, not an fd a later connection may reuse
+                    auto conn = get_conn(fd);
+                    if (!conn)
                     {
-                        m_tp.insert_task_normal(std::bind(&EpollTCPServer::recv, this, fd));
+                        continue;
+                    }
+                    if (ev.events & EPOLLERR)
+                    {
+                        m_tp.insert_task_normal(std::bind(&EpollTCPServer::close_conn, this, conn));
+                    }
+                    else if (in_handshake(fd))
+                    {
+                        // kept off the pool of established connections
+                        m_hs_tp.insert_task_normal(std::bind(&EpollTCPServer::recv, this, conn));
+                    }
+                    else
+                    {
+                        m_tp.insert_task_normal(std::bind(&EpollTCPServer::recv, this, conn));
                     }
                 }
             }
         }
+        return 0;
     }
 
     void EpollTCPServer::accept()
@@ -180,31 +376,71 @@ namespace soda
             {
                 break;
             }
-            // NIO
-            m_socket.set_nonblocking(conn->fd);
+            bool reject = false;
             {
                 std::lock_guard<std::mutex> lock(m_mtx);
-                m_conns.emplace(conn->fd, SSLConnInfo{conn->fd, conn->addr, conn->port, false, nullptr});
+                reject = m_handshakes.size() >= m_hs_pending;
+                if (!reject)
+                {
+                    m_conns[conn->fd] = std::make_shared<SSLConnInfo>(conn->fd, conn->addr, conn->port);
+                    m_handshakes.emplace(conn->fd, std::chrono::steady_clock::now() + std::chrono::milliseconds(m_hs_timeout));
+                }
             }
+            if (reject)
+            {
+                m_socket.close_sockfd(conn->fd);
+                continue;
+            }
+            // NIO
+            m_socket.set_nonblocking(conn->fd);
             // edge trigger, use oneshot to avoid single descriptor multi-thread competition
             m_epoller.add_event(conn->fd, EPOLLIN | EPOLLET | EPOLLONESHOT);
             if (m_callback_on_conn)
             {
                 m_callback_on_conn(*this, conn->fd, conn->addr, conn->port);
             }
+
+            if (HANDSHAKE_DEFER == m_hs_overflow)
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (m_handshakes.size() >= m_hs_pending)
+                {
+                    // the rest waits in the backlog, the next finished handshake re-arms the listener
+                    m_accept_deferred = true;
+                    break;
+                }
+            }
+        }
+        if (m_accept_deferred)
+        {
+            // a handshake may have finished before the flag was set
+            std::unique_lock<std::mutex> lock(m_mtx);
+            bool full = m_handshakes.size() >= m_hs_pending;
+            lock.unlock();
+            if (!full)
+            {
+                resume_accept();
+            }
+            return;
         }
         // reactivate
         m_epoller.mod_event(m_sockfd, EPOLLIN | EPOLLET | EPOLLONESHOT);
     }
 
-    void EpollTCPServer::ssl_accept(SSLConnInfo *conn)
+    void EpollTCPServer::ssl_accept(const std::shared_ptr<SSLConnInfo> &conn)
     {
+        if (conn->expired)
+        {
+            close_conn(conn);
+            return;
+        }
+
         if (!conn->ssl)
         {
             conn->ssl = m_tls.get_ssl(conn->fd);
             if (!conn->ssl)
             {
-                close(conn->fd);
+                close_conn(conn);
                 return;
             }
         }
@@ -212,63 +448,107 @@ namespace soda
         switch (m_tls.accept(conn->ssl))
         {
         case 1:
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
             conn->ssl_connected = true;
-            break;
+            conn->busy = false;
+            m_handshakes.erase(conn->fd);
+        }
+            resume_accept();
+            // records that came with the last flight may already be buffered in the ssl, read them on the data pool
+            m_tp.insert_task_normal(std::bind(&EpollTCPServer::recv, this, conn));
+            return;
         case -1:
-            close(conn->fd);
+            close_conn(conn);
             return;
         case 0:
         default:
             break;
         }
-        m_epoller.mod_event(conn->fd, EPOLLIN | EPOLLET | EPOLLONESHOT);
+        rearm(conn);
     }
 
-    void EpollTCPServer::recv(int32_t fd)
+    void EpollTCPServer::recv(std::shared_ptr<SSLConnInfo> conn)
     {
-        SSLConnInfo *conn = get_conn(fd);
-        if (!conn)
+        if (conn->closed || !enter(conn))
         {
             return;
         }
 
-        if (!conn->ssl_connected)
+        int32_t fd = conn->fd;
+        if (in_handshake(fd))
         {
             ssl_accept(conn);
             return;
         }
 
-        if (!m_callback_on_recv)
-        {
-            return;
-        }
-
-        uint8_t buf[4096];
+        // kept alive if the callback closes fd
+        TLSUtil::ssl_ptr ssl = conn->ssl;
+        uint8_t buf[TLSUtil::READ_BUFFER_SIZE];
         int ret = -1;
+        // replies sent from the callback leave in full records once it returns
+        m_tls.cork(ssl);
         // NIO, read multiple times
-        while (!m_stop)
+        while (!m_stop && !conn->closed)
         {
-            memset(buf, 0, sizeof(buf));
-            ret = m_tls.recv(conn->ssl, buf, sizeof(buf));
+            ret = m_tls.recv_all(ssl, buf, sizeof(buf));
             // if buffer is full, may need to read again
             if (ret > 0)
             {
-                m_callback_on_recv(*this, fd, conn->addr, conn->port, buf, ret);
+                if (m_callback_on_recv)
+                {
+                    m_callback_on_recv(*this, fd, conn->addr, conn->port, buf, ret);
+                }
                 if (sizeof(buf) == ret)
                 {
                     continue;
                 }
             }
-            else if (-1 == ret)
-            {
-                close(fd);
-                return;
-            }
             break;
         }
+        if (-1 == ret || -1 == m_tls.uncork(ssl))
+        {
+            close_conn(conn);
+            return;
+        }
         // reactivate
-        m_epoller.mod_event(fd, EPOLLIN | EPOLLET | EPOLLONESHOT);
+        rearm(conn);
+    }
+
+    bool EpollTCPServer::enter(const std::shared_ptr<SSLConnInfo> &conn)
+    {
+        // arm_output() may re-arm conn after epoll_wait gave an event but before its task started
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (conn->busy)
+        {
+            return false;
+        }
+        conn->busy = true;
+        return true;
+    }
+
+    void EpollTCPServer::rearm(const std::shared_ptr<SSLConnInfo> &conn)
+    {
+        // close_conn() takes it out of the epoller under m_mtx after marking it
+        // pending output is checked under m_mtx, a send seeing the connection busy leaves it to this
+        std::lock_guard<std::mutex> lock(m_mtx);
+        conn->busy = false;
+        if (!conn->closed)
+        {
+            bool pending = m_tls.pending(conn->ssl) > 0;
+            m_epoller.mod_event(conn->fd, EPOLLIN | EPOLLET | EPOLLONESHOT | (pending ? static_cast<uint32_t>(EPOLLOUT) : 0u));
+        }
+    }
+
+    void EpollTCPServer::arm_output(const std::shared_ptr<SSLConnInfo> &conn)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (!conn->busy && !conn->closed)
+        {
+            m_epoller.mod_event(conn->fd, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLONESHOT);
+        }
     }
+
     void EpollTCPServer::stop()
     {
         if (m_stop)
@@ -282,16 +562,30 @@ namespace soda
             close(iter->first);
             iter = m_conns.begin();
         }
-        std::lock_guard<std::mutex> lock(m_mtx);
-        m_conns.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_conns.clear();
+            m_handshakes.clear();
+        }
+        m_accept_deferred = false;
+        // unlocked, workers may be waiting for m_mtx
         m_epoller.stop();
+        m_hs_tp.stop();
         m_tp.stop();
         m_socket.stop();
     }
     void EpollTCPServer::close(int32_t fd)
     {
-        SSLConnInfo *conn = get_conn(fd);
-        if (!conn)
+        auto conn = get_conn(fd);
+        if (conn)
+        {
+            close_conn(conn);
+        }
+    }
+
+    void EpollTCPServer::close_conn(const std::shared_ptr<SSLConnInfo> &conn)
+    {
+        if (conn->closed.exchange(true))
         {
             return;
         }
@@ -301,10 +595,18 @@ namespace soda
             m_callback_on_disconn(*this, conn->addr, conn->port);
         }
 
-        std::lock_guard<std::mutex> lock(m_mtx);
-        m_epoller.del_event(fd);
-        m_conns.erase(fd);
-        m_socket.close_sockfd(fd);
+        int32_t fd = conn->fd;
+        bool handshaking = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_epoller.del_event(fd);
+            m_conns.erase(fd);
+            handshaking = m_handshakes.erase(fd) > 0;
+        }
+        if (handshaking)
+        {
+            resume_accept();
+        }
     }
 
     // -1 if failed
@@ -327,13 +629,14 @@ namespace soda
         m_epoller.start();
         m_epoller.add_event(m_sockfd, EPOLLIN | EPOLLET | EPOLLONESHOT);
         m_tp.start();
+        m_hs_tp.start();
         m_tp.insert_task_normal(std::bind(&EpollTCPServer::listen, this));
         return 0;
     }
 
     int EpollTCPServer::send(uint32_t fd, const void *src, size_t size)
     {
-        SSLConnInfo *conn = get_conn(fd);
+        auto conn = get_conn(fd);
         if (!conn)
         {
             return -1;
@@ -342,11 +645,46 @@ namespace soda
         int ret = m_tls.send(conn->ssl, src, size);
         if (-1 == ret)
         {
-            close(fd);
+            close_conn(conn);
+        }
+        else if (m_tls.pending(conn->ssl) > 0)
+        {
+            arm_output(conn);
         }
         return ret;
     }
 
+    int EpollTCPServer::sendfile(uint32_t fd, int srcfd, off_t *offset, size_t size)
+    {
+        auto conn = get_conn(fd);
+        if (!conn)
+        {
+            return -1;
+        }
+
+        int ret = m_tls.sendfile(conn->ssl, srcfd, offset, size);
+        if (-1 == ret)
+        {
+            close_conn(conn);
+        }
+        else if (m_tls.pending(conn->ssl) > 0)
+        {
+            arm_output(conn);
+        }
+        return ret;
+    }
+
+    void EpollTCPServer::set_ktls(bool enable) const
+    {
+        m_tls.set_ktls(enable);
+    }
+
+    bool EpollTCPServer::is_ktls(uint32_t fd)
+    {
+        auto conn = get_conn(fd);
+        return conn && m_tls.ktls_send(conn->ssl);
+    }
+
     void EpollTCPServer::send_to_all(const void *src, size_t size)
     {
         for (auto &&ele : m_conns)
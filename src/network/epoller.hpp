@@ -35,8 +35,9 @@ namespace soda
         ~Epoller();
 
         // The first value of failure is -1, and then the number of events is returned successfully
+        // timeout in ms, -1 to wait until an event comes; 0 events if it expires
         using check_res_t = std::tuple<int32_t, std::shared_ptr<epoll_event>>;
-        check_res_t check_once();
+        check_res_t check_once(int timeout = -1);
 
         // for restart mainly, constructor will start automaticlly
         void start();
@@ -52,12 +53,15 @@ namespace soda
         // -1 if failed, if it does not exist, it is considered as failure
         int mod_event(int32_t fd, int events);
 
+        // wake up epoll, check_once() reports an event with fd -1
+        void wakeup();
+
+        // the eventfd wakeup() writes to, for a loop waiting on something else, e.g. io_uring
+        int32_t wakeup_fd() const { return m_wfd; }
+
     private:
         // -1 if failed
         int init();
-
-        // wake up epoll
-        void wakeup();
     };
 
     // -1 if failed
@@ -101,7 +105,7 @@ namespace soda
     }
 
     // The first value of failure is -1, and then the number of events is returned successfully
-    Epoller::check_res_t Epoller::check_once()
+    Epoller::check_res_t Epoller::check_once(int timeout)
     {
         check_res_t result{-1, m_events};
         if (m_is_listening || m_stop)
@@ -112,7 +116,7 @@ namespace soda
         int ret = -1;
         do
         {
-            ret = epoll_wait(m_epfd, m_events.get(), EPOLL_MAX_ONCE_WAKEUP, -1);
+            ret = epoll_wait(m_epfd, m_events.get(), EPOLL_MAX_ONCE_WAKEUP, timeout);
         } while (-1 == ret && EINTR == errno);
 
         if (-1 == ret)
@@ -0,0 +1,401 @@
+#pragma once
+
+// framing - frame boundaries in a TCP byte stream: length prefix (varint, big endian u16/u32) or delimiter
+// FrameReceiver sits between a server and the handler: partial frames wait in a per-connection mirrored ring,
+// complete frames are passed in place, all frames completed by one read in one call
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <climits>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <sys/uio.h>
+
+#include "../buffer/ring_buffer.hpp"
+
+namespace soda
+{
+    // payload of one frame, valid only during the callback
+    struct Frame
+    {
+        const uint8_t *data;
+        size_t size;
+    };
+
+    class FrameCodec
+    {
+    public:
+        static const size_t DEFAULT_MAX_FRAME_SIZE = 16 * 1024 * 1024;
+        // header buffer passed to encode()
+        static const size_t MAX_HEADER_SIZE = 10;
+
+        virtual ~FrameCodec() {}
+
+        // -1 if the stream is invalid; 0 while the first frame is incomplete; otherwise its size with header and trailer
+        // checked: bytes of data known to hold no frame end, kept by the caller between calls for the same frame
+        virtual int decode(const uint8_t *data, size_t size, Frame *frame, size_t *checked) const = 0;
+
+        // -1 if too large; otherwise iovcnt: header (written to header), payload and trailer, for one sendv
+        virtual int encode(const void *src, size_t size, uint8_t *header, iovec *iov) const = 0;
+    };
+
+    class LengthCodec : public FrameCodec
+    {
+    public:
+        enum Type
+        {
+            // LEB128, 7 bits per byte, low bits first
+            VARINT,
+            U16,
+            U32
+        };
+
+        // max_size: larger payloads make the stream invalid
+        LengthCodec(Type type = U32, size_t max_size = DEFAULT_MAX_FRAME_SIZE);
+
+        int decode(const uint8_t *data, size_t size, Frame *frame, size_t *checked) const override;
+
+        int encode(const void *src, size_t size, uint8_t *header, iovec *iov) const override;
+
+    private:
+        Type m_type;
+        size_t m_max_size;
+    };
+
+    class DelimiterCodec : public FrameCodec
+    {
+    public:
+        // payloads must not contain the delimiter; max_size: larger payloads make the stream invalid
+        DelimiterCodec(const std::string &delimiter = "\n", size_t max_size = DEFAULT_MAX_FRAME_SIZE);
+
+        int decode(const uint8_t *data, size_t size, Frame *frame, size_t *checked) const override;
+
+        int encode(const void *src, size_t size, uint8_t *header, iovec *iov) const override;
+
+    private:
+        std::string m_delimiter;
+        size_t m_max_size;
+    };
+
+    // frames of many connections, keyed by fd; calls for one fd must not overlap, as the servers guarantee for recv callbacks
+    class FrameReceiver : Noncopyable
+    {
+        // initial ring, doubled as needed
+        static const size_t INPUT_BUFFER_SIZE = 16 * 1024;
+
+    public:
+        explicit FrameReceiver(std::shared_ptr<const FrameCodec> codec);
+
+        // -1 if the stream is invalid, the connection should be closed
+        // cb(const Frame *frames, size_t frame_size) gets the frames completed by data, if any
+        template <typename F>
+        int feed(int32_t fd, const std::string &addr, uint16_t port, const void *data, size_t size, F &&cb);
+
+        // forget what is buffered for fd, e.g. from the conn callback; a new peer on a reused fd is also detected by feed()
+        void reset(int32_t fd);
+
+        // recv callback for EpollTCPServer, PollTCPServer and SelectTCPServer:
+        // frames go to cb(s, fd, addr, port, frames, frame_size), an invalid stream closes the connection
+        template <typename Server>
+        static std::function<void(Server &, int32_t, const std::string &, uint16_t, const void *, size_t)>
+        recv_callback(std::shared_ptr<FrameReceiver> receiver,
+                      std::function<void(Server &, int32_t, const std::string &, uint16_t, const Frame *, size_t)> cb);
+
+    private:
+        struct Stream
+        {
+            std::string addr;
+            uint16_t port;
+            // partial frame, nullptr until one has to wait
+            std::unique_ptr<RingBuffer> input;
+            size_t checked;
+            // reused for every batch
+            std::vector<Frame> frames;
+        };
+
+        std::shared_ptr<const FrameCodec> m_codec;
+        std::unordered_map<int32_t, std::shared_ptr<Stream>> m_streams;
+        std::mutex m_mtx;
+
+    private:
+        // shared, reset() from another thread may drop it while a feed is still using it
+        std::shared_ptr<Stream> get_stream(int32_t fd, const std::string &addr, uint16_t port);
+
+        // -1 if failed
+        int append(Stream &stream, const void *src, size_t size);
+
+        // buffered bytes in one piece
+        RingBufferSpans peek(Stream &stream);
+    };
+
+    LengthCodec::LengthCodec(Type type, size_t max_size) : m_type(type),
+                                                           // frame sizes are returned as int
+                                                           m_max_size(max_size < INT_MAX - MAX_HEADER_SIZE ? max_size : INT_MAX - MAX_HEADER_SIZE) {}
+
+    int LengthCodec::decode(const uint8_t *data, size_t size, Frame *frame, size_t *) const
+    {
+        uint64_t len = 0;
+        size_t header = 0;
+        switch (m_type)
+        {
+        case VARINT:
+            for (size_t shift = 0;; shift += 7)
+            {
+                if (header >= size)
+                {
+                    return header >= MAX_HEADER_SIZE ? -1 : 0;
+                }
+                if (shift > 63)
+                {
+                    return -1;
+                }
+                uint8_t byte = data[header++];
+                len |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80))
+                {
+                    break;
+                }
+            }
+            break;
+        case U16:
+            if (size < 2)
+            {
+                return 0;
+            }
+            len = (static_cast<uint64_t>(data[0]) << 8) | data[1];
+            header = 2;
+            break;
+        case U32:
+            if (size < 4)
+            {
+                return 0;
+            }
+            len = (static_cast<uint64_t>(data[0]) << 24) | (static_cast<uint64_t>(data[1]) << 16) |
+                  (static_cast<uint64_t>(data[2]) << 8) | data[3];
+            header = 4;
+            break;
+        }
+
+        if (len > m_max_size)
+        {
+            return -1;
+        }
+        if (size - header < len)
+        {
+            return 0;
+        }
+        frame->data = data + header;
+        frame->size = len;
+        return header + len;
+    }
+
+    int LengthCodec::encode(const void *src, size_t size, uint8_t *header, iovec *iov) const
+    {
+        size_t len = 0;
+        if (size > m_max_size || (U16 == m_type && size > 0xffff))
+        {
+            return -1;
+        }
+
+        switch (m_type)
+        {
+        case VARINT:
+            for (size_t rest = size;; rest >>= 7)
+            {
+                header[len++] = (rest & 0x7f) | (rest > 0x7f ? 0x80 : 0);
+                if (rest <= 0x7f)
+                {
+                    break;
+                }
+            }
+            break;
+        case U16:
+            header[len++] = size >> 8;
+            header[len++] = size;
+            break;
+        case U32:
+            header[len++] = size >> 24;
+            header[len++] = size >> 16;
+            header[len++] = size >> 8;
+            header[len++] = size;
+            break;
+        }
+
+        iov[0] = {header, len};
+        iov[1] = {const_cast<void *>(src), size};
+        return 2;
+    }
+
+    DelimiterCodec::DelimiterCodec(const std::string &delimiter, size_t max_size) : m_delimiter(delimiter),
+                                                                                    m_max_size(max_size < INT_MAX - delimiter.size() ? max_size : INT_MAX - delimiter.size())
+    {
+        if (m_delimiter.empty())
+        {
+            ERROR_PRINT("empty delimiter");
+            m_delimiter = "\n";
+        }
+    }
+
+    int DelimiterCodec::decode(const uint8_t *data, size_t size, Frame *frame, size_t *checked) const
+    {
+        // a delimiter may start in the last bytes checked
+        size_t from = *checked >= m_delimiter.size() ? *checked - m_delimiter.size() + 1 : 0;
+        const void *pos = from < size ? memmem(data + from, size - from, m_delimiter.data(), m_delimiter.size()) : nullptr;
+        if (!pos)
+        {
+            *checked = size;
+            return size > m_max_size + m_delimiter.size() ? -1 : 0;
+        }
+
+        size_t len = reinterpret_cast<const uint8_t *>(pos) - data;
+        if (len > m_max_size)
+        {
+            return -1;
+        }
+        frame->data = data;
+        frame->size = len;
+        return len + m_delimiter.size();
+    }
+
+    int DelimiterCodec::encode(const void *src, size_t size, uint8_t *, iovec *iov) const
+    {
+        if (size > m_max_size)
+        {
+            return -1;
+        }
+        iov[0] = {const_cast<void *>(src), size};
+        iov[1] = {const_cast<char *>(m_delimiter.data()), m_delimiter.size()};
+        return 2;
+    }
+
+    FrameReceiver::FrameReceiver(std::shared_ptr<const FrameCodec> codec) : m_codec(std::move(codec)) {}
+
+    template <typename F>
+    int FrameReceiver::feed(int32_t fd, const std::string &addr, uint16_t port, const void *data, size_t size, F &&cb)
+    {
+        std::shared_ptr<Stream> holder = get_stream(fd, addr, port);
+        Stream &stream = *holder;
+
+        // nothing waiting: frames are parsed in the caller's buffer, only a partial tail is copied
+        const uint8_t *src = reinterpret_cast<const uint8_t *>(data);
+        bool buffered = stream.input && !stream.input->empty();
+        if (buffered)
+        {
+            if (-1 == append(stream, data, size))
+            {
+                return -1;
+            }
+            RingBufferSpans spans = peek(stream);
+            src = spans.first;
+            size = spans.first_size;
+        }
+
+        stream.frames.clear();
+        size_t pos = 0;
+        while (pos < size)
+        {
+            Frame frame;
+            int ret = m_codec->decode(src + pos, size - pos, &frame, &stream.checked);
+            if (-1 == ret)
+            {
+                return -1;
+            }
+            if (0 == ret)
+            {
+                break;
+            }
+            stream.frames.push_back(frame);
+            stream.checked = 0;
+            pos += ret;
+        }
+
+        if (!stream.frames.empty())
+        {
+            cb(stream.frames.data(), stream.frames.size());
+        }
+
+        if (buffered)
+        {
+            stream.input->consume(pos);
+        }
+        else if (pos < size && -1 == append(stream, src + pos, size - pos))
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    void FrameReceiver::reset(int32_t fd)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_streams.erase(fd);
+    }
+
+    template <typename Server>
+    std::function<void(Server &, int32_t, const std::string &, uint16_t, const void *, size_t)>
+    FrameReceiver::recv_callback(std::shared_ptr<FrameReceiver> receiver,
+                                 std::function<void(Server &, int32_t, const std::string &, uint16_t, const Frame *, size_t)> cb)
+    {
+        return [receiver, cb](Server &s, int32_t fd, const std::string &addr, uint16_t port, const void *data, size_t size)
+        {
+            int ret = receiver->feed(fd, addr, port, data, size, [&](const Frame *frames, size_t frame_size)
+                                     { cb(s, fd, addr, port, frames, frame_size); });
+            if (-1 == ret)
+            {
+                DEBUG_PRINT("invalid frame");
+                receiver->reset(fd);
+                s.close(fd);
+            }
+        };
+    }
+
+    std::shared_ptr<FrameReceiver::Stream> FrameReceiver::get_stream(int32_t fd, const std::string &addr, uint16_t port)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        std::shared_ptr<Stream> &stream = m_streams[fd];
+        if (!stream || stream->port != port || stream->addr != addr)
+        {
+            stream.reset(new Stream{addr, port, nullptr, 0, {}});
+        }
+        return stream;
+    }
+
+    int FrameReceiver::append(Stream &stream, const void *src, size_t size)
+    {
+        size_t buffered = stream.input ? stream.input->size() : 0;
+        if (!stream.input || stream.input->free_size() < size)
+        {
+            // mirrored, a frame crossing the end of the ring is still contiguous
+            size_t capacity = buffered + size > INPUT_BUFFER_SIZE ? buffered + size : INPUT_BUFFER_SIZE;
+            std::unique_ptr<RingBuffer> input(new RingBuffer(capacity, true));
+            if (stream.input)
+            {
+                RingBufferSpans spans = stream.input->peek();
+                input->write(spans.first, spans.first_size);
+                input->write(spans.second, spans.second_size);
+            }
+            stream.input = std::move(input);
+        }
+        return size == stream.input->write(src, size) ? 0 : -1;
+    }
+
+    RingBufferSpans FrameReceiver::peek(Stream &stream)
+    {
+        RingBufferSpans spans = stream.input->peek();
+        if (0 == spans.second_size)
+        {
+            return spans;
+        }
+
+        // mapping the mirror failed, rewrite from the start of a new ring
+        std::unique_ptr<RingBuffer> input(new RingBuffer(stream.input->capacity(), true));
+        input->write(spans.first, spans.first_size);
+        input->write(spans.second, spans.second_size);
+        stream.input = std::move(input);
+        return stream.input->peek();
+    }
+
+} // namespace soda
@@ -0,0 +1,496 @@
+#pragma once
+
+// io_uring - submission and completion rings on the raw syscalls, no liburing; one provided buffer ring for multishot recv
+// not thread safe: one thread queues, submits and reaps, e.g. an event loop
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+
+#include "../general/util.hpp"
+
+namespace soda
+{
+    class IOUring : Noncopyable
+    {
+    public:
+        static const unsigned DEFAULT_ENTRIES = 1024;
+
+        // entries: submission queue size, the completion queue gets 4 times as many
+        explicit IOUring(unsigned entries = DEFAULT_ENTRIES);
+        ~IOUring();
+
+        // false if setup failed, e.g. io_uring disabled
+        bool valid() const { return -1 != m_fd; }
+
+        // multishot accept and recv, provided buffer rings and wait timeouts all work; probed once
+        static bool supported();
+
+        // a zeroed entry to fill, submits first if the queue is full; nullptr if failed
+        io_uring_sqe *get_sqe();
+
+        // -1 if failed; submit what was queued, then wait until a completion is ready or timeout ms pass, -1 for no limit
+        int submit_and_wait(int timeout);
+
+        // fn(const io_uring_cqe &) for each ready completion; the number seen
+        template <typename F>
+        size_t for_each_cqe(F fn);
+
+        // -1 if failed; count (a power of 2) buffers of size bytes the kernel picks from for recvs of group
+        int setup_buffers(uint16_t group, uint16_t count, uint32_t size);
+
+        // the buffer a completion with IORING_CQE_F_BUFFER filled
+        uint8_t *buffer(uint16_t bid) const { return m_buffers + static_cast<size_t>(bid) * m_buffer_size; }
+
+        // hand a filled buffer back to the kernel
+        void recycle_buffer(uint16_t bid);
+
+        // -1 if failed; queue common requests, one completion per result while IORING_CQE_F_MORE is set
+
+        int accept_multishot(int fd, uint64_t user_data);
+
+        int recv_multishot(int fd, uint16_t group, uint64_t user_data);
+
+        int poll(int fd, uint32_t events, bool multishot, uint64_t user_data);
+
+        // cancel the poll queued with target as its user_data; its completion comes with -ECANCELED
+        int poll_remove(uint64_t target, uint64_t user_data);
+
+        // cancel any request queued with target as its user_data, e.g. a multishot recv; -ENOENT if it is done
+        int cancel(uint64_t target, uint64_t user_data);
+
+    private:
+        int32_t m_fd;
+        uint32_t m_features;
+
+        void *m_sq_ring;
+        size_t m_sq_ring_size;
+        void *m_cq_ring;
+        size_t m_cq_ring_size;
+        io_uring_sqe *m_sqes;
+        size_t m_sqes_size;
+
+        unsigned *m_sq_head;
+        unsigned *m_sq_tail;
+        unsigned m_sq_mask;
+        unsigned m_sq_entries;
+        // the next entry handed out, published to m_sq_tail on submit
+        unsigned m_sqe_tail;
+
+        unsigned *m_cq_head;
+        unsigned *m_cq_tail;
+        unsigned m_cq_mask;
+        io_uring_cqe *m_cqes;
+
+        io_uring_buf_ring *m_buf_ring;
+        size_t m_buf_ring_size;
+        uint16_t m_buf_mask;
+        uint16_t m_buf_tail;
+        uint8_t *m_buffers;
+        size_t m_buffers_size;
+        uint32_t m_buffer_size;
+
+    private:
+        // -1 if failed
+        int init(unsigned entries);
+
+        void release();
+
+        // -1 if failed; the number submitted
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t arg_size);
+
+        static bool probe();
+    };
+
+    IOUring::IOUring(unsigned entries) : m_fd(-1),
+                                         m_features(0),
+                                         m_sq_ring(MAP_FAILED),
+                                         m_sq_ring_size(0),
+                                         m_cq_ring(MAP_FAILED),
+                                         m_cq_ring_size(0),
+                                         m_sqes(nullptr),
+                                         m_sqes_size(0),
+                                         m_sq_head(nullptr),
+                                         m_sq_tail(nullptr),
+                                         m_sq_mask(0),
+                                         m_sq_entries(0),
+                                         m_sqe_tail(0),
+                                         m_cq_head(nullptr),
+                                         m_cq_tail(nullptr),
+                                         m_cq_mask(0),
+                                         m_cqes(nullptr),
+                                         m_buf_ring(nullptr),
+                                         m_buf_ring_size(0),
+                                         m_buf_mask(0),
+                                         m_buf_tail(0),
+                                         m_buffers(nullptr),
+                                         m_buffers_size(0),
+                                         m_buffer_size(0)
+    {
+        if (-1 == init(entries))
+        {
+            release();
+        }
+    }
+
+    IOUring::~IOUring()
+    {
+        release();
+    }
+
+    int IOUring::init(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        // multishot recvs of many connections share it, let bursts queue up instead of overflowing
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        m_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (-1 == m_fd)
+        {
+            perror("io_uring setup failed");
+            return -1;
+        }
+        m_features = params.features;
+
+        m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        // one mapping for both rings since 5.4
+        if (m_features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+        }
+        m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (MAP_FAILED == m_sq_ring)
+        {
+            perror("io_uring mmap failed");
+            return -1;
+        }
+        if (m_features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_cq_ring = m_sq_ring;
+        }
+        else
+        {
+            m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (MAP_FAILED == m_cq_ring)
+            {
+                perror("io_uring mmap failed");
+                return -1;
+            }
+        }
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (MAP_FAILED == sqes)
+        {
+            perror("io_uring mmap failed");
+            return -1;
+        }
+        m_sqes = reinterpret_cast<io_uring_sqe *>(sqes);
+
+        uint8_t *sq = reinterpret_cast<uint8_t *>(m_sq_ring);
+        m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sq_entries = params.sq_entries;
+        m_sqe_tail = *m_sq_tail;
+        // entries are used in order, the indirection array is set up once
+        unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < m_sq_entries; ++i)
+        {
+            array[i] = i;
+        }
+
+        uint8_t *cq = reinterpret_cast<uint8_t *>(m_cq_ring);
+        m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return 0;
+    }
+
+    void IOUring::release()
+    {
+        // requests still pending are cancelled with the ring
+        if (-1 != m_fd)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+        if (m_sqes)
+        {
+            munmap(m_sqes, m_sqes_size);
+            m_sqes = nullptr;
+        }
+        if (MAP_FAILED != m_cq_ring && m_cq_ring != m_sq_ring)
+        {
+            munmap(m_cq_ring, m_cq_ring_size);
+        }
+        m_cq_ring = MAP_FAILED;
+        if (MAP_FAILED != m_sq_ring)
+        {
+            munmap(m_sq_ring, m_sq_ring_size);
+            m_sq_ring = MAP_FAILED;
+        }
+        if (m_buf_ring)
+        {
+            munmap(m_buf_ring, m_buf_ring_size);
+            m_buf_ring = nullptr;
+        }
+        if (m_buffers)
+        {
+            munmap(m_buffers, m_buffers_size);
+            m_buffers = nullptr;
+        }
+    }
+
+    int IOUring::enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t arg_size)
+    {
+        int ret = -1;
+        do
+        {
+            ret = syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, arg, arg_size);
+        } while (-1 == ret && EINTR == errno);
+        return ret;
+    }
+
+    io_uring_sqe *IOUring::get_sqe()
+    {
+        if (m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+        {
+            __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+            if (-1 == enter(m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE), 0, 0, nullptr, 0))
+            {
+                perror("io_uring submit failed");
+                return nullptr;
+            }
+            if (m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+            {
+                return nullptr;
+            }
+        }
+
+        io_uring_sqe *sqe = &m_sqes[m_sqe_tail & m_sq_mask];
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        ++m_sqe_tail;
+        return sqe;
+    }
+
+    int IOUring::submit_and_wait(int timeout)
+    {
+        __atomic_store_n(m_sq_tail, m_sqe_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = m_sqe_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        // completions left from the last round are reaped without waiting
+        bool ready = *m_cq_head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+
+        __kernel_timespec ts;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000LL;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = timeout >= 0 ? reinterpret_cast<uint64_t>(&ts) : 0;
+
+        int ret = enter(to_submit, ready ? 0 : 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        // timed out, or the completion queue has to be reaped first
+        if (-1 == ret && (ETIME == errno || EBUSY == errno || EAGAIN == errno))
+        {
+            return 0;
+        }
+        if (-1 == ret)
+        {
+            perror("io_uring enter failed");
+        }
+        return ret;
+    }
+
+    template <typename F>
+    size_t IOUring::for_each_cqe(F fn)
+    {
+        size_t size = 0;
+        unsigned head = *m_cq_head;
+        while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+        {
+            // a copy, the slot is handed back before fn runs and may queue more
+            io_uring_cqe cqe = m_cqes[head & m_cq_mask];
+            __atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+            fn(cqe);
+            ++size;
+        }
+        return size;
+    }
+
+    int IOUring::setup_buffers(uint16_t group, uint16_t count, uint32_t size)
+    {
+        if (m_buf_ring || 0 == count || 0 != (count & (count - 1)))
+        {
+            return -1;
+        }
+
+        m_buf_ring_size = count * sizeof(io_uring_buf);
+        void *ring = mmap(nullptr, m_buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        m_buffers_size = static_cast<size_t>(count) * size;
+        void *buffers = mmap(nullptr, m_buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == ring || MAP_FAILED == buffers)
+        {
+            perror("io_uring buffer mmap failed");
+            if (MAP_FAILED != ring)
+            {
+                munmap(ring, m_buf_ring_size);
+            }
+            if (MAP_FAILED != buffers)
+            {
+                munmap(buffers, m_buffers_size);
+            }
+            return -1;
+        }
+        m_buf_ring = reinterpret_cast<io_uring_buf_ring *>(ring);
+        m_buffers = reinterpret_cast<uint8_t *>(buffers);
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+        reg.ring_entries = count;
+        reg.bgid = group;
+        // since 5.19
+        if (-1 == syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+        {
+            perror("io_uring register buffers failed");
+            return -1;
+        }
+
+        m_buffer_size = size;
+        m_buf_mask = count - 1;
+        for (uint16_t bid = 0; bid < count; ++bid)
+        {
+            recycle_buffer(bid);
+        }
+        return 0;
+    }
+
+    void IOUring::recycle_buffer(uint16_t bid)
+    {
+        // not bufs[]: the flexible array of the uapi header is misplaced in C++, entries start at the ring itself
+        io_uring_buf *buf = reinterpret_cast<io_uring_buf *>(m_buf_ring) + (m_buf_tail & m_buf_mask);
+        buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+        buf->len = m_buffer_size;
+        buf->bid = bid;
+        __atomic_store_n(&m_buf_ring->tail, ++m_buf_tail, __ATOMIC_RELEASE);
+    }
+
+    int IOUring::accept_multishot(int fd, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe)
+        {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        // no fcntl afterwards
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data;
+        return 0;
+    }
+
+    int IOUring::recv_multishot(int fd, uint16_t group, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe)
+        {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = group;
+        sqe->user_data = user_data;
+        return 0;
+    }
+
+    int IOUring::poll(int fd, uint32_t events, bool multishot, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe)
+        {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = events;
+        sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+        sqe->user_data = user_data;
+        return 0;
+    }
+
+    int IOUring::poll_remove(uint64_t target, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe)
+        {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = user_data;
+        return 0;
+    }
+
+    int IOUring::cancel(uint64_t target, uint64_t user_data)
+    {
+        io_uring_sqe *sqe = get_sqe();
+        if (!sqe)
+        {
+            return -1;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = user_data;
+        return 0;
+    }
+
+    bool IOUring::supported()
+    {
+        static const bool ok = probe();
+        return ok;
+    }
+
+    bool IOUring::probe()
+    {
+        IOUring ring(8);
+        if (!ring.valid() || !(ring.m_features & IORING_FEAT_EXT_ARG) || -1 == ring.setup_buffers(0, 2, 64))
+        {
+            return false;
+        }
+
+        // multishot recv came last (6.0), see that one byte arrives and the request stays armed
+        int fds[2];
+        if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+        {
+            return false;
+        }
+        bool ok = false;
+        if (0 == ring.recv_multishot(fds[0], 0, 1) && 1 == ::write(fds[1], "x", 1))
+        {
+            ring.submit_and_wait(1000);
+            ring.for_each_cqe([&](const io_uring_cqe &cqe)
+                              { ok = 1 == cqe.res && (cqe.flags & IORING_CQE_F_BUFFER) && (cqe.flags & IORING_CQE_F_MORE); });
+        }
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return ok;
+    }
+
+} // namespace soda
@@ -0,0 +1,633 @@
+#pragma once
+
+// multiplexer - readiness of many fds behind one interface: select, poll, epoll or io_uring, picked at runtime
+// oneshot: a reported fd is not reported again until arm(), one thread at a time reads it
+// select, poll and io_uring keep their sets on the waiting thread, changes from other threads are queued and taken in
+// one batch per wait; epoll changes its set directly
+
+#include <sys/select.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "epoller.hpp"
+#include "io_uring.hpp"
+#include "../general/util.hpp"
+
+namespace soda
+{
+    class Multiplexer : Noncopyable
+    {
+    public:
+        enum Type
+        {
+            MUX_SELECT,
+            MUX_POLL,
+            MUX_EPOLL,
+            MUX_IO_URING
+        };
+
+        // nullptr if failed; io_uring falls back to epoll where the kernel lacks it
+        static std::unique_ptr<Multiplexer> create(Type type);
+
+        virtual ~Multiplexer() {}
+
+        virtual Type type() const = 0;
+
+        // watch fd for reading, armed
+        // -1 if failed
+        virtual int add(int fd) = 0;
+
+        // fd is reported again once it is readable
+        // -1 if failed
+        virtual int arm(int fd) = 0;
+
+        // stop watching fd and close it once no wait looks at it
+        // -1 if failed
+        virtual int close(int fd) = 0;
+
+        // ready fds into ready, cleared first; timeout in ms, -1 to wait until one comes or wakeup()
+        // -1 if failed; the number of ready fds
+        virtual int wait(std::vector<int> &ready, int timeout = -1) = 0;
+
+        virtual void wakeup() = 0;
+    };
+
+    // changes from any thread wait in a queue, the waiting thread applies them before it waits again
+    class QueuedMultiplexer : public Multiplexer
+    {
+    public:
+        int add(int fd) override;
+        int arm(int fd) override;
+        int close(int fd) override;
+        void wakeup() override;
+
+    protected:
+        enum OpType
+        {
+            OP_ADD,
+            OP_ARM,
+            OP_CLOSE
+        };
+
+        struct Op
+        {
+            OpType type;
+            int fd;
+        };
+
+        QueuedMultiplexer();
+        // fds whose close is still queued are closed
+        ~QueuedMultiplexer();
+
+        // the waiting thread: all queued changes, in order
+        std::vector<Op> &take();
+
+        // the waiting thread: after m_wfd was readable
+        void clear_wakeup();
+
+        // readable after wakeup() or a change queued while the queue was empty
+        int32_t m_wfd;
+
+    private:
+        // -1 if failed
+        int push(OpType type, int fd);
+
+        std::mutex m_mtx;
+        std::vector<Op> m_ops;
+        // swapped with m_ops by take()
+        std::vector<Op> m_taken;
+    };
+
+    // the fd set is a bitmap grown with the highest fd, past FD_SETSIZE; ready fds are found a word at a time
+    class SelectMultiplexer : public QueuedMultiplexer
+    {
+        // fds in a word of an fd_set, as the kernel lays it out
+        static const size_t FD_BITS = sizeof(unsigned long) * CHAR_BIT;
+
+    public:
+        SelectMultiplexer();
+
+        Type type() const override { return MUX_SELECT; }
+
+        int wait(std::vector<int> &ready, int timeout = -1) override;
+
+    private:
+        // armed fds, words of an fd_set of any size
+        std::vector<unsigned long> m_fds;
+        // copy handed to select
+        std::vector<unsigned long> m_ready;
+        // highest fd in m_fds
+        int32_t m_max_fd;
+
+    private:
+        void set_fd(int fd);
+
+        void clr_fd(int fd);
+    };
+
+    // pollfds indexed by fd, armed ones kept in front and only those polled; removal is swap-remove
+    class PollMultiplexer : public QueuedMultiplexer
+    {
+    public:
+        PollMultiplexer();
+
+        Type type() const override { return MUX_POLL; }
+
+        int wait(std::vector<int> &ready, int timeout = -1) override;
+
+    private:
+        // [0] m_wfd, armed fds, then the ones reported and not yet armed again
+        std::vector<pollfd> m_fds;
+        size_t m_armed_size;
+        // fd -> index in m_fds, -1 if none
+        std::vector<int32_t> m_slots;
+
+    private:
+        void add_pollfd(int fd);
+
+        void del_pollfd(int fd);
+
+        void arm_pollfd(int fd);
+
+        // the last armed one takes its place
+        void disarm(size_t slot);
+
+        void swap_pollfd(size_t a, size_t b);
+    };
+
+    // EPOLLONESHOT, re-armed by EPOLL_CTL_MOD from any thread
+    class EpollMultiplexer : public Multiplexer
+    {
+    public:
+        Type type() const override { return MUX_EPOLL; }
+
+        int add(int fd) override;
+        int arm(int fd) override;
+        int close(int fd) override;
+        int wait(std::vector<int> &ready, int timeout = -1) override;
+        void wakeup() override;
+
+    private:
+        Epoller m_epoller;
+    };
+
+    // a oneshot IORING_OP_POLL_ADD per armed fd; the generation of the fd in user_data tells a completion of a closed fd
+    // from one of a new fd with the same number
+    class IOUringMultiplexer : public QueuedMultiplexer
+    {
+        // user_data of the multishot poll on m_wfd and of poll removals
+        static const uint64_t WAKEUP_DATA = UINT64_MAX;
+        static const uint64_t REMOVE_DATA = UINT64_MAX - 1;
+
+    public:
+        IOUringMultiplexer();
+
+        // false if the ring could not be set up
+        bool valid() const { return m_ring.valid(); }
+
+        Type type() const override { return MUX_IO_URING; }
+
+        int wait(std::vector<int> &ready, int timeout = -1) override;
+
+    private:
+        IOUring m_ring;
+        // fd -> generation, bumped on close
+        std::vector<uint32_t> m_gens;
+
+    private:
+        uint64_t user_data(int fd) const;
+    };
+
+    std::unique_ptr<Multiplexer> Multiplexer::create(Type type)
+    {
+        switch (type)
+        {
+        case MUX_SELECT:
+            return std::unique_ptr<Multiplexer>(new SelectMultiplexer());
+        case MUX_POLL:
+            return std::unique_ptr<Multiplexer>(new PollMultiplexer());
+        case MUX_IO_URING:
+            if (IOUring::supported())
+            {
+                std::unique_ptr<IOUringMultiplexer> mux(new IOUringMultiplexer());
+                if (mux->valid())
+                {
+                    return std::unique_ptr<Multiplexer>(mux.release());
+                }
+            }
+            DEBUG_PRINT("io_uring unavailable, using epoll");
+            return std::unique_ptr<Multiplexer>(new EpollMultiplexer());
+        case MUX_EPOLL:
+        default:
+            return std::unique_ptr<Multiplexer>(new EpollMultiplexer());
+        }
+    }
+
+    QueuedMultiplexer::QueuedMultiplexer() : m_wfd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        if (-1 == m_wfd)
+        {
+            perror("eventfd create failed");
+        }
+    }
+
+    QueuedMultiplexer::~QueuedMultiplexer()
+    {
+        for (auto &&op : m_ops)
+        {
+            if (OP_CLOSE == op.type)
+            {
+                ::close(op.fd);
+            }
+        }
+        if (-1 != m_wfd)
+        {
+            ::close(m_wfd);
+        }
+    }
+
+    int QueuedMultiplexer::add(int fd)
+    {
+        return push(OP_ADD, fd);
+    }
+
+    int QueuedMultiplexer::arm(int fd)
+    {
+        return push(OP_ARM, fd);
+    }
+
+    int QueuedMultiplexer::close(int fd)
+    {
+        return push(OP_CLOSE, fd);
+    }
+
+    int QueuedMultiplexer::push(OpType type, int fd)
+    {
+        if (fd < 0)
+        {
+            return -1;
+        }
+        bool first = false;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            first = m_ops.empty();
+            m_ops.push_back(Op{type, fd});
+        }
+        // later ones ride on the same wakeup
+        if (first)
+        {
+            wakeup();
+        }
+        return 0;
+    }
+
+    void QueuedMultiplexer::wakeup()
+    {
+        uint64_t one = 1;
+        if (-1 == write(m_wfd, &one, sizeof(one)) && EAGAIN != errno)
+        {
+            perror("wakeup failed");
+        }
+    }
+
+    std::vector<QueuedMultiplexer::Op> &QueuedMultiplexer::take()
+    {
+        m_taken.clear();
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_taken.swap(m_ops);
+        return m_taken;
+    }
+
+    void QueuedMultiplexer::clear_wakeup()
+    {
+        uint64_t count = 0;
+        read(m_wfd, &count, sizeof(count));
+    }
+
+    SelectMultiplexer::SelectMultiplexer() : m_max_fd(-1)
+    {
+        set_fd(m_wfd);
+    }
+
+    int SelectMultiplexer::wait(std::vector<int> &ready, int timeout)
+    {
+        ready.clear();
+        for (auto &&op : take())
+        {
+            if (OP_CLOSE == op.type)
+            {
+                clr_fd(op.fd);
+                ::close(op.fd);
+            }
+            else
+            {
+                set_fd(op.fd);
+            }
+        }
+
+        m_ready.assign(m_fds.begin(), m_fds.begin() + m_max_fd / FD_BITS + 1);
+        timeval tv{timeout / 1000, (timeout % 1000) * 1000};
+        int act_size = select(m_max_fd + 1, reinterpret_cast<fd_set *>(m_ready.data()), nullptr, nullptr,
+                              timeout >= 0 ? &tv : nullptr);
+        if (-1 == act_size)
+        {
+            if (EINTR == errno)
+            {
+                return 0;
+            }
+            perror("select error");
+            return -1;
+        }
+
+        for (size_t i = 0; i < m_ready.size() && act_size > 0; ++i)
+        {
+            unsigned long bits = m_ready[i];
+            act_size -= __builtin_popcountl(bits);
+            while (bits)
+            {
+                int fd = i * FD_BITS + __builtin_ctzl(bits);
+                bits &= bits - 1;
+                if (fd == m_wfd)
+                {
+                    clear_wakeup();
+                    continue;
+                }
+                // oneshot
+                clr_fd(fd);
+                ready.push_back(fd);
+            }
+        }
+        return ready.size();
+    }
+
+    void SelectMultiplexer::set_fd(int fd)
+    {
+        size_t word = fd / FD_BITS;
+        if (word >= m_fds.size())
+        {
+            m_fds.resize(word + 1, 0);
+        }
+        m_fds[word] |= 1UL << (fd % FD_BITS);
+        if (fd > m_max_fd)
+        {
+            m_max_fd = fd;
+        }
+    }
+
+    void SelectMultiplexer::clr_fd(int fd)
+    {
+        size_t word = fd / FD_BITS;
+        if (word >= m_fds.size())
+        {
+            return;
+        }
+        m_fds[word] &= ~(1UL << (fd % FD_BITS));
+        if (fd == m_max_fd)
+        {
+            // down to the next set bit, a word at a time; m_wfd stays
+            for (size_t i = word + 1; i-- > 0;)
+            {
+                if (m_fds[i])
+                {
+                    m_max_fd = i * FD_BITS + FD_BITS - 1 - __builtin_clzl(m_fds[i]);
+                    break;
+                }
+            }
+        }
+    }
+
+    PollMultiplexer::PollMultiplexer() : m_armed_size(0)
+    {
+        add_pollfd(m_wfd);
+    }
+
+    int PollMultiplexer::wait(std::vector<int> &ready, int timeout)
+    {
+        ready.clear();
+        for (auto &&op : take())
+        {
+            switch (op.type)
+            {
+            case OP_ADD:
+                add_pollfd(op.fd);
+                break;
+            case OP_ARM:
+                arm_pollfd(op.fd);
+                break;
+            case OP_CLOSE:
+                del_pollfd(op.fd);
+                ::close(op.fd);
+                break;
+            }
+        }
+
+        // the armed part only
+        int act_size = poll(m_fds.data(), m_armed_size, timeout);
+        if (-1 == act_size)
+        {
+            if (EINTR == errno)
+            {
+                return 0;
+            }
+            perror("poll error");
+            return -1;
+        }
+
+        if (m_fds[0].revents)
+        {
+            --act_size;
+            clear_wakeup();
+        }
+        // until the last ready one
+        for (size_t i = 1; i < m_armed_size && act_size > 0;)
+        {
+            if (0 == m_fds[i].revents)
+            {
+                ++i;
+                continue;
+            }
+            // hang-ups and errors too, the reader finds out
+            --act_size;
+            ready.push_back(m_fds[i].fd);
+            // the last armed one moves to i and is checked next
+            disarm(i);
+        }
+        return ready.size();
+    }
+
+    void PollMultiplexer::add_pollfd(int fd)
+    {
+        if (static_cast<size_t>(fd) >= m_slots.size())
+        {
+            m_slots.resize(fd + 1, -1);
+        }
+        if (-1 == m_slots[fd])
+        {
+            m_slots[fd] = m_fds.size();
+            pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            m_fds.push_back(pfd);
+        }
+        arm_pollfd(fd);
+    }
+
+    void PollMultiplexer::del_pollfd(int fd)
+    {
+        if (static_cast<size_t>(fd) >= m_slots.size() || -1 == m_slots[fd])
+        {
+            return;
+        }
+        size_t slot = m_slots[fd];
+        if (slot < m_armed_size)
+        {
+            disarm(slot);
+            slot = m_armed_size;
+        }
+        swap_pollfd(slot, m_fds.size() - 1);
+        m_fds.pop_back();
+        m_slots[fd] = -1;
+    }
+
+    void PollMultiplexer::arm_pollfd(int fd)
+    {
+        if (static_cast<size_t>(fd) >= m_slots.size() || -1 == m_slots[fd] ||
+            static_cast<size_t>(m_slots[fd]) < m_armed_size)
+        {
+            return;
+        }
+        swap_pollfd(m_slots[fd], m_armed_size);
+        m_fds[m_armed_size].revents = 0;
+        ++m_armed_size;
+    }
+
+    void PollMultiplexer::disarm(size_t slot)
+    {
+        --m_armed_size;
+        swap_pollfd(slot, m_armed_size);
+    }
+
+    void PollMultiplexer::swap_pollfd(size_t a, size_t b)
+    {
+        if (a == b)
+        {
+            return;
+        }
+        std::swap(m_fds[a], m_fds[b]);
+        m_slots[m_fds[a].fd] = a;
+        m_slots[m_fds[b].fd] = b;
+    }
+
+    int EpollMultiplexer::add(int fd)
+    {
+        return m_epoller.add_event(fd, EPOLLIN | EPOLLONESHOT);
+    }
+
+    int EpollMultiplexer::arm(int fd)
+    {
+        return m_epoller.mod_event(fd, EPOLLIN | EPOLLONESHOT);
+    }
+
+    int EpollMultiplexer::close(int fd)
+    {
+        m_epoller.del_event(fd);
+        return ::close(fd);
+    }
+
+    int EpollMultiplexer::wait(std::vector<int> &ready, int timeout)
+    {
+        ready.clear();
+        auto &&res = m_epoller.check_once(timeout);
+        int size = std::get<0>(res);
+        if (-1 == size)
+        {
+            return -1;
+        }
+        auto &&events = std::get<1>(res).get();
+        for (int i = 0; i < size; ++i)
+        {
+            // -1 for wakeup()
+            if (-1 != events[i].data.fd)
+            {
+                ready.push_back(events[i].data.fd);
+            }
+        }
+        return ready.size();
+    }
+
+    void EpollMultiplexer::wakeup()
+    {
+        m_epoller.wakeup();
+    }
+
+    IOUringMultiplexer::IOUringMultiplexer()
+    {
+        if (m_ring.valid())
+        {
+            m_ring.poll(m_wfd, POLLIN, true, WAKEUP_DATA);
+        }
+    }
+
+    uint64_t IOUringMultiplexer::user_data(int fd) const
+    {
+        return (static_cast<uint64_t>(m_gens[fd]) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    int IOUringMultiplexer::wait(std::vector<int> &ready, int timeout)
+    {
+        ready.clear();
+        for (auto &&op : take())
+        {
+            if (static_cast<size_t>(op.fd) >= m_gens.size())
+            {
+                m_gens.resize(op.fd + 1, 0);
+            }
+            if (OP_CLOSE == op.type)
+            {
+                // a pending poll holds the file, it is cancelled; ENOENT if the fd was not armed
+                m_ring.poll_remove(user_data(op.fd), REMOVE_DATA);
+                ++m_gens[op.fd];
+                ::close(op.fd);
+            }
+            else
+            {
+                m_ring.poll(op.fd, POLLIN, false, user_data(op.fd));
+            }
+        }
+
+        if (-1 == m_ring.submit_and_wait(timeout))
+        {
+            return -1;
+        }
+        m_ring.for_each_cqe([this, &ready](const io_uring_cqe &cqe)
+                            {
+            if (WAKEUP_DATA == cqe.user_data)
+            {
+                clear_wakeup();
+                if (!(cqe.flags & IORING_CQE_F_MORE))
+                {
+                    m_ring.poll(m_wfd, POLLIN, true, WAKEUP_DATA);
+                }
+                return;
+            }
+            if (REMOVE_DATA == cqe.user_data)
+            {
+                return;
+            }
+            int fd = static_cast<int32_t>(cqe.user_data & UINT32_MAX);
+            // not of an fd closed meanwhile
+            if (static_cast<size_t>(fd) < m_gens.size() && m_gens[fd] == cqe.user_data >> 32)
+            {
+                ready.push_back(fd);
+            } });
+        return ready.size();
+    }
+
+} // namespace soda
@@ -6,12 +6,17 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <memory>
+#include <vector>
 #include <netdb.h>
 #include <cstring>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <time.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
 
 #include "../general/util.hpp"
 
@@ -51,15 +56,15 @@ namespace soda
         SocketUtil(const std::string &addr, uint16_t port, int socktype, int protocol);
         ~SocketUtil();
 
+        // -1 if failed; reuseport: several listeners on the same addr and port, the kernel spreads connections among them
+        int start_tcp_server(const std::string &addr, uint16_t port, bool reuseport = false);
         // -1 if failed
-        int start_tcp_server(const std::string &addr, uint16_t port);
-        // -1 if failed
-        int start_tcp_server();
+        int start_tcp_server(bool reuseport = false);
 
+        // -1 if failed; reuseport: several sockets on the same addr and port, the kernel spreads datagrams among them
+        int start_udp_server(const std::string &addr, uint16_t port, bool reuseport = false);
         // -1 if failed
-        int start_udp_server(const std::string &addr, uint16_t port);
-        // -1 if failed
-        int start_udp_server();
+        int start_udp_server(bool reuseport = false);
 
         // -1 if failed
         int start_tcp_client(const std::string &addr, uint16_t port);
@@ -85,6 +90,11 @@ namespace soda
         // -1 if failed
         int set_reuseport();
 
+        // steer among the SO_REUSEPORT group of fd: prog returns the index of the socket in bind order,
+        // an index out of range falls back to the 4-tuple hash
+        // -1 if failed, e.g. kernel before 4.5
+        int set_reuseport_cbpf(int fd, const std::vector<sock_filter> &prog);
+
         // 1 is on, 0 is off, how many seconds to start monitoring after being idle, and the time interval for each detection, how many times at most
         // -1 if failed
         int set_keepalive(bool enable, int idle, int interval, int maxpkt);
@@ -128,9 +138,20 @@ namespace soda
         // -1 if failed or disconnected; received length on success; 0 if there is no data to read
         int recv(uint32_t fd, void *dst, size_t size, int flags = 0);
 
+        // scatter receive into at most IOV_MAX spans in one syscall
+        // -1 if failed or disconnected; received length on success; 0 if there is no data to read
+        int recvv(uint32_t fd, const iovec *iov, int iovcnt);
+
         // -1 if failed or disconnected; received length on success; 0 if there is no data to read
         int recv_from(uint32_t fd, void *dst, size_t size, AddrInfo *ai, int flags = 0);
 
+        // receive up to vlen datagrams in one syscall; MSG_WAITFORONE blocks only until the first one
+        // -1 if failed; the number of messages received, 0 if there is none on a non-blocking socket
+        int recv_batch(uint32_t fd, mmsghdr *msgs, unsigned int vlen, int flags = 0);
+
+        // -1 if failed; address and port of the peer of a connected fd
+        int get_peer(int fd, AddrInfo *ai);
+
         // close sockfd, just dereference, when all references are closed, it will be really closed, if it is a connection, send fin
         // -1 if failed
         int close_sockfd(int fd);
@@ -141,12 +162,39 @@ namespace soda
 
         int connect_sock();
 
-        // -1 if failed; success returns the amount of data sent
+        // -1 if failed; success returns the amount of data sent, 0 if a non-blocking socket is full
         int send(uint32_t fd, const void *src, size_t size, int flags = 0);
 
+        // gather send of at most IOV_MAX spans in one syscall
+        // -1 if failed; success returns the amount of data sent, 0 if a non-blocking socket is full
+        int sendv(uint32_t fd, const iovec *iov, int iovcnt, int flags = 0);
+
+        // allow MSG_ZEROCOPY sends on fd
+        // -1 if failed, e.g. kernel before 4.14
+        int set_zerocopy(int fd);
+
+        // read one MSG_ZEROCOPY completion from the error queue of fd: sends numbered [*lo, *hi] are done with their buffers
+        // copied: the kernel copied the data instead, zerocopy does not pay off on this route
+        // -1 if failed; 1 if one was read, 0 if there is none
+        int recv_zerocopy(int fd, uint32_t *lo, uint32_t *hi, bool *copied);
+
         // -1 if failed; success returns the amount of data sent
         int send_to(const void *src, size_t size, const std::string &addr, uint16_t port, int flags);
 
+        // send vlen messages with as few syscalls as the kernel allows
+        // -1 if the first one failed; the number of messages sent, 0 if a non-blocking socket is full
+        int send_batch(uint32_t fd, mmsghdr *msgs, unsigned int vlen, int flags = 0);
+
+        // let the kernel coalesce datagrams of one flow, the segment size comes in a SOL_UDP UDP_GRO cmsg
+        // -1 if failed, e.g. kernel before 5.0
+        int set_udp_gro(int fd, bool enable = true);
+
+        // -1 if failed; addr and port of a datagram peer, for sendmsg and send_batch
+        int to_sockaddr(const std::string &addr, uint16_t port, sockaddr_storage *dst, socklen_t *size);
+
+        // sockaddr -> AddrInfo
+        AddrInfo to_addrinfo(const sockaddr *sockaddr);
+
         // -1 if failed; success returns the amount of data sent
         int sendfile(uint32_t srcfd, uint32_t dstfd, off_t *offset, size_t count);
 
@@ -180,9 +228,6 @@ namespace soda
         // -1 if failed, length for success, ignore EINTR
         inline int send_ign_EINTR_to(int fd, const void *src, size_t size, int flags, const sockaddr *addr, socklen_t len);
 
-        // sockaddr -> AddrInfo
-        AddrInfo to_addrinfo(sockaddr *sockaddr);
-
         inline int can_continue() const;
     };
 
@@ -232,20 +277,22 @@ namespace soda
         if (-1 != m_sockfd)
         {
             close_sockfd(m_sockfd);
+            // stop() runs again on destruction, the fd may be reused by then
+            m_sockfd = -1;
         }
         memset(&m_sockaddr, 0, sizeof(m_sockaddr));
         m_sockaddr_ptr = nullptr;
         m_sockaddr_size = 0;
     }
 
-    int SocketUtil::start_tcp_server(const std::string &addr, uint16_t port)
+    int SocketUtil::start_tcp_server(const std::string &addr, uint16_t port, bool reuseport)
     {
         set_addr(addr);
         set_port(port);
-        return start_tcp_server();
+        return start_tcp_server(reuseport);
     }
 
-    int SocketUtil::start_tcp_server()
+    int SocketUtil::start_tcp_server(bool reuseport)
     {
         set_socktype(SOCK_STREAM);
         set_protocol(0);
@@ -253,6 +300,7 @@ namespace soda
         if (create_sock(true) == -1 ||
             set_not_IPv6_only() == -1 ||
             set_reuseaddr() == -1 ||
+            (reuseport && set_reuseport() == -1) ||
             bind_sock() == -1 ||
             listen_sock() == -1)
         {
@@ -281,14 +329,14 @@ namespace soda
         return 0;
     }
 
-    int SocketUtil::start_udp_server(const std::string &addr, uint16_t port)
+    int SocketUtil::start_udp_server(const std::string &addr, uint16_t port, bool reuseport)
     {
         set_addr(addr);
         set_port(port);
-        return start_udp_server();
+        return start_udp_server(reuseport);
     }
 
-    int SocketUtil::start_udp_server()
+    int SocketUtil::start_udp_server(bool reuseport)
     {
         set_socktype(SOCK_DGRAM);
         set_protocol(0);
@@ -296,6 +344,7 @@ namespace soda
         if (create_sock(true) == -1 ||
             set_not_IPv6_only() == -1 ||
             set_reuseaddr() == -1 ||
+            (reuseport && set_reuseport() == -1) ||
             bind_sock() == -1)
         {
             return -1;
@@ -391,6 +440,19 @@ namespace soda
         return 0;
     }
 
+    int SocketUtil::set_reuseport_cbpf(int fd, const std::vector<sock_filter> &prog)
+    {
+        sock_fprog fprog{};
+        fprog.len = prog.size();
+        fprog.filter = const_cast<sock_filter *>(prog.data());
+        if (-1 == setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &fprog, sizeof(fprog)))
+        {
+            perror("set SOL_SOCKET SO_ATTACH_REUSEPORT_CBPF failed");
+            return -1;
+        }
+        return 0;
+    }
+
     int SocketUtil::set_not_IPv6_only()
     {
         if (m_sockaddr.ss_family == AF_INET6)
@@ -564,19 +626,19 @@ namespace soda
         return 0;
     }
 
-    AddrInfo SocketUtil::to_addrinfo(sockaddr *sockaddr)
+    AddrInfo SocketUtil::to_addrinfo(const sockaddr *sockaddr)
     {
-        char addr_c[INET6_ADDRSTRLEN];
+        char addr_c[INET6_ADDRSTRLEN] = "";
         uint16_t port = 0;
         if (AF_INET == sockaddr->sa_family)
         {
-            sockaddr_in *addr_4 = reinterpret_cast<sockaddr_in *>(&sockaddr);
+            const sockaddr_in *addr_4 = reinterpret_cast<const sockaddr_in *>(sockaddr);
             inet_ntop(AF_INET, &addr_4->sin_addr, addr_c, sizeof(addr_c));
             port = ntohs(addr_4->sin_port);
         }
         else if (AF_INET6 == sockaddr->sa_family)
         {
-            sockaddr_in6 *addr_6 = reinterpret_cast<sockaddr_in6 *>(&sockaddr);
+            const sockaddr_in6 *addr_6 = reinterpret_cast<const sockaddr_in6 *>(sockaddr);
             inet_ntop(AF_INET6, &addr_6->sin6_addr, addr_c, sizeof(addr_c));
             port = ntohs(addr_6->sin6_port);
         }
@@ -622,8 +684,26 @@ namespace soda
             return -1;
         }
 
+        // nothing more to read is not an error for NIO
+        if (0 == can_continue())
+        {
+            return 0;
+        }
         perror("recv failed");
-        return can_continue();
+        return -1;
+    }
+
+    int SocketUtil::get_peer(int fd, AddrInfo *ai)
+    {
+        sockaddr_storage addr;
+        socklen_t addr_size = static_cast<socklen_t>(sizeof(sockaddr_storage));
+        if (-1 == getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &addr_size))
+        {
+            perror("getpeername failed");
+            return -1;
+        }
+        *ai = to_addrinfo(reinterpret_cast<sockaddr *>(&addr));
+        return 0;
     }
 
     int SocketUtil::recv_from(uint32_t fd, void *dst, size_t size, AddrInfo *ai, int flags)
@@ -643,6 +723,26 @@ namespace soda
         return can_continue();
     }
 
+    int SocketUtil::recv_batch(uint32_t fd, mmsghdr *msgs, unsigned int vlen, int flags)
+    {
+        int ret = -1;
+        do
+        {
+            ret = ::recvmmsg(fd, msgs, vlen, flags, nullptr);
+        } while (-1 == ret && EINTR == errno);
+
+        if (ret >= 0)
+        {
+            return ret;
+        }
+        if (0 == can_continue())
+        {
+            return 0;
+        }
+        perror("recvmmsg failed");
+        return -1;
+    }
+
     int SocketUtil::close_sockfd(int fd)
     {
         int ret = close(fd);
@@ -716,7 +816,7 @@ namespace soda
         do
         {
             ret = ::send(fd, src, size, flags);
-        } while (-1 == ret && errno != EINTR);
+        } while (-1 == ret && EINTR == errno);
         return ret;
     }
 
@@ -731,7 +831,7 @@ namespace soda
         do
         {
             ret = ::sendto(fd, src, size, flags, addr, len);
-        } while (-1 == ret && errno != EINTR);
+        } while (-1 == ret && EINTR == errno);
         return ret;
     }
 
@@ -745,8 +845,120 @@ namespace soda
             return ret;
         }
 
+        // a full socket buffer is not an error for NIO, the caller waits for EPOLLOUT
+        if (0 == can_continue())
+        {
+            return 0;
+        }
         perror("send failed");
-        return can_continue();
+        return -1;
+    }
+
+    int SocketUtil::recvv(uint32_t fd, const iovec *iov, int iovcnt)
+    {
+        ssize_t ret = -1;
+        do
+        {
+            ret = ::readv(fd, iov, iovcnt);
+        } while (-1 == ret && EINTR == errno);
+
+        if (ret > 0)
+        {
+            return ret;
+        }
+        if (0 == ret)
+        {
+            perror("recv failed");
+            return -1;
+        }
+
+        // nothing more to read is not an error for NIO
+        if (0 == can_continue())
+        {
+            return 0;
+        }
+        perror("readv failed");
+        return -1;
+    }
+
+    int SocketUtil::sendv(uint32_t fd, const iovec *iov, int iovcnt, int flags)
+    {
+        msghdr msg{};
+        msg.msg_iov = const_cast<iovec *>(iov);
+        msg.msg_iovlen = iovcnt;
+
+        // shield SIGPIPE, expect -1 and EPIPE
+        flags |= MSG_NOSIGNAL;
+        ssize_t ret = -1;
+        do
+        {
+            ret = ::sendmsg(fd, &msg, flags);
+        } while (-1 == ret && EINTR == errno);
+
+        if (ret >= 0)
+        {
+            return ret;
+        }
+        // ENOBUFS: MSG_ZEROCOPY is over the locked memory limit, same as a full socket
+        if (0 == can_continue() || (ENOBUFS == errno && (flags & MSG_ZEROCOPY)))
+        {
+            return 0;
+        }
+        perror("sendmsg failed");
+        return -1;
+    }
+
+    int SocketUtil::set_zerocopy(int fd)
+    {
+        int optval = 1;
+        if (-1 == setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &optval, sizeof(optval)))
+        {
+            perror("set SOL_SOCKET SO_ZEROCOPY failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    int SocketUtil::recv_zerocopy(int fd, uint32_t *lo, uint32_t *hi, bool *copied)
+    {
+        char control[CMSG_SPACE(sizeof(sock_extended_err))];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t ret = -1;
+        do
+        {
+            ret = ::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        } while (-1 == ret && EINTR == errno);
+
+        if (-1 == ret)
+        {
+            if (0 == can_continue())
+            {
+                return 0;
+            }
+            perror("recvmsg MSG_ERRQUEUE failed");
+            return -1;
+        }
+
+        cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || !((SOL_IP == cm->cmsg_level && IP_RECVERR == cm->cmsg_type) ||
+                     (SOL_IPV6 == cm->cmsg_level && IPV6_RECVERR == cm->cmsg_type)))
+        {
+            // not a zerocopy notification
+            return 0;
+        }
+
+        sock_extended_err *err = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cm));
+        if (SO_EE_ORIGIN_ZEROCOPY != err->ee_origin || 0 != err->ee_errno)
+        {
+            return 0;
+        }
+        *lo = err->ee_info;
+        *hi = err->ee_data;
+        *copied = err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED;
+        return 1;
     }
 
     int SocketUtil::send_to(const void *src, size_t size, const std::string &addr, uint16_t port, int flags)
@@ -774,6 +986,59 @@ namespace soda
         return can_continue();
     }
 
+    int SocketUtil::send_batch(uint32_t fd, mmsghdr *msgs, unsigned int vlen, int flags)
+    {
+        unsigned int sent = 0;
+        while (sent < vlen)
+        {
+            int ret = ::sendmmsg(fd, msgs + sent, vlen - sent, flags);
+            if (-1 == ret)
+            {
+                if (EINTR == errno)
+                {
+                    continue;
+                }
+                if (0 == can_continue())
+                {
+                    break;
+                }
+                if (0 == sent)
+                {
+                    perror("sendmmsg failed");
+                    return -1;
+                }
+                // the error comes again with the first unsent message
+                break;
+            }
+            sent += ret;
+        }
+        return sent;
+    }
+
+    int SocketUtil::set_udp_gro(int fd, bool enable)
+    {
+        int optval = enable ? 1 : 0;
+        if (-1 == setsockopt(fd, SOL_UDP, UDP_GRO, &optval, sizeof(optval)))
+        {
+            perror("set SOL_UDP UDP_GRO failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    int SocketUtil::to_sockaddr(const std::string &addr, uint16_t port, sockaddr_storage *dst, socklen_t *size)
+    {
+        addrinfo *res;
+        if (-1 == resolve_addr(addr, std::to_string(port), &res, SOCK_DGRAM, 0, 0))
+        {
+            return -1;
+        }
+        memcpy(dst, res->ai_addr, res->ai_addrlen);
+        *size = res->ai_addrlen;
+        freeaddrinfo(res);
+        return 0;
+    }
+
     int SocketUtil::sendfile(uint32_t dstfd, uint32_t srcfd, off_t *offset, size_t size)
     {
         size_t sent_size = 0;
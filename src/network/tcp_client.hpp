@@ -1,11 +1,15 @@
 #pragma once
 
 // tcp client - callback for conn, msg, disconn; multi-thread processing for recv; automatic reconnection
+// the recv thread is an epoll loop with a timer wheel, reconnect attempts are timers instead of sleeps
 
 #include <functional>
 #include <atomic>
+#include <mutex>
 
 #include "socket_util.hpp"
+#include "epoller.hpp"
+#include "timer_wheel.hpp"
 #include "../thread/simple_thread_pool.hpp"
 #include "../general/random.hpp"
 
@@ -38,7 +42,14 @@ namespace soda
         bool m_need_reconn;
         size_t m_reconn_interval;
         int32_t m_reconn_times;
-
+        // m_reconn_mtx held; attempts left and the timer of the chain, 0 for none, kept while an attempt runs
+        size_t m_reconn_left;
+        TimerWheel::timer_id m_reconn_timer;
+        std::mutex m_reconn_mtx;
+
+        std::atomic_bool m_stop;
+        Epoller m_epoller;
+        TimerWheel m_timers;
         std::thread m_rcv_t;
 
         conn_cb_t m_callback_on_conn;
@@ -72,8 +83,10 @@ namespace soda
         // -1 if failed
         int connect();
 
-        // -1 if failed
-        int reconnect();
+        // attempts run on the recv thread, m_reconn_interval apart
+        void reconnect();
+
+        void try_reconnect();
     };
 
     TCPClient::TCPClient(const std::string &addr, uint16_t port) : m_socket(addr, port, SOCK_STREAM, 0),
@@ -81,44 +94,71 @@ namespace soda
                                                                    m_connected(false),
                                                                    m_need_reconn(true),
                                                                    m_reconn_interval(5000 + random::get_int(-2000, 2000)),
-                                                                   m_reconn_times(20)
+                                                                   m_reconn_times(20),
+                                                                   m_reconn_left(0),
+                                                                   m_reconn_timer(0),
+                                                                   m_stop(true)
     {
+        // a reconnect scheduled from send() wakes the recv thread
+        m_timers.set_wakeup(std::bind(&Epoller::wakeup, &m_epoller));
     }
 
     TCPClient::~TCPClient()
     {
-        m_socket.close_sockfd(m_sockfd);
-        if (m_rcv_t.joinable())
-        {
-            m_rcv_t.join();
-        }
+        stop();
     }
 
     void TCPClient::start()
     {
-        connect();
+        if (!m_stop)
+        {
+            return;
+        }
+        m_stop = false;
+        m_epoller.start();
+        if (-1 == connect())
+        {
+            reconnect();
+        }
         m_rcv_t = std::move(std::thread(std::bind(&TCPClient::recv, this)));
     }
 
     void TCPClient::stop()
     {
-        close();
+        if (m_stop)
+        {
+            return;
+        }
+        // no sleeping reconnect to wait for, the loop wakes up and leaves
+        m_stop = true;
+        m_epoller.wakeup();
         if (m_rcv_t.joinable())
         {
             m_rcv_t.join();
         }
+        {
+            std::lock_guard<std::mutex> lock(m_reconn_mtx);
+            m_timers.cancel(m_reconn_timer);
+            m_reconn_timer = 0;
+        }
+        close();
+        m_epoller.stop();
     }
 
     int TCPClient::connect()
     {
         if (-1 == m_socket.start_tcp_client())
         {
+            // the socket of a failed connect is not left open until the next attempt
+            m_socket.stop();
             return -1;
         }
         m_connected = true;
         m_sockfd = m_socket.get_sockfd();
         m_addr = m_socket.get_addr();
         m_port = m_socket.get_port();
+        // level trigger, the socket stays blocking and one recv is done per event
+        m_epoller.add_event(m_sockfd, EPOLLIN);
 
         if (m_callback_on_conn)
         {
@@ -127,25 +167,35 @@ namespace soda
         return 0;
     }
 
-    int TCPClient::reconnect()
+    void TCPClient::reconnect()
     {
-        if (m_connected || !m_need_reconn)
+        if (m_connected || !m_need_reconn || m_stop)
         {
-            return 0;
+            return;
         }
 
-        m_socket.close_sockfd(m_sockfd);
-
+        std::lock_guard<std::mutex> lock(m_reconn_mtx);
+        if (0 != m_reconn_timer || 0 == m_reconn_times)
+        {
+            // already reconnecting
+            return;
+        }
         // if m_reconn_times==-1，decrease from MAX_SIZE_T
-        for (size_t i = m_reconn_times; i > 0; --i)
+        m_reconn_left = static_cast<size_t>(m_reconn_times);
+        m_reconn_timer = m_timers.schedule(0, std::bind(&TCPClient::try_reconnect, this));
+    }
+
+    void TCPClient::try_reconnect()
+    {
+        // the chain owns m_reconn_timer until it ends, a reconnect() meanwhile does not start another
+        bool done = m_connected || m_stop || -1 != connect();
+        std::lock_guard<std::mutex> lock(m_reconn_mtx);
+        if (done || 0 == m_reconn_timer || 0 == --m_reconn_left)
         {
-            if (-1 != connect())
-            {
-                return 0;
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(m_reconn_interval));
+            m_reconn_timer = 0;
+            return;
         }
-        return -1;
+        m_reconn_timer = m_timers.schedule(m_reconn_interval, std::bind(&TCPClient::try_reconnect, this));
     }
 
     // -1 if failed
@@ -188,29 +238,36 @@ namespace soda
 
     void TCPClient::recv()
     {
-        if (!m_connected)
-        {
-            return;
-        }
         uint8_t buf[4096];
         int ret = -1;
-        // NIO
-        while (m_connected)
+        while (!m_stop)
         {
-            memset(buf, 0, sizeof(buf));
-            ret = m_socket.recv(m_sockfd, buf, sizeof(buf));
-            if (ret > 0)
+            // wakes up for data, the next reconnect attempt or stop()
+            auto &&res = m_epoller.check_once(m_timers.timeout());
+            int size = std::get<0>(res);
+            auto &&events = std::get<1>(res).get();
+            for (int i = 0; i < size; ++i)
             {
-                if (m_callback_on_recv)
+                if (!m_connected || events[i].data.fd != m_sockfd)
                 {
-                    m_callback_on_recv(*this, m_sockfd, m_addr, m_port, buf, ret);
+                    continue;
+                }
+                memset(buf, 0, sizeof(buf));
+                ret = m_socket.recv(m_sockfd, buf, sizeof(buf));
+                if (ret > 0)
+                {
+                    if (m_callback_on_recv)
+                    {
+                        m_callback_on_recv(*this, m_sockfd, m_addr, m_port, buf, ret);
+                    }
+                }
+                else if (ret <= 0)
+                {
+                    close();
+                    reconnect();
                 }
             }
-            else if (ret <= 0)
-            {
-                close();
-                reconnect();
-            }
+            m_timers.advance();
         }
     }
 
@@ -227,7 +284,9 @@ namespace soda
         {
             m_callback_on_disconn(*this, m_addr, m_port);
         }
-        m_socket.close_sockfd(m_sockfd);
+        m_epoller.del_event(m_sockfd);
+        // m_socket forgets the fd, its destructor would close it again
+        m_socket.stop();
     }
 
     void TCPClient::set_reconn(bool enable, int interval, int times)
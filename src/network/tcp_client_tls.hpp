@@ -1,11 +1,16 @@
 #pragma once
 
 // tcp client - tls version; callback for conn, msg, disconn; multi-thread processing for recv; automatic reconnection
+// optional kTLS: the kernel encrypts records after the handshake and sendfile is zero copy
+// reconnect attempts are timers on the epoll loop of the recv thread, as in tcp_client.hpp
 
 #include <functional>
 #include <atomic>
+#include <mutex>
 
 #include "socket_util.hpp"
+#include "epoller.hpp"
+#include "timer_wheel.hpp"
 #include "../thread/simple_thread_pool.hpp"
 #include "../general/random.hpp"
 #include "tls_util.hpp"
@@ -35,10 +40,17 @@ namespace soda
         uint16_t m_port;
 
         std::atomic_bool m_connected;
+        std::atomic_bool m_stop;
         bool m_need_reconn;
         size_t m_reconn_interval;
         int32_t m_reconn_times;
+        // m_reconn_mtx held; attempts left and the timer of the chain, 0 for none, kept while an attempt runs
+        size_t m_reconn_left;
+        TimerWheel::timer_id m_reconn_timer;
+        std::mutex m_reconn_mtx;
 
+        Epoller m_epoller;
+        TimerWheel m_timers;
         std::thread m_rcv_t;
 
         conn_cb_t m_callback_on_conn;
@@ -61,13 +73,26 @@ namespace soda
         bool set_CA(const std::string &cert) const;
         void set_if_verify_peer_crt(bool verify) const;
 
+        // full vs resumed handshakes; a reconnect offers the session of the previous connection
+        TLSHandshakeStats get_handshake_stats() const;
+
         void start();
 
         void stop();
 
         // -1 if failed
+        // sends from the recv callback are coalesced into full records and go out when it returns
         int send(const void *src, size_t size);
 
+        // -1 if failed; size bytes of srcfd from *offset, which is advanced; zero copy if the connection uses kTLS
+        int sendfile(int srcfd, off_t *offset, size_t size);
+
+        // call before start(); record crypto in the kernel where supported, user space otherwise
+        void set_ktls(bool enable) const;
+
+        // the kernel encrypts what is sent
+        bool is_ktls() const;
+
         void set_reconn(bool enable, int interval, int times);
 
     private:
@@ -75,35 +100,37 @@ namespace soda
         void close();
         // -1 if failed
         int connect();
-        // -1 if failed
-        int reconnect();
+        // attempts run on the recv thread, m_reconn_interval apart
+        void reconnect();
+        void try_reconnect();
         // -1 if failed
         int tls_connect();
 
         // -1 if disconnected
-        inline int check_connection() const;
+        inline int check_connection(const TLSUtil::ssl_ptr &ssl) const;
     };
 
     TCPClient::TCPClient(const std::string &addr, uint16_t port) : m_socket(addr, port, SOCK_STREAM, 0),
                                                                    m_sockfd(-1),
                                                                    m_connected(false),
+                                                                   m_stop(true),
                                                                    m_need_reconn(true),
                                                                    m_reconn_interval(5000 + random::get_int(-2000, 2000)),
                                                                    m_reconn_times(20),
+                                                                   m_reconn_left(0),
+                                                                   m_reconn_timer(0),
                                                                    m_tls(false),
                                                                    m_ssl(nullptr),
                                                                    m_ssl_connected(false)
 
     {
+        // a reconnect scheduled from send() wakes the recv thread
+        m_timers.set_wakeup(std::bind(&Epoller::wakeup, &m_epoller));
     }
 
     TCPClient::~TCPClient()
     {
-        m_socket.close_sockfd(m_sockfd);
-        if (m_rcv_t.joinable())
-        {
-            m_rcv_t.join();
-        }
+        stop();
     }
 
     void TCPClient::set_if_verify_peer_crt(bool verify) const
@@ -121,9 +148,14 @@ namespace soda
         return m_tls.set_crt_key(crt, key, file_type);
     }
 
-    inline int TCPClient::check_connection() const
+    TLSHandshakeStats TCPClient::get_handshake_stats() const
     {
-        if (!m_connected || !m_ssl_connected || !m_ssl)
+        return m_tls.get_handshake_stats();
+    }
+
+    inline int TCPClient::check_connection(const TLSUtil::ssl_ptr &ssl) const
+    {
+        if (!m_connected || !m_ssl_connected || !ssl)
         {
             return -1;
         }
@@ -132,38 +164,59 @@ namespace soda
 
     void TCPClient::start()
     {
-        if (-1 != connect())
+        if (!m_stop)
         {
-            m_rcv_t = std::move(std::thread(std::bind(&TCPClient::recv, this)));
+            return;
         }
-        else
+        m_stop = false;
+        m_epoller.start();
+        if (-1 == connect())
         {
-            stop();
+            reconnect();
         }
+        m_rcv_t = std::move(std::thread(std::bind(&TCPClient::recv, this)));
     }
 
     void TCPClient::stop()
     {
-        close();
-        if (m_rcv_t.joinable())
+        if (m_stop)
+        {
+            return;
+        }
+        // the recv thread leaves its loop before the ssl is freed
+        m_stop = true;
+        m_epoller.wakeup();
+        if (m_rcv_t.joinable() && std::this_thread::get_id() != m_rcv_t.get_id())
         {
             m_rcv_t.join();
         }
+        {
+            std::lock_guard<std::mutex> lock(m_reconn_mtx);
+            m_timers.cancel(m_reconn_timer);
+            m_reconn_timer = 0;
+        }
+        close();
+        m_epoller.stop();
     }
 
     int TCPClient::tls_connect()
     {
-        m_ssl = m_tls.get_ssl(m_sockfd);
-        if (!m_ssl)
+        TLSUtil::ssl_ptr ssl = m_tls.get_ssl(m_sockfd, m_addr + ":" + std::to_string(m_port));
+        if (!ssl)
         {
             return -1;
         }
-        if (1 != m_tls.connect(m_ssl))
+        std::atomic_store(&m_ssl, ssl);
+        if (1 != m_tls.connect(ssl))
         {
             return -1;
         }
 
         m_ssl_connected = true;
+        // reads hold the lock of sends, recv() waits for input before reading
+        m_socket.set_nonblocking(m_sockfd);
+        // level trigger, records left in the ssl are read before waiting again
+        m_epoller.add_event(m_sockfd, EPOLLIN);
         return 0;
     }
 
@@ -171,6 +224,8 @@ namespace soda
     {
         if (-1 == m_socket.start_tcp_client())
         {
+            // the socket of a failed connect is not left open until the next attempt
+            m_socket.stop();
             return -1;
         }
         m_connected = true;
@@ -182,44 +237,62 @@ namespace soda
         {
             m_callback_on_conn(*this, m_addr, m_port);
         }
-        return tls_connect();
+        if (-1 == tls_connect())
+        {
+            close();
+            return -1;
+        }
+        return 0;
     }
 
-    int TCPClient::reconnect()
+    void TCPClient::reconnect()
     {
-        if (-1 != check_connection() || !m_need_reconn)
+        if (m_connected || !m_need_reconn || m_stop)
         {
-            return 0;
+            return;
         }
 
-        m_socket.close_sockfd(m_sockfd);
-
+        std::lock_guard<std::mutex> lock(m_reconn_mtx);
+        if (0 != m_reconn_timer || 0 == m_reconn_times)
+        {
+            // already reconnecting
+            return;
+        }
         // if m_reconn_times==-1，decrease from MAX_SIZE_T
-        for (size_t i = m_reconn_times; i > 0; --i)
+        m_reconn_left = static_cast<size_t>(m_reconn_times);
+        m_reconn_timer = m_timers.schedule(0, std::bind(&TCPClient::try_reconnect, this));
+    }
+
+    void TCPClient::try_reconnect()
+    {
+        // a full handshake per attempt, the session of the last connection is offered
+        bool done = m_connected || m_stop || -1 != connect();
+        std::lock_guard<std::mutex> lock(m_reconn_mtx);
+        if (done || 0 == m_reconn_timer || 0 == --m_reconn_left)
         {
-            if (-1 != connect())
-            {
-                return 0;
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(m_reconn_interval));
+            m_reconn_timer = 0;
+            return;
         }
-        return -1;
+        m_reconn_timer = m_timers.schedule(m_reconn_interval, std::bind(&TCPClient::try_reconnect, this));
     }
 
     // -1 if failed
     int TCPClient::send(const void *src, size_t size)
     {
-        if (-1 == check_connection())
+        // close() on the recv thread may reset m_ssl meanwhile
+        TLSUtil::ssl_ptr ssl = std::atomic_load(&m_ssl);
+        if (-1 == check_connection(ssl))
         {
             return -1;
         }
 
-        int ret = m_tls.send(m_ssl, src, size);
-        if (ret >= 0)
+        // blocking for the caller, a full socket is waited for without the lock the recv thread needs
+        int ret = m_tls.send(ssl, src, size);
+        if (ret >= 0 && -1 != m_tls.wait_sent(ssl))
         {
             return ret;
         }
-        else if (-1 == ret)
+        else if (-1 == ret && ssl == std::atomic_load(&m_ssl))
         {
             close();
             reconnect();
@@ -227,55 +300,113 @@ namespace soda
         return -1;
     }
 
-    void TCPClient::recv()
+    int TCPClient::sendfile(int srcfd, off_t *offset, size_t size)
     {
-        if (-1 == check_connection())
+        TLSUtil::ssl_ptr ssl = std::atomic_load(&m_ssl);
+        if (-1 == check_connection(ssl))
         {
-            return;
+            return -1;
         }
 
-        uint8_t buf[4096];
-        int ret = -1;
-        // NIO
-        while (m_connected)
+        // in pieces, what a full socket does not take is buffered until it drains
+        size_t sent_size = 0;
+        while (sent_size < size)
         {
-            memset(buf, 0, sizeof(buf));
-            ret = m_tls.recv(m_ssl, buf, sizeof(buf));
-            if (ret > 0)
+            int ret = m_tls.sendfile(ssl, srcfd, offset, std::min(size - sent_size, size_t(TLSUtil::READ_BUFFER_SIZE)));
+            if (-1 == ret || -1 == m_tls.wait_sent(ssl))
             {
-                if (m_callback_on_recv)
+                if (ssl == std::atomic_load(&m_ssl))
                 {
-                    m_callback_on_recv(*this, m_sockfd, m_addr, m_port, buf, ret);
+                    close();
+                    reconnect();
                 }
+                return -1;
             }
-            else if (ret <= 0)
+            sent_size += ret;
+        }
+        return sent_size;
+    }
+
+    void TCPClient::set_ktls(bool enable) const
+    {
+        m_tls.set_ktls(enable);
+    }
+
+    bool TCPClient::is_ktls() const
+    {
+        TLSUtil::ssl_ptr ssl = std::atomic_load(&m_ssl);
+        return -1 != check_connection(ssl) && m_tls.ktls_send(ssl);
+    }
+
+    void TCPClient::recv()
+    {
+        uint8_t buf[TLSUtil::READ_BUFFER_SIZE];
+        int ret = -1;
+        while (!m_stop)
+        {
+            // wakes up for data, the next reconnect attempt or stop()
+            auto &&res = m_epoller.check_once(m_timers.timeout());
+            int size = std::get<0>(res);
+            auto &&events = std::get<1>(res).get();
+            for (int i = 0; i < size; ++i)
             {
-                close();
-                reconnect();
+                // kept alive if the callback closes the connection
+                TLSUtil::ssl_ptr ssl = std::atomic_load(&m_ssl);
+                if (events[i].data.fd != m_sockfd || -1 == check_connection(ssl))
+                {
+                    continue;
+                }
+                // NIO, a full buffer may leave records in the ssl that epoll does not report
+                do
+                {
+                    ret = m_tls.recv_all(ssl, buf, sizeof(buf));
+                    if (ret > 0 && m_callback_on_recv)
+                    {
+                        // replies leave in full records once the callback returns
+                        m_tls.cork(ssl);
+                        m_callback_on_recv(*this, m_sockfd, m_addr, m_port, buf, ret);
+                        if (-1 == m_tls.uncork(ssl) || -1 == m_tls.wait_sent(ssl))
+                        {
+                            ret = -1;
+                        }
+                    }
+                } while (sizeof(buf) == ret && !m_stop);
+                // the callback may have closed it and connected again
+                if (ret < 0 && m_connected && ssl == std::atomic_load(&m_ssl))
+                {
+                    close();
+                    reconnect();
+                }
             }
+            m_timers.advance();
         }
     }
 
     void TCPClient::close()
     {
-        if (!m_connected)
+        // a sender and the recv thread may both fail on the same connection
+        if (!m_connected.exchange(false))
         {
             return;
         }
 
-        m_connected = false;
         m_ssl_connected = false;
 
         if (m_callback_on_disconn)
         {
             m_callback_on_disconn(*this, m_addr, m_port);
         }
-        if (m_ssl)
+        // senders keep their own copy alive
+        TLSUtil::ssl_ptr ssl = std::atomic_exchange(&m_ssl, TLSUtil::ssl_ptr());
+        if (ssl)
         {
-            m_ssl.reset();
+            // a recv callback still holding the ssl writes nothing to the fd once it is closed and maybe reused
+            m_tls.detach(ssl);
         }
 
-        m_socket.close_sockfd(m_sockfd);
+        m_epoller.del_event(m_sockfd);
+        // m_socket forgets the fd, its destructor would close it again
+        m_socket.stop();
     }
 
     void TCPClient::set_reconn(bool enable, int interval, int times)
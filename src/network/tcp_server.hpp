@@ -1,18 +1,23 @@
 #pragma once
 
-// TCP server - multi-threaded; callback for conn/disconn/msg; the maximum clients online at the same time can be set, the default is 10
+// TCP server - multi-threaded; callback for conn/disconn/msg; the maximum clients online at the same time can be set, the default is 10; IPv4/IPv6
+// the core of the select/poll servers: one loop waits on a multiplexer picked at construction, reads run on the pool;
+// a connection is not reported again until its read is done, so callbacks of one connection never overlap
 
 #include <string>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
+#include <poll.h>
 #include <iostream>
 #include <unordered_map>
-#include <tuple>
+#include <memory>
+#include <vector>
+#include <algorithm>
 #include <functional>
 #include <atomic>
-#include <cstring>
+#include <mutex>
+#include <thread>
 
+#include "socket_util.hpp"
+#include "multiplexer.hpp"
 #include "../thread/thread_pool.hpp"
 
 namespace soda
@@ -20,6 +25,9 @@ namespace soda
     class TCPServer : Noncopyable
     {
         static const uint16_t DEFAULT_MAX_CONN = 10;
+        static const size_t RECV_BUFFER_SIZE = 16384;
+        // ms, for a full socket buffer to drain
+        static const int SEND_TIMEOUT = 5000;
 
     public:
         // callback for conn /ip, port
@@ -35,8 +43,9 @@ namespace soda
         // callback for disconn /ip, port
         using disconn_cb_t = std::function<void(const std::string &ip, uint16_t port)>;
 
-        TCPServer(uint16_t port, std::string ip = "::");
-        ~TCPServer();
+        // backend: io_uring falls back to epoll where the kernel lacks it
+        TCPServer(uint16_t port, std::string ip = "::", Multiplexer::Type backend = Multiplexer::MUX_EPOLL);
+        virtual ~TCPServer();
 
         void set_callback_on_conn(conn_cb_t cb);
         void set_callback_on_recv(recv_cb_t cb);
@@ -46,39 +55,67 @@ namespace soda
 
         void stop();
 
+        void close(uint32_t fd);
+
+        // accepting waits while the maximum is reached
         void set_max_conn(size_t size);
 
         size_t get_conns() const;
 
-        // -1 if failed
+        // the one in use once started
+        Multiplexer::Type get_backend() const;
+
+        // -1 if failed; blocks while the socket buffer is full
         int send(uint32_t fd, const void *src, size_t size);
 
         friend std::ostream &operator<<(std::ostream &os, const TCPServer &s)
         {
-            return std::cout << "tcp_server -"
-                             << " conn: " << s.m_conn_size
-                             << "max: " << s.m_max_conn_size
-                             << " running " << !s.m_is_stop
-                             << std::endl;
+            return os << "tcp_server -"
+                      << " conn: " << s.m_conn_size
+                      << " max: " << s.m_max_conn_size
+                      << " running " << !s.m_is_stop
+                      << std::endl;
         }
 
+    protected:
+        // the callbacks go through these, a subclass calls its own instead
+
+        virtual void on_conn(int32_t fd, const std::string &ip, uint16_t port);
+
+        virtual void on_recv(int32_t fd, const std::string &ip, uint16_t port, const void *data, size_t data_size);
+
+        virtual void on_disconn(const std::string &ip, uint16_t port);
+
     private:
-        std::string m_ip;
-        uint16_t m_port;
-        int32_t m_sockfd;
-        sockaddr_in m_server_sockaddr;
-        sockaddr_in m_client_sockaddr;
-        struct Addr
+        struct Conn
         {
+            int32_t fd;
             std::string ip;
             uint16_t port;
+            // m_mtx held; a read is queued or running, the fd is closed when it is done
+            bool reading;
+            // m_mtx held; sends in progress, the fd is closed when the last is done
+            size_t sending;
+            std::atomic_bool closed;
         };
-        std::unordered_map<uint16_t, Addr> m_conns;
+        using conn_ptr = std::shared_ptr<Conn>;
+
+        std::string m_ip;
+        uint16_t m_port;
+        SocketUtil m_socket;
+        int32_t m_sockfd;
+
+        Multiplexer::Type m_backend;
+        std::unique_ptr<Multiplexer> m_mux;
+
+        // closed ones stay until their read is done
+        std::unordered_map<int32_t, conn_ptr> m_conns;
+        // m_mtx held; the listener is left unarmed at the maximum
+        bool m_accept_deferred;
 
         ThreadPool m_tp;
 
         std::atomic_bool m_is_stop;
-
         std::atomic_size_t m_max_conn_size;
         std::atomic_size_t m_conn_size;
 
@@ -89,37 +126,38 @@ namespace soda
         std::mutex m_mtx;
 
     private:
-        // -1 if failed
-        int create_sockfd();
-
-        // -1 if failed
-        int create_sockaddr();
+        // runs on the pool until stop()
+        void loop();
 
-        // -1 if failed
-        int bind_sock();
+        // until EAGAIN or the maximum
+        void accept();
 
-        // -1 if failed
-        int listen_sock();
+        void recv(conn_ptr conn);
 
-        void accept();
+        // -1 if failed; the fd stays open while it runs
+        int send(const conn_ptr &conn, const void *src, size_t size);
 
-        void process_conn(uint32_t fd);
+        // m_mtx held; stop watching and close
+        void drop(const conn_ptr &conn);
 
-        void recv(uint32_t fd);
+        // m_mtx held; drop a closed connection nobody reads from or sends to anymore
+        void drop_if_idle(const conn_ptr &conn);
 
-        void close_conn(uint32_t fd);
+        // arm the listener again if accepting waited for a close
+        void resume_accept();
     };
 
-    TCPServer::TCPServer(uint16_t port, std::string ip) : m_port(port),
-                                                          m_ip(ip),
-                                                          m_sockfd(-1),
-                                                          m_is_stop(true),
-                                                          m_tp(2, DEFAULT_MAX_CONN + 1),
-                                                          m_max_conn_size(DEFAULT_MAX_CONN),
-                                                          m_conn_size(0)
+    TCPServer::TCPServer(uint16_t port, std::string ip, Multiplexer::Type backend) : m_ip(ip),
+                                                                                      m_port(port),
+                                                                                      m_sockfd(-1),
+                                                                                      m_backend(backend),
+                                                                                      m_accept_deferred(false),
+                                                                                      // the loop keeps one worker
+                                                                                      m_tp(2, std::max<size_t>(2, std::thread::hardware_concurrency() + 1)),
+                                                                                      m_is_stop(true),
+                                                                                      m_max_conn_size(DEFAULT_MAX_CONN),
+                                                                                      m_conn_size(0)
     {
-        memset(&m_server_sockaddr, 0, sizeof(m_server_sockaddr));
-        memset(&m_client_sockaddr, 0, sizeof(m_client_sockaddr));
     }
 
     TCPServer::~TCPServer()
@@ -140,200 +178,294 @@ namespace soda
         m_callback_on_disconn = std::move(cb);
     }
 
-    void TCPServer::start(size_t max_conn_size)
+    void TCPServer::on_conn(int32_t, const std::string &ip, uint16_t port)
     {
-        if (!m_is_stop)
+        if (m_callback_on_conn)
         {
-            return;
+            m_callback_on_conn(ip, port);
         }
-        m_is_stop = false;
-        set_max_conn(max_conn_size);
-
-        int err = create_sockfd();
-        err = create_sockaddr();
-        int opt = 1;
-        setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        setsockopt(m_sockfd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
-
-        err = bind_sock();
-        err = listen_sock();
+    }
 
-        if (-1 == err)
+    void TCPServer::on_recv(int32_t fd, const std::string &ip, uint16_t port, const void *data, size_t data_size)
+    {
+        if (m_callback_on_recv)
         {
-            perror("tcp_server start failed");
-            stop();
-            return;
+            m_callback_on_recv(fd, ip, port, data, data_size);
         }
-
-        m_tp.insert_task_normal(std::bind(&TCPServer::accept, this));
     }
 
-    void TCPServer::stop()
+    void TCPServer::on_disconn(const std::string &ip, uint16_t port)
     {
-        if (m_is_stop)
+        if (m_callback_on_disconn)
         {
-            return;
+            m_callback_on_disconn(ip, port);
         }
-        m_is_stop = true;
-
-        std::lock_guard<std::mutex> lock(m_mtx);
+    }
 
-        for (auto &&conn : m_conns)
+    void TCPServer::start(size_t max_conn_size)
+    {
+        if (!m_is_stop)
         {
-            close(conn.first);
+            return;
         }
-        close(m_sockfd);
-        m_conns.clear();
-        m_tp.stop();
-        m_conn_size = 0;
-    }
 
-    void TCPServer::set_max_conn(size_t size)
-    {
-        if (size < m_conn_size)
+        m_mux = Multiplexer::create(m_backend);
+        if (!m_mux ||
+            -1 == m_socket.start_tcp_server(m_ip, m_port) ||
+            -1 == m_socket.set_nonblocking(m_socket.get_sockfd()))
         {
+            perror("tcp_server start failed");
+            m_socket.stop();
+            m_mux.reset();
             return;
         }
+        m_sockfd = m_socket.get_sockfd();
+        m_is_stop = false;
+        m_accept_deferred = false;
+        set_max_conn(max_conn_size);
 
-        // one more for accept
-        m_tp.set_max_size(size + 1);
-        m_max_conn_size = size;
+        m_mux->add(m_sockfd);
+        m_tp.start();
+        m_tp.insert_task_normal(std::bind(&TCPServer::loop, this));
     }
 
-    int TCPServer::create_sockfd()
+    void TCPServer::loop()
     {
-        int sock_fd = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (-1 == sock_fd)
+        std::vector<int> ready;
+        while (!m_is_stop)
         {
-            perror("create socket fd failed");
-            return -1;
+            if (-1 == m_mux->wait(ready))
+            {
+                ERROR_PRINT("tcp_server wait failed");
+                break;
+            }
+
+            bool acceptable = false;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                for (int fd : ready)
+                {
+                    if (fd == m_sockfd)
+                    {
+                        acceptable = true;
+                        continue;
+                    }
+                    auto iter = m_conns.find(fd);
+                    if (iter == m_conns.end() || iter->second->closed)
+                    {
+                        continue;
+                    }
+                    iter->second->reading = true;
+                    m_tp.insert_task_normal(std::bind(&TCPServer::recv, this, iter->second));
+                }
+            }
+
+            // after the reads are handed out, new connections may take numbers of fds closed meanwhile
+            if (acceptable && !m_is_stop)
+            {
+                accept();
+            }
         }
-        return m_sockfd = sock_fd;
     }
 
-    int TCPServer::create_sockaddr()
+    void TCPServer::accept()
     {
-        sockaddr_in &addr = m_server_sockaddr;
-        addr.sin_family = AF_INET;
-        if (-1 == inet_pton(AF_INET, m_ip.c_str(), &addr.sin_addr))
+        while (!m_is_stop)
         {
-            perror("ip addr invalid");
-            return -1;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (m_conn_size >= m_max_conn_size)
+                {
+                    // armed again by a close
+                    m_accept_deferred = true;
+                    return;
+                }
+            }
+
+            SocketUtil::conn_info_ptr info = m_socket.accept();
+            if (!info || -1 == info->fd)
+            {
+                break;
+            }
+
+            m_socket.set_nonblocking(info->fd);
+            conn_ptr conn = std::make_shared<Conn>();
+            conn->fd = info->fd;
+            conn->ip = info->addr;
+            conn->port = info->port;
+            conn->reading = false;
+            conn->sending = 0;
+            conn->closed = false;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_conns[conn->fd] = conn;
+                ++m_conn_size;
+            }
+
+            on_conn(conn->fd, conn->ip, conn->port);
+
+            std::lock_guard<std::mutex> lock(m_mtx);
+            // closed by the callback already
+            if (!conn->closed)
+            {
+                m_mux->add(conn->fd);
+            }
         }
-        addr.sin_port = htons(m_port);
-        return 0;
+        m_mux->arm(m_sockfd);
     }
 
-    int TCPServer::bind_sock()
+    void TCPServer::recv(conn_ptr conn)
     {
-        sockaddr *addr = reinterpret_cast<sockaddr *>(&m_server_sockaddr);
-        socklen_t len = static_cast<socklen_t>(sizeof(sockaddr_in));
-        if (-1 == ::bind(m_sockfd, addr, len))
+        uint8_t buf[RECV_BUFFER_SIZE];
+        int ret = 0;
+        while (!m_is_stop && !conn->closed)
         {
-            perror("bind failed");
-            return -1;
+            ret = m_socket.recv(conn->fd, buf, sizeof(buf));
+            if (ret <= 0)
+            {
+                break;
+            }
+            on_recv(conn->fd, conn->ip, conn->port, buf, ret);
+            if (static_cast<size_t>(ret) < sizeof(buf))
+            {
+                // drained most likely, the multiplexer tells otherwise
+                break;
+            }
         }
-        return 0;
-    }
 
-    int TCPServer::listen_sock()
-    {
-        if (-1 == ::listen(m_sockfd, SOMAXCONN))
+        if (-1 == ret)
+        {
+            close(conn->fd);
+        }
+
+        std::lock_guard<std::mutex> lock(m_mtx);
+        conn->reading = false;
+        if (conn->closed)
         {
-            perror("listen failed");
-            return -1;
+            drop_if_idle(conn);
+        }
+        else
+        {
+            m_mux->arm(conn->fd);
         }
-        return 0;
     }
 
-    void TCPServer::accept()
+    void TCPServer::close(uint32_t fd)
     {
-        while (!m_is_stop && m_conn_size < m_max_conn_size)
+        conn_ptr conn;
         {
-            sockaddr *addr = reinterpret_cast<sockaddr *>(&m_client_sockaddr);
-            socklen_t len = static_cast<socklen_t>(sizeof(sockaddr_in));
-            int32_t fd = ::accept(m_sockfd, addr, &len);
-
-            if (-1 == fd)
+            std::lock_guard<std::mutex> lock(m_mtx);
+            auto iter = m_conns.find(fd);
+            if (iter == m_conns.end() || iter->second->closed)
             {
-                perror("accept failed");
-                stop();
-                break;
+                return;
             }
-
-            ++m_conn_size;
-            process_conn(fd);
+            conn = iter->second;
+            conn->closed = true;
+            --m_conn_size;
+            // otherwise recv() or the last send drops it once done, the fd number is not reused under them
+            if (conn->sending > 0)
+            {
+                // wakes up senders waiting for room
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+            drop_if_idle(conn);
         }
+
+        on_disconn(conn->ip, conn->port);
+        resume_accept();
     }
 
-    void TCPServer::close_conn(uint32_t fd)
+    void TCPServer::drop(const conn_ptr &conn)
     {
-        std::lock_guard<std::mutex> lock(m_mtx);
-
-        auto &conn = m_conns.find(fd)->second;
+        m_conns.erase(conn->fd);
+        m_mux->close(conn->fd);
+    }
 
-        if (m_callback_on_disconn)
+    void TCPServer::drop_if_idle(const conn_ptr &conn)
+    {
+        if (!conn->reading && 0 == conn->sending)
         {
-            m_callback_on_disconn(conn.ip, conn.port);
+            drop(conn);
         }
-        close(fd);
-        m_conns.erase(fd);
-        --m_conn_size;
     }
 
-    void TCPServer::process_conn(uint32_t fd)
+    void TCPServer::resume_accept()
     {
-        char ip_c[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &m_client_sockaddr.sin_addr, ip_c, sizeof(ip_c));
-        uint16_t port = ntohs(m_client_sockaddr.sin_port);
-        std::string ip{ip_c};
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_accept_deferred && !m_is_stop && m_conn_size < m_max_conn_size)
         {
-            std::lock_guard<std::mutex> lock(m_mtx);
-            m_conns.emplace(fd, Addr{ip, port});
+            m_accept_deferred = false;
+            m_mux->arm(m_sockfd);
         }
-        memset(&m_client_sockaddr, 0, sizeof(m_client_sockaddr));
+    }
 
-        if (m_callback_on_conn)
+    void TCPServer::stop()
+    {
+        if (m_is_stop)
         {
-            m_callback_on_conn(ip, port);
+            return;
         }
-        m_tp.insert_task_normal(std::bind(&TCPServer::recv, this, fd));
-    }
+        m_is_stop = true;
 
-    void TCPServer::recv(uint32_t fd)
-    {
-        size_t buf_size = 1024;
-        uint8_t buf[buf_size];
+        // reads in progress leave at the next check, queued ones are dropped with the pool
+        m_mux->wakeup();
+        m_tp.stop();
 
-        while (!m_is_stop)
+        std::vector<conn_ptr> conns;
         {
-            memset(buf, 0, buf_size);
-            int ret = ::recv(fd, buf, buf_size, 0);
-            if (-1 == ret && errno != EINTR)
+            std::lock_guard<std::mutex> lock(m_mtx);
+            for (auto &&conn : m_conns)
             {
-                perror("recv failed");
-                close_conn(fd);
-                break;
+                conn.second->reading = false;
+                conns.push_back(conn.second);
             }
-            else if (0 == ret)
+        }
+        for (auto &&conn : conns)
+        {
+            if (conn->closed)
             {
-                close_conn(fd);
-                break;
+                // closed during a read that never finished
+                std::lock_guard<std::mutex> lock(m_mtx);
+                drop_if_idle(conn);
+                continue;
             }
-            else if (m_callback_on_recv)
+            close(conn->fd);
+        }
+        // close() woke senders up, the last one drops the connection
+        for (auto &&conn : conns)
+        {
+            while (true)
             {
-                std::string ip;
-                uint16_t port;
                 {
                     std::lock_guard<std::mutex> lock(m_mtx);
-                    auto &conn = m_conns.find(fd)->second;
-                    ip = conn.ip;
-                    port = conn.port;
+                    if (0 == conn->sending)
+                    {
+                        break;
+                    }
                 }
-
-                m_callback_on_recv(fd, ip, port, buf, ret);
+                std::this_thread::yield();
             }
         }
+
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_conns.clear();
+        m_conn_size = 0;
+        m_accept_deferred = false;
+        // closes what is still queued
+        m_mux.reset();
+        m_socket.stop();
+        m_sockfd = -1;
+    }
+
+    void TCPServer::set_max_conn(size_t size)
+    {
+        if (size < m_conn_size)
+        {
+            return;
+        }
+        m_max_conn_size = size;
+        resume_accept();
     }
 
     size_t TCPServer::get_conns() const
@@ -341,36 +473,70 @@ namespace soda
         return m_conn_size;
     }
 
+    Multiplexer::Type TCPServer::get_backend() const
+    {
+        return m_mux ? m_mux->type() : m_backend;
+    }
+
     int TCPServer::send(uint32_t fd, const void *src, size_t size)
     {
+        conn_ptr conn;
         {
             std::lock_guard<std::mutex> lock(m_mtx);
-            if (m_is_stop || m_conns.find(fd) == m_conns.end())
+            auto iter = m_conns.find(fd);
+            if (m_is_stop || iter == m_conns.end() || iter->second->closed)
             {
-                return 0;
+                return -1;
             }
+            conn = iter->second;
+            ++conn->sending;
         }
 
-        int ret = -1;
-        do
-        {
-            ret = ::send(fd, src, size, 0);
-        } while (-1 == ret && errno != EINTR);
+        int ret = send(conn, src, size);
 
-        if (-1 == ret)
-        {
-            perror("send failed");
-            close_conn(fd);
-            return ret;
-        }
-        else if (ret < size)
+        std::lock_guard<std::mutex> lock(m_mtx);
+        --conn->sending;
+        if (conn->closed)
         {
-            return ret += send(fd, reinterpret_cast<const uint8_t *>(src) + ret, size - ret);
+            drop_if_idle(conn);
         }
-        else if (ret == size)
+        return ret;
+    }
+
+    int TCPServer::send(const conn_ptr &conn, const void *src, size_t size)
+    {
+        int32_t fd = conn->fd;
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(src);
+        size_t sent = 0;
+        while (sent < size)
         {
-            return ret;
+            int ret = m_socket.send(fd, data + sent, size - sent);
+            if (-1 == ret || conn->closed)
+            {
+                close(fd);
+                return -1;
+            }
+            else if (0 == ret)
+            {
+                // the socket is nonblocking, wait for room
+                pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                int act_size = ::poll(&pfd, 1, SEND_TIMEOUT);
+                if (-1 == act_size && EINTR == errno)
+                {
+                    continue;
+                }
+                if (act_size <= 0)
+                {
+                    ERROR_PRINT("send timeout");
+                    close(fd);
+                    return -1;
+                }
+            }
+            sent += ret;
         }
-        return size;
+        return sent;
     }
-} // namespace TCPServer
+} // namespace soda
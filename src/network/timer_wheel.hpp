@@ -0,0 +1,363 @@
+#pragma once
+
+// timer wheel - hierarchical, 256 slots of one tick then 3 levels of 64 slots, O(1) schedule and cancel; thread safe
+// driven by an event loop: wait at most timeout() ms, then advance() runs what is due on the loop thread
+
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <functional>
+
+#include "../general/util.hpp"
+
+namespace soda
+{
+    class TimerWheel : Noncopyable
+    {
+        static const size_t NEAR_BITS = 8;
+        static const size_t NEAR_SIZE = 1 << NEAR_BITS;
+        static const size_t LEVEL_BITS = 6;
+        static const size_t LEVEL_SIZE = 1 << LEVEL_BITS;
+        // the first level included; 2^26 ticks ahead, further ones wait in the last slot and cascade again
+        static const size_t LEVEL_COUNT = 4;
+        static const size_t BUCKET_SIZE = NEAR_SIZE + (LEVEL_COUNT - 1) * LEVEL_SIZE;
+        static const uint32_t NIL = UINT32_MAX;
+
+    public:
+        // never 0
+        using timer_id = uint64_t;
+        using callback_t = std::function<void()>;
+
+        // tick_ms: resolution, delays are rounded up to it
+        explicit TimerWheel(uint32_t tick_ms = 1);
+
+        // call cb once on the thread calling advance(), delay_ms from now
+        timer_id schedule(uint64_t delay_ms, callback_t cb);
+
+        // false if it already ran or was cancelled
+        bool cancel(timer_id id);
+
+        // run the timers due by now; returns the number run
+        size_t advance();
+
+        // ms until a timer may be due, for epoll_wait; -1 if there is none
+        int timeout();
+
+        // ms since the wheel was created, deadlines are measured in it
+        uint64_t now() const;
+
+        size_t size() const;
+
+        // called when a timer is scheduled before the wait timeout() asked for ends, e.g. Epoller::wakeup
+        void set_wakeup(callback_t fn);
+
+    private:
+        struct Node
+        {
+            uint64_t expire;
+            uint32_t prev;
+            uint32_t next;
+            // bumped when the node is freed, ids of old timers stop matching
+            uint32_t gen;
+            uint16_t bucket;
+            bool used;
+            callback_t cb;
+        };
+
+        std::vector<Node> m_nodes;
+        // free nodes linked by next
+        uint32_t m_free;
+        uint32_t m_heads[BUCKET_SIZE];
+        // non-empty first level slots
+        uint64_t m_near_bits[NEAR_SIZE / 64];
+        // next tick to run
+        uint64_t m_tick;
+        // the tick the loop waits for since the last timeout(), earlier timers wake it up
+        uint64_t m_wait_tick;
+        callback_t m_wakeup;
+        size_t m_size;
+        uint32_t m_tick_ms;
+        std::chrono::steady_clock::time_point m_start;
+        mutable std::mutex m_mtx;
+
+    private:
+        // m_mtx held
+
+        void link(uint32_t idx);
+
+        void unlink(uint32_t idx);
+
+        // the node goes back to the free list, its callback is moved to cb
+        void release(uint32_t idx, callback_t &cb);
+
+        // put the timers of a bucket where they belong now
+        void cascade(size_t bucket);
+
+        // slots from idx to the next non-empty first level slot, NEAR_SIZE - idx if none
+        size_t next_near(size_t idx) const;
+    };
+
+    TimerWheel::TimerWheel(uint32_t tick_ms) : m_free(NIL),
+                                               m_near_bits{},
+                                               m_tick(0),
+                                               m_wait_tick(UINT64_MAX),
+                                               m_size(0),
+                                               m_tick_ms(tick_ms > 0 ? tick_ms : 1),
+                                               m_start(std::chrono::steady_clock::now())
+    {
+        for (size_t i = 0; i < BUCKET_SIZE; ++i)
+        {
+            m_heads[i] = NIL;
+        }
+    }
+
+    TimerWheel::timer_id TimerWheel::schedule(uint64_t delay_ms, callback_t cb)
+    {
+        // rounded up, never early
+        uint64_t expire = (now() + delay_ms + m_tick_ms - 1) / m_tick_ms;
+
+        std::unique_lock<std::mutex> lock(m_mtx);
+        uint32_t idx = m_free;
+        if (NIL == idx)
+        {
+            idx = m_nodes.size();
+            m_nodes.push_back(Node{0, NIL, NIL, 0, 0, false, nullptr});
+        }
+        else
+        {
+            m_free = m_nodes[idx].next;
+        }
+
+        Node &node = m_nodes[idx];
+        node.expire = expire;
+        node.used = true;
+        node.cb = std::move(cb);
+        link(idx);
+        ++m_size;
+        timer_id id = (static_cast<uint64_t>(node.gen) << 32) | (idx + 1);
+
+        bool wakeup = expire < m_wait_tick && m_wakeup;
+        m_wait_tick = expire < m_wait_tick ? expire : m_wait_tick;
+        lock.unlock();
+        if (wakeup)
+        {
+            m_wakeup();
+        }
+        return id;
+    }
+
+    bool TimerWheel::cancel(timer_id id)
+    {
+        callback_t cb;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            uint32_t idx = static_cast<uint32_t>(id) - 1;
+            if (0 == static_cast<uint32_t>(id) || idx >= m_nodes.size() ||
+                !m_nodes[idx].used || m_nodes[idx].gen != static_cast<uint32_t>(id >> 32))
+            {
+                return false;
+            }
+            unlink(idx);
+            release(idx, cb);
+        }
+        // captures are destroyed unlocked, they may cancel timers too
+        return true;
+    }
+
+    size_t TimerWheel::advance()
+    {
+        uint64_t target = now() / m_tick_ms;
+        std::vector<callback_t> due;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            while (m_tick <= target && m_size > 0)
+            {
+                size_t idx = m_tick & (NEAR_SIZE - 1);
+                if (0 == idx)
+                {
+                    // a lap of the first level is done, the next slot of the level above comes down
+                    for (size_t level = 1, shift = NEAR_BITS; level < LEVEL_COUNT; ++level, shift += LEVEL_BITS)
+                    {
+                        size_t slot = (m_tick >> shift) & (LEVEL_SIZE - 1);
+                        cascade(NEAR_SIZE + (level - 1) * LEVEL_SIZE + slot);
+                        if (0 != slot)
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                if (NIL == m_heads[idx])
+                {
+                    // jump over empty slots, not past the end of the lap
+                    size_t skip = next_near(idx);
+                    m_tick += skip < target + 1 - m_tick ? skip : target + 1 - m_tick;
+                    continue;
+                }
+
+                while (NIL != m_heads[idx])
+                {
+                    uint32_t node = m_heads[idx];
+                    unlink(node);
+                    due.emplace_back();
+                    release(node, due.back());
+                }
+                ++m_tick;
+            }
+            if (0 == m_size && m_tick <= target)
+            {
+                m_tick = target + 1;
+            }
+        }
+
+        for (auto &&cb : due)
+        {
+            cb();
+        }
+        return due.size();
+    }
+
+    int TimerWheel::timeout()
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (0 == m_size)
+        {
+            m_wait_tick = UINT64_MAX;
+            return -1;
+        }
+
+        // the next occupied slot of this lap, or the end of the lap where upper levels cascade;
+        // at the start of a lap the cascade is still to be done
+        size_t idx = m_tick & (NEAR_SIZE - 1);
+        uint64_t tick = m_tick + (0 == idx ? 0 : next_near(idx));
+        m_wait_tick = tick;
+        uint64_t at = tick * m_tick_ms;
+        uint64_t cur = now();
+        if (at <= cur)
+        {
+            return 0;
+        }
+        return at - cur < INT_MAX ? static_cast<int>(at - cur) : INT_MAX;
+    }
+
+    uint64_t TimerWheel::now() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+    size_t TimerWheel::size() const
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_size;
+    }
+
+    void TimerWheel::set_wakeup(callback_t fn)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_wakeup = std::move(fn);
+    }
+
+    void TimerWheel::link(uint32_t idx)
+    {
+        Node &node = m_nodes[idx];
+        uint64_t expire = node.expire > m_tick ? node.expire : m_tick;
+        uint64_t delta = expire - m_tick;
+
+        size_t bucket = 0;
+        if (delta < NEAR_SIZE)
+        {
+            bucket = expire & (NEAR_SIZE - 1);
+            m_near_bits[bucket / 64] |= uint64_t(1) << (bucket % 64);
+        }
+        else
+        {
+            size_t level = 1;
+            size_t shift = NEAR_BITS;
+            while (level < LEVEL_COUNT - 1 && delta >> (shift + LEVEL_BITS))
+            {
+                ++level;
+                shift += LEVEL_BITS;
+            }
+            if (delta >> (shift + LEVEL_BITS))
+            {
+                expire = m_tick + (uint64_t(1) << (shift + LEVEL_BITS)) - 1;
+            }
+            bucket = NEAR_SIZE + (level - 1) * LEVEL_SIZE + ((expire >> shift) & (LEVEL_SIZE - 1));
+        }
+
+        node.bucket = bucket;
+        node.prev = NIL;
+        node.next = m_heads[bucket];
+        if (NIL != node.next)
+        {
+            m_nodes[node.next].prev = idx;
+        }
+        m_heads[bucket] = idx;
+    }
+
+    void TimerWheel::unlink(uint32_t idx)
+    {
+        Node &node = m_nodes[idx];
+        if (NIL != node.prev)
+        {
+            m_nodes[node.prev].next = node.next;
+        }
+        else
+        {
+            m_heads[node.bucket] = node.next;
+            if (NIL == node.next && node.bucket < NEAR_SIZE)
+            {
+                m_near_bits[node.bucket / 64] &= ~(uint64_t(1) << (node.bucket % 64));
+            }
+        }
+        if (NIL != node.next)
+        {
+            m_nodes[node.next].prev = node.prev;
+        }
+    }
+
+    void TimerWheel::release(uint32_t idx, callback_t &cb)
+    {
+        Node &node = m_nodes[idx];
+        cb = std::move(node.cb);
+        node.cb = nullptr;
+        node.used = false;
+        ++node.gen;
+        node.next = m_free;
+        m_free = idx;
+        --m_size;
+    }
+
+    void TimerWheel::cascade(size_t bucket)
+    {
+        uint32_t idx = m_heads[bucket];
+        m_heads[bucket] = NIL;
+        while (NIL != idx)
+        {
+            uint32_t next = m_nodes[idx].next;
+            link(idx);
+            idx = next;
+        }
+    }
+
+    size_t TimerWheel::next_near(size_t idx) const
+    {
+        for (size_t word = idx / 64; word < NEAR_SIZE / 64; ++word)
+        {
+            uint64_t bits = m_near_bits[word];
+            if (word == idx / 64)
+            {
+                // slots before idx belong to the next lap
+                bits &= ~uint64_t(0) << (idx % 64);
+            }
+            if (bits)
+            {
+                return word * 64 + __builtin_ctzll(bits) - idx;
+            }
+        }
+        return NEAR_SIZE - idx;
+    }
+
+} // namespace soda
@@ -1,10 +1,31 @@
 #pragma once
 
 // tls related
+// resumption: server session tickets under rotating keys and a sharded session cache; clients keep the last session per peer
+// kTLS: opt-in, records are encrypted by the kernel after the handshake and sendfile works; user space crypto if unsupported
+// batching: after the handshake sends are buffered per connection and cut into full records in a memory BIO,
+// a flush sends them with one writev; reads drain all that one socket read brought in and share the lock of sends
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <list>
+#include <algorithm>
+#include <deque>
+#include <ctime>
+#include <unordered_map>
 
 #include "../general/util.hpp"
 
@@ -23,12 +44,93 @@ namespace soda
         }
     };
 
+    // handshakes done by one TLSUtil
+    struct TLSHandshakeStats
+    {
+        uint64_t full;
+        uint64_t resumed;
+        uint64_t failed;
+    };
+
+    // server side session cache, sessions kept serialized in shards with their own lock and LRU order
+    class TLSSessionCache : Noncopyable
+    {
+        static const size_t SHARD_SIZE = 16;
+
+    public:
+        explicit TLSSessionCache(size_t capacity);
+
+        void add(SSL_SESSION *session);
+
+        // nullptr if missing or expired; the caller owns the returned session
+        SSL_SESSION *get(const unsigned char *id, unsigned int id_size);
+
+        void remove(const unsigned char *id, unsigned int id_size);
+
+    private:
+        struct Entry
+        {
+            std::string id;
+            std::string der;
+            time_t expire;
+        };
+
+        struct Shard
+        {
+            std::mutex mtx;
+            // most recently used first
+            std::list<Entry> entries;
+            std::unordered_map<std::string, std::list<Entry>::iterator> index;
+        };
+
+        Shard m_shards[SHARD_SIZE];
+        size_t m_shard_capacity;
+
+    private:
+        Shard &shard(const std::string &id);
+    };
+
     class TLSUtil : Noncopyable
     {
+        // current key and the previous ones, tickets under a previous key are still accepted and renewed
+        static const size_t TICKET_KEY_COUNT = 3;
+        // encrypted records are sent anyway once this much is waiting, even if corked
+        static const size_t MAX_PENDING_SIZE = 256 * 1024;
+        // ms wait_sent() waits for a full socket
+        static const int FLUSH_TIMEOUT = 5000;
+
+    public:
+        // plaintext of a full TLS record
+        static const size_t RECORD_SIZE = 16384;
+        // raw bytes one socket read may take in, a buffer of this size takes what recv_all() drains
+        static const size_t READ_BUFFER_SIZE = 65536;
+
     private:
         SSL_CTX *m_ctx;
         bool m_is_server;
 
+        struct TicketKey
+        {
+            unsigned char name[16];
+            unsigned char aes[32];
+            unsigned char hmac[32];
+        };
+        // newest first
+        std::deque<TicketKey> m_ticket_keys;
+        uint32_t m_ticket_rotate_seconds;
+        time_t m_ticket_rotate_at;
+        std::mutex m_ticket_mtx;
+
+        std::unique_ptr<TLSSessionCache> m_session_cache;
+
+        // client: the last session of each peer
+        std::unordered_map<std::string, SSL_SESSION *> m_peer_sessions;
+        std::mutex m_peer_mtx;
+
+        mutable std::atomic<uint64_t> m_full;
+        mutable std::atomic<uint64_t> m_resumed;
+        mutable std::atomic<uint64_t> m_failed;
+
     public:
         using ssl_ptr = std::shared_ptr<SSL>;
         TLSUtil(bool is_server);
@@ -39,7 +141,21 @@ namespace soda
         bool set_CA(const std::string &cert) const;
 
         // nullptr if failed
-        ssl_ptr get_ssl(uint32_t fd);
+        // peer: for a client, e.g. "addr:port"; the last session with it is offered for resumption and replaced by new ones
+        ssl_ptr get_ssl(uint32_t fd, const std::string &peer = "");
+
+        // for server; stateless resumption, ticket keys are replaced every rotate_seconds
+        // false if failed
+        bool set_session_tickets(bool enable, uint32_t rotate_seconds = 3600);
+
+        // for server; make a new ticket key current now, e.g. on a schedule shared by a cluster
+        // false if failed
+        bool rotate_ticket_key();
+
+        // for server; stateful resumption for clients without tickets, capacity sessions kept for timeout_seconds
+        void set_session_cache(size_t capacity, uint32_t timeout_seconds = 300);
+
+        TLSHandshakeStats get_handshake_stats() const;
 
         // set if need check peer's cert
         void set_if_verify_peer_crt(bool verify) const;
@@ -53,16 +169,202 @@ namespace soda
         // -1 if failed or disconnected; received length on success; 0 try later
         int recv(const ssl_ptr &ssl, void *dst, size_t size) const;
 
+        // like recv(), then keeps reading while records are left from the same socket read
+        // -1 if failed or disconnected; received length on success; 0 try later
+        // after the handshake reads hold the lock of sends, a blocking socket should be polled for input first
+        int recv_all(const ssl_ptr &ssl, void *dst, size_t size) const;
+
+        // after the handshake: buffered, sent at once unless corked, full records are encrypted as they fill up;
+        // what a full socket does not take is kept, see pending()
+        // before: one SSL_write
         // -1 if failed or disconnected; sent length on success; 0 try later
         int send(const ssl_ptr &ssl, const void *src, size_t size) const;
 
+        // hold back sends on ssl, e.g. while a request is handled; calls nest
+        void cork(const ssl_ptr &ssl) const;
+
+        // the last one sends what was held back
+        // -1 if failed
+        int uncork(const ssl_ptr &ssl) const;
+
+        // encrypt what is buffered and send all waiting records with one writev, a full socket is not waited for
+        // -1 if failed
+        int flush(const ssl_ptr &ssl) const;
+
+        // bytes a full socket did not take, they go out with the next send, flush or read, e.g. once it is writable
+        size_t pending(const ssl_ptr &ssl) const;
+
+        // for a blocking caller, e.g. a client: send what is pending, waiting for a full socket without the lock of sends
+        // -1 if failed or still full after FLUSH_TIMEOUT
+        int wait_sent(const ssl_ptr &ssl) const;
+
+        // call before the fd of ssl is closed: close_notify goes out now, copies of ssl still held
+        // write nothing more to the fd, their sends and reads fail
+        void detach(const ssl_ptr &ssl) const;
+
+        // let OpenSSL hand record encryption to the kernel after the handshake, for connections made from now on;
+        // needs kernel TLS (the tls module) and a cipher it supports, e.g. AES-GCM, otherwise crypto stays in user space
+        void set_ktls(bool enable) const;
+
+        // the kernel encrypts what is sent / decrypts what is received on ssl
+        bool ktls_send(const ssl_ptr &ssl) const;
+        bool ktls_recv(const ssl_ptr &ssl) const;
+
+        // size bytes of srcfd from *offset, which is advanced
+        // zero copy with SSL_sendfile under kTLS while the socket takes it, the rest is read and buffered as send() does
+        // -1 if failed; the amount of data sent
+        int sendfile(const ssl_ptr &ssl, int srcfd, off_t *offset, size_t size) const;
+
     private:
+        // per connection state of batched sends, ex data of SSL
+        struct WriteBuffer
+        {
+            std::mutex mtx;
+            int fd;
+            // detach() was called, the fd may be closed or reused
+            bool closed;
+            size_t cork;
+            // not yet in records
+            std::string plain;
+            // records taken out of mem but not sent
+            std::string cipher;
+            // the wbio, owned by the SSL; nullptr under kTLS, SSL_write goes to the socket
+            BIO *mem;
+        };
+
         void init();
         void cleanup();
 
         int handle_err(const SSL *ssl, int err) const;
+
+        // count a finished handshake, ret as returned by accept() and connect()
+        int count_handshake(const SSL *ssl, int ret) const;
+
+        // ex data of SSL holding the peer key of a client connection
+        static int peer_index();
+
+        // ex data of SSL holding its WriteBuffer
+        static int write_index();
+
+        // nullptr while in handshake
+        static WriteBuffer *write_buffer(const ssl_ptr &ssl);
+
+        // on a finished handshake, writes go to a memory BIO unless the kernel encrypts them
+        void start_batching(const ssl_ptr &ssl) const;
+
+        // wb.mtx held
+
+        // -1 if failed; encrypt the full records of wb.plain, or all of it
+        int write_records(SSL *ssl, WriteBuffer &wb, bool all) const;
+
+        // -1 if failed; send what is in wb.cipher and wb.mem, what a full socket does not take is kept in wb.cipher
+        int send_records(WriteBuffer &wb) const;
+
+        // bytes a full socket did not take: records in wb.cipher, or plaintext SSL_write could not hand to it under kTLS
+        static size_t unsent(const WriteBuffer &wb);
+
+        // best effort, close_notify from SSL_shutdown is in wb.mem; a full socket is not waited for
+        static void send_close_notify(WriteBuffer &wb);
+
+        // false if fd is still full after FLUSH_TIMEOUT
+        static bool wait_writable(int fd);
+
+        static TLSUtil *from(SSL *ssl);
+
+        // m_ticket_mtx held
+        bool add_ticket_key();
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc);
+#else
+        static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc);
+#endif
+
+        static int new_session_cb(SSL *ssl, SSL_SESSION *session);
+
+        static SSL_SESSION *get_session_cb(SSL *ssl, const unsigned char *id, int id_size, int *copy);
+
+        static void remove_session_cb(SSL_CTX *ctx, SSL_SESSION *session);
     };
 
+    TLSSessionCache::TLSSessionCache(size_t capacity) : m_shard_capacity(capacity / SHARD_SIZE > 0 ? capacity / SHARD_SIZE : 1) {}
+
+    TLSSessionCache::Shard &TLSSessionCache::shard(const std::string &id)
+    {
+        return m_shards[std::hash<std::string>()(id) % SHARD_SIZE];
+    }
+
+    void TLSSessionCache::add(SSL_SESSION *session)
+    {
+        unsigned int id_size = 0;
+        const unsigned char *id = SSL_SESSION_get_id(session, &id_size);
+        int der_size = i2d_SSL_SESSION(session, nullptr);
+        if (0 == id_size || der_size <= 0)
+        {
+            return;
+        }
+        Entry entry{std::string(reinterpret_cast<const char *>(id), id_size), std::string(der_size, '\0'),
+                    static_cast<time_t>(SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session))};
+        unsigned char *der = reinterpret_cast<unsigned char *>(&entry.der[0]);
+        i2d_SSL_SESSION(session, &der);
+
+        Shard &s = shard(entry.id);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        auto iter = s.index.find(entry.id);
+        if (iter != s.index.end())
+        {
+            s.entries.erase(iter->second);
+            s.index.erase(iter);
+        }
+        if (s.entries.size() >= m_shard_capacity)
+        {
+            s.index.erase(s.entries.back().id);
+            s.entries.pop_back();
+        }
+        s.entries.push_front(std::move(entry));
+        s.index[s.entries.front().id] = s.entries.begin();
+    }
+
+    SSL_SESSION *TLSSessionCache::get(const unsigned char *id, unsigned int id_size)
+    {
+        std::string key(reinterpret_cast<const char *>(id), id_size);
+        std::string der;
+        {
+            Shard &s = shard(key);
+            std::lock_guard<std::mutex> lock(s.mtx);
+            auto iter = s.index.find(key);
+            if (iter == s.index.end())
+            {
+                return nullptr;
+            }
+            if (iter->second->expire <= time(nullptr))
+            {
+                s.entries.erase(iter->second);
+                s.index.erase(iter);
+                return nullptr;
+            }
+            s.entries.splice(s.entries.begin(), s.entries, iter->second);
+            der = iter->second->der;
+        }
+
+        // parsed unlocked
+        const unsigned char *src = reinterpret_cast<const unsigned char *>(der.data());
+        return d2i_SSL_SESSION(nullptr, &src, der.size());
+    }
+
+    void TLSSessionCache::remove(const unsigned char *id, unsigned int id_size)
+    {
+        std::string key(reinterpret_cast<const char *>(id), id_size);
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        auto iter = s.index.find(key);
+        if (iter != s.index.end())
+        {
+            s.entries.erase(iter->second);
+            s.index.erase(iter);
+        }
+    }
+
     int TLSUtil::handle_err(const SSL *ssl, int err) const
     {
         err = SSL_get_error(ssl, err);
@@ -82,27 +384,473 @@ namespace soda
 
     int TLSUtil::send(const ssl_ptr &ssl, const void *src, size_t size) const
     {
-        int ret = SSL_write(ssl.get(), src, size);
-        return ret > 0 ? ret : handle_err(ssl.get(), ret);
+        WriteBuffer *wb = write_buffer(ssl);
+        if (!wb)
+        {
+            int ret = SSL_write(ssl.get(), src, size);
+            return ret > 0 ? ret : handle_err(ssl.get(), ret);
+        }
+
+        std::lock_guard<std::mutex> lock(wb->mtx);
+        if (wb->closed)
+        {
+            return -1;
+        }
+        wb->plain.append(static_cast<const char *>(src), size);
+        if (-1 == write_records(ssl.get(), *wb, false))
+        {
+            return -1;
+        }
+        if (0 == wb->cork)
+        {
+            return -1 == write_records(ssl.get(), *wb, true) || -1 == send_records(*wb) ? -1 : size;
+        }
+        if (wb->mem && wb->cipher.size() + BIO_ctrl_pending(wb->mem) >= MAX_PENDING_SIZE)
+        {
+            return -1 == send_records(*wb) ? -1 : size;
+        }
+        return size;
+    }
+
+    void TLSUtil::cork(const ssl_ptr &ssl) const
+    {
+        WriteBuffer *wb = write_buffer(ssl);
+        if (wb)
+        {
+            std::lock_guard<std::mutex> lock(wb->mtx);
+            ++wb->cork;
+        }
+    }
+
+    int TLSUtil::uncork(const ssl_ptr &ssl) const
+    {
+        WriteBuffer *wb = write_buffer(ssl);
+        if (!wb)
+        {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(wb->mtx);
+        if (wb->cork > 0 && 0 != --wb->cork)
+        {
+            return 0;
+        }
+        if (wb->closed)
+        {
+            return -1;
+        }
+        return -1 == write_records(ssl.get(), *wb, true) ? -1 : send_records(*wb);
+    }
+
+    int TLSUtil::flush(const ssl_ptr &ssl) const
+    {
+        WriteBuffer *wb = write_buffer(ssl);
+        if (!wb)
+        {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(wb->mtx);
+        if (wb->closed)
+        {
+            return -1;
+        }
+        return -1 == write_records(ssl.get(), *wb, true) ? -1 : send_records(*wb);
+    }
+
+    void TLSUtil::detach(const ssl_ptr &ssl) const
+    {
+        if (!ssl)
+        {
+            return;
+        }
+        WriteBuffer *wb = write_buffer(ssl);
+        if (!wb)
+        {
+            // in handshake, nothing to say goodbye with
+            SSL_set_quiet_shutdown(ssl.get(), 1);
+            return;
+        }
+        std::lock_guard<std::mutex> lock(wb->mtx);
+        if (wb->closed)
+        {
+            return;
+        }
+        SSL_shutdown(ssl.get());
+        send_close_notify(*wb);
+        // SSL_free writes nothing either
+        SSL_set_quiet_shutdown(ssl.get(), 1);
+        wb->closed = true;
+    }
+
+    int TLSUtil::write_records(SSL *ssl, WriteBuffer &wb, bool all) const
+    {
+        size_t pos = 0;
+        while (wb.plain.size() - pos >= RECORD_SIZE || (all && pos < wb.plain.size()))
+        {
+            // the same buffer is passed again after a retry, as SSL_write requires
+            int ret = SSL_write(ssl, wb.plain.data() + pos, std::min(size_t(RECORD_SIZE), wb.plain.size() - pos));
+            if (ret > 0)
+            {
+                pos += ret;
+                continue;
+            }
+            // a memory BIO never fills up, only the socket under kTLS does, the rest stays in wb.plain
+            if (wb.mem || -1 == handle_err(ssl, ret))
+            {
+                ERR_print_errors_fp(stderr);
+                return -1;
+            }
+            break;
+        }
+        wb.plain.erase(0, pos);
+        return 0;
+    }
+
+    int TLSUtil::send_records(WriteBuffer &wb) const
+    {
+        if (!wb.mem)
+        {
+            return 0;
+        }
+        while (true)
+        {
+            char *data = nullptr;
+            long len = BIO_get_mem_data(wb.mem, &data);
+            if (wb.cipher.empty() && len <= 0)
+            {
+                return 0;
+            }
+
+            // what is left of the last flush, then the new records
+            iovec iov[2] = {{&wb.cipher[0], wb.cipher.size()}, {data, static_cast<size_t>(len)}};
+            msghdr msg{};
+            msg.msg_iov = wb.cipher.empty() ? iov + 1 : iov;
+            msg.msg_iovlen = wb.cipher.empty() ? 1 : 2;
+            ssize_t ret = sendmsg(wb.fd, &msg, MSG_NOSIGNAL);
+            if (ret < 0)
+            {
+                if (EINTR == errno)
+                {
+                    continue;
+                }
+                if (EAGAIN == errno || EWOULDBLOCK == errno)
+                {
+                    wb.cipher.append(data, len);
+                    BIO_reset(wb.mem);
+                    return 0;
+                }
+                perror("send records failed");
+                return -1;
+            }
+
+            size_t sent = ret;
+            if (sent < wb.cipher.size())
+            {
+                wb.cipher.erase(0, sent);
+                continue;
+            }
+            sent -= wb.cipher.size();
+            wb.cipher.assign(data + sent, len - sent);
+            BIO_reset(wb.mem);
+        }
+    }
+
+    void TLSUtil::send_close_notify(WriteBuffer &wb)
+    {
+        char *data = nullptr;
+        long len = wb.mem ? BIO_get_mem_data(wb.mem, &data) : 0;
+        if (wb.cipher.empty() && len > 0)
+        {
+            ::send(wb.fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+    }
+
+    size_t TLSUtil::unsent(const WriteBuffer &wb)
+    {
+        bool blocked = !wb.mem && (0 == wb.cork || wb.plain.size() >= RECORD_SIZE);
+        return wb.cipher.size() + (blocked ? wb.plain.size() : 0);
+    }
+
+    size_t TLSUtil::pending(const ssl_ptr &ssl) const
+    {
+        WriteBuffer *wb = write_buffer(ssl);
+        if (!wb)
+        {
+            return 0;
+        }
+        std::lock_guard<std::mutex> lock(wb->mtx);
+        return unsent(*wb);
+    }
+
+    int TLSUtil::wait_sent(const ssl_ptr &ssl) const
+    {
+        WriteBuffer *wb = write_buffer(ssl);
+        if (!wb)
+        {
+            return 0;
+        }
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(wb->mtx);
+                if (wb->closed)
+                {
+                    return -1;
+                }
+                // what is corked is left alone
+                if (-1 == write_records(ssl.get(), *wb, 0 == wb->cork) ||
+                    ((0 == wb->cork || !wb->cipher.empty()) && -1 == send_records(*wb)))
+                {
+                    return -1;
+                }
+                if (0 == unsent(*wb))
+                {
+                    return 0;
+                }
+            }
+            if (!wait_writable(wb->fd))
+            {
+                return -1;
+            }
+        }
+    }
+
+    bool TLSUtil::wait_writable(int fd)
+    {
+        pollfd pfd{fd, POLLOUT, 0};
+        int ret = -1;
+        do
+        {
+            ret = poll(&pfd, 1, FLUSH_TIMEOUT);
+        } while (-1 == ret && EINTR == errno);
+        return ret > 0;
+    }
+
+    TLSUtil::WriteBuffer *TLSUtil::write_buffer(const ssl_ptr &ssl)
+    {
+        return ssl ? static_cast<WriteBuffer *>(SSL_get_ex_data(ssl.get(), write_index())) : nullptr;
+    }
+
+    void TLSUtil::start_batching(const ssl_ptr &ssl) const
+    {
+        if (write_buffer(ssl))
+        {
+            return;
+        }
+        WriteBuffer *wb = new WriteBuffer();
+        wb->fd = SSL_get_fd(ssl.get());
+        wb->closed = false;
+        wb->cork = 0;
+        wb->mem = nullptr;
+        if (!ktls_send(ssl))
+        {
+            wb->mem = BIO_new(BIO_s_mem());
+            if (wb->mem)
+            {
+                // the socket BIO stays the rbio
+                SSL_set0_wbio(ssl.get(), wb->mem);
+            }
+        }
+        // freed with ssl
+        SSL_set_ex_data(ssl.get(), write_index(), wb);
+    }
+
+    void TLSUtil::set_ktls(bool enable) const
+    {
+#ifdef SSL_OP_ENABLE_KTLS
+        if (enable)
+        {
+            SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+        }
+        else
+        {
+            SSL_CTX_clear_options(m_ctx, SSL_OP_ENABLE_KTLS);
+        }
+#else
+        if (enable)
+        {
+            DEBUG_PRINT("OpenSSL without kTLS, crypto stays in user space");
+        }
+#endif
+    }
+
+    bool TLSUtil::ktls_send(const ssl_ptr &ssl) const
+    {
+#ifndef OPENSSL_NO_KTLS
+        return ssl && BIO_get_ktls_send(SSL_get_wbio(ssl.get()));
+#else
+        return false;
+#endif
+    }
+
+    bool TLSUtil::ktls_recv(const ssl_ptr &ssl) const
+    {
+#ifndef OPENSSL_NO_KTLS
+        return ssl && BIO_get_ktls_recv(SSL_get_rbio(ssl.get()));
+#else
+        return false;
+#endif
+    }
+
+    int TLSUtil::sendfile(const ssl_ptr &ssl, int srcfd, off_t *offset, size_t size) const
+    {
+        size_t sent_size = 0;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+        WriteBuffer *wb = write_buffer(ssl);
+        if (wb && ktls_send(ssl))
+        {
+            // buffered sends go first, then the file under the same lock
+            std::lock_guard<std::mutex> lock(wb->mtx);
+            if (wb->closed || -1 == write_records(ssl.get(), *wb, true))
+            {
+                return -1;
+            }
+            while (sent_size < size && wb->plain.empty())
+            {
+                ossl_ssize_t ret = SSL_sendfile(ssl.get(), srcfd, *offset, size - sent_size, 0);
+                if (ret > 0)
+                {
+                    *offset += ret;
+                    sent_size += ret;
+                    continue;
+                }
+                if (-1 == handle_err(ssl.get(), ret))
+                {
+                    ERR_print_errors_fp(stderr);
+                    return -1;
+                }
+                // a full socket is not waited for, the rest is buffered below
+                break;
+            }
+            if (sent_size == size)
+            {
+                return sent_size;
+            }
+        }
+#endif
+
+        // the same buffer is passed again after a retry, as SSL_write requires
+        char buf[16384];
+        while (sent_size < size)
+        {
+            ssize_t len = pread(srcfd, buf, std::min(sizeof(buf), size - sent_size), *offset);
+            if (len <= 0)
+            {
+                if (-1 == len && EINTR == errno)
+                {
+                    continue;
+                }
+                perror("sendfile read failed");
+                return -1;
+            }
+            for (ssize_t pos = 0; pos < len;)
+            {
+                int ret = send(ssl, buf + pos, len - pos);
+                if (-1 == ret)
+                {
+                    return -1;
+                }
+                pos += ret;
+            }
+            *offset += len;
+            sent_size += len;
+        }
+        return sent_size;
     }
 
     int TLSUtil::recv(const ssl_ptr &ssl, void *dst, size_t size) const
     {
+        // SSL_read may write alerts and key updates to the wbio sends use
+        WriteBuffer *wb = write_buffer(ssl);
+        std::unique_lock<std::mutex> lock;
+        if (wb)
+        {
+            lock = std::unique_lock<std::mutex>(wb->mtx);
+            if (wb->closed)
+            {
+                return -1;
+            }
+        }
         int ret = SSL_read(ssl.get(), dst, size);
-        return ret > 0 ? ret : handle_err(ssl.get(), ret);
+        ret = ret > 0 ? ret : handle_err(ssl.get(), ret);
+        return wb && -1 == send_records(*wb) ? -1 : ret;
+    }
+
+    int TLSUtil::recv_all(const ssl_ptr &ssl, void *dst, size_t size) const
+    {
+        WriteBuffer *wb = write_buffer(ssl);
+        std::unique_lock<std::mutex> lock;
+        if (wb)
+        {
+            lock = std::unique_lock<std::mutex>(wb->mtx);
+            if (wb->closed)
+            {
+                return -1;
+            }
+        }
+        size_t recv_size = 0;
+        int ret = 0;
+        while (recv_size < size)
+        {
+            ret = SSL_read(ssl.get(), static_cast<char *>(dst) + recv_size, size - recv_size);
+            if (ret <= 0)
+            {
+                ret = handle_err(ssl.get(), ret);
+                break;
+            }
+            recv_size += ret;
+            // another SSL_read would go to the socket, and block if it is blocking
+            if (0 == SSL_pending(ssl.get()) && !SSL_has_pending(ssl.get()))
+            {
+                break;
+            }
+        }
+        if (wb && -1 == send_records(*wb))
+        {
+            return -1;
+        }
+        // an error after some data comes again on the next call
+        return recv_size > 0 ? recv_size : ret;
     }
 
     int TLSUtil::connect(const ssl_ptr &ssl) const
     {
         int ret = SSL_connect(ssl.get());
-        return ret > 0 ? ret : handle_err(ssl.get(), ret);
+        ret = count_handshake(ssl.get(), ret > 0 ? ret : handle_err(ssl.get(), ret));
+        if (1 == ret)
+        {
+            start_batching(ssl);
+        }
+        return ret;
     }
 
     int TLSUtil::accept(const ssl_ptr &ssl) const
     {
         // if NIO,it could return -1 and SSL_ERROR_WANT_WRITE or SSL_ERROR_WANT_READ
         int ret = SSL_accept(ssl.get());
-        return ret > 0 ? ret : handle_err(ssl.get(), ret);
+        ret = count_handshake(ssl.get(), ret > 0 ? ret : handle_err(ssl.get(), ret));
+        if (1 == ret)
+        {
+            start_batching(ssl);
+        }
+        return ret;
+    }
+
+    int TLSUtil::count_handshake(const SSL *ssl, int ret) const
+    {
+        if (1 == ret)
+        {
+            ++(SSL_session_reused(ssl) ? m_resumed : m_full);
+        }
+        else if (-1 == ret)
+        {
+            ++m_failed;
+        }
+        return ret;
+    }
+
+    TLSHandshakeStats TLSUtil::get_handshake_stats() const
+    {
+        return {m_full, m_resumed, m_failed};
     }
 
     bool TLSUtil::set_CA(const std::string &cert) const
@@ -122,7 +870,7 @@ namespace soda
         SSL_CTX_set_verify(m_ctx, mode, nullptr);
     }
 
-    TLSUtil::ssl_ptr TLSUtil::get_ssl(uint32_t fd)
+    TLSUtil::ssl_ptr TLSUtil::get_ssl(uint32_t fd, const std::string &peer)
     {
         SSL *ssl = SSL_new(m_ctx);
         if (!ssl)
@@ -133,9 +881,241 @@ namespace soda
         // abvoe TLS1.2
         SSL_set_min_proto_version(ssl, TLS1_2_VERSION);
         SSL_set_fd(ssl, fd);
+        // one socket read takes in several records, recv_all() drains them
+        SSL_set_read_ahead(ssl, 1);
+        SSL_set_default_read_buffer_len(ssl, READ_BUFFER_SIZE);
+
+        if (!m_is_server && !peer.empty())
+        {
+            // freed with ssl
+            SSL_set_ex_data(ssl, peer_index(), new std::string(peer));
+            std::lock_guard<std::mutex> lock(m_peer_mtx);
+            auto iter = m_peer_sessions.find(peer);
+            if (iter != m_peer_sessions.end() && SSL_SESSION_is_resumable(iter->second))
+            {
+                SSL_set_session(ssl, iter->second);
+            }
+        }
         return ssl_ptr(ssl, SSLDeleter());
     }
 
+    bool TLSUtil::set_session_tickets(bool enable, uint32_t rotate_seconds)
+    {
+        if (!enable)
+        {
+            SSL_CTX_set_options(m_ctx, SSL_OP_NO_TICKET);
+            return true;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_ticket_mtx);
+            m_ticket_rotate_seconds = rotate_seconds > 0 ? rotate_seconds : 1;
+            if (m_ticket_keys.empty() && !add_ticket_key())
+            {
+                return false;
+            }
+        }
+        SSL_CTX_clear_options(m_ctx, SSL_OP_NO_TICKET);
+        // one ticket per TLS 1.3 handshake, clients keep only the last one
+        SSL_CTX_set_num_tickets(m_ctx, 1);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(m_ctx, &TLSUtil::ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(m_ctx, &TLSUtil::ticket_key_cb);
+#endif
+        return true;
+    }
+
+    bool TLSUtil::rotate_ticket_key()
+    {
+        std::lock_guard<std::mutex> lock(m_ticket_mtx);
+        return add_ticket_key();
+    }
+
+    bool TLSUtil::add_ticket_key()
+    {
+        TicketKey key;
+        if (1 != RAND_bytes(key.name, sizeof(key.name)) ||
+            1 != RAND_bytes(key.aes, sizeof(key.aes)) ||
+            1 != RAND_bytes(key.hmac, sizeof(key.hmac)))
+        {
+            ERR_print_errors_fp(stderr);
+            return false;
+        }
+        m_ticket_keys.push_front(key);
+        if (m_ticket_keys.size() > TICKET_KEY_COUNT)
+        {
+            OPENSSL_cleanse(&m_ticket_keys.back(), sizeof(TicketKey));
+            m_ticket_keys.pop_back();
+        }
+        m_ticket_rotate_at = time(nullptr) + m_ticket_rotate_seconds;
+        return true;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    int TLSUtil::ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+#else
+    int TLSUtil::ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv, EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+#endif
+    {
+        TLSUtil *tls = from(ssl);
+        TicketKey key;
+        // 1 ok, 2 ok but the ticket should be renewed, 0 unknown key: a full handshake
+        int ret = 1;
+        {
+            std::lock_guard<std::mutex> lock(tls->m_ticket_mtx);
+            if (enc)
+            {
+                if (time(nullptr) >= tls->m_ticket_rotate_at && !tls->add_ticket_key())
+                {
+                    return -1;
+                }
+                key = tls->m_ticket_keys.front();
+                memcpy(name, key.name, sizeof(key.name));
+            }
+            else
+            {
+                size_t i = 0;
+                while (i < tls->m_ticket_keys.size() && 0 != memcmp(name, tls->m_ticket_keys[i].name, sizeof(key.name)))
+                {
+                    ++i;
+                }
+                if (i == tls->m_ticket_keys.size())
+                {
+                    return 0;
+                }
+                key = tls->m_ticket_keys[i];
+                // TLS 1.3 clients use a ticket once, they always get a new one
+                ret = 0 == i && TLS1_3_VERSION != SSL_version(ssl) ? 1 : 2;
+            }
+        }
+
+        if (enc)
+        {
+            if (1 != RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) ||
+                1 != EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes, iv))
+            {
+                return -1;
+            }
+        }
+        else if (1 != EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), nullptr, key.aes, iv))
+        {
+            return -1;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        OSSL_PARAM params[] = {OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac, sizeof(key.hmac)),
+                               OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char *>("SHA256"), 0),
+                               OSSL_PARAM_construct_end()};
+        int hmac_ret = EVP_MAC_CTX_set_params(hctx, params);
+#else
+        int hmac_ret = HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), nullptr);
+#endif
+        OPENSSL_cleanse(&key, sizeof(key));
+        return 1 == hmac_ret ? ret : -1;
+    }
+
+    void TLSUtil::set_session_cache(size_t capacity, uint32_t timeout_seconds)
+    {
+        m_session_cache.reset(new TLSSessionCache(capacity));
+        SSL_CTX_set_timeout(m_ctx, timeout_seconds);
+        // OpenSSL's own cache is one table under one lock
+        SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(m_ctx, &TLSUtil::new_session_cb);
+        SSL_CTX_sess_set_get_cb(m_ctx, &TLSUtil::get_session_cb);
+        SSL_CTX_sess_set_remove_cb(m_ctx, &TLSUtil::remove_session_cb);
+    }
+
+    int TLSUtil::new_session_cb(SSL *ssl, SSL_SESSION *session)
+    {
+        TLSUtil *tls = from(ssl);
+        if (tls->m_is_server)
+        {
+            if (tls->m_session_cache)
+            {
+                tls->m_session_cache->add(session);
+            }
+            // serialized, the reference is not kept
+            return 0;
+        }
+
+        std::string *peer = static_cast<std::string *>(SSL_get_ex_data(ssl, peer_index()));
+        if (!peer)
+        {
+            return 0;
+        }
+        // a copy, an error later on this connection makes its own session not resumable
+        SSL_SESSION *copy = SSL_SESSION_dup(session);
+        if (!copy)
+        {
+            return 0;
+        }
+        SSL_SESSION *old = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(tls->m_peer_mtx);
+            SSL_SESSION *&last = tls->m_peer_sessions[*peer];
+            old = last;
+            last = copy;
+        }
+        if (old)
+        {
+            SSL_SESSION_free(old);
+        }
+        return 0;
+    }
+
+    SSL_SESSION *TLSUtil::get_session_cb(SSL *ssl, const unsigned char *id, int id_size, int *copy)
+    {
+        TLSUtil *tls = from(ssl);
+        // a new object, no reference to add
+        *copy = 0;
+        return tls->m_session_cache ? tls->m_session_cache->get(id, id_size) : nullptr;
+    }
+
+    void TLSUtil::remove_session_cb(SSL_CTX *ctx, SSL_SESSION *session)
+    {
+        TLSUtil *tls = static_cast<TLSUtil *>(SSL_CTX_get_app_data(ctx));
+        unsigned int id_size = 0;
+        const unsigned char *id = SSL_SESSION_get_id(session, &id_size);
+        if (tls && tls->m_session_cache)
+        {
+            tls->m_session_cache->remove(id, id_size);
+        }
+    }
+
+    int TLSUtil::peer_index()
+    {
+        static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr,
+                                                [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *)
+                                                { delete static_cast<std::string *>(ptr); });
+        return index;
+    }
+
+    int TLSUtil::write_index()
+    {
+        static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr,
+                                                [](void *, void *ptr, CRYPTO_EX_DATA *, int, long, void *)
+                                                {
+                                                    WriteBuffer *wb = static_cast<WriteBuffer *>(ptr);
+                                                    if (!wb)
+                                                    {
+                                                        return;
+                                                    }
+                                                    // freed before the BIOs, the fd is closed after the SSL unless detached
+                                                    if (!wb->closed)
+                                                    {
+                                                        send_close_notify(*wb);
+                                                    }
+                                                    delete wb;
+                                                });
+        return index;
+    }
+
+    TLSUtil *TLSUtil::from(SSL *ssl)
+    {
+        return static_cast<TLSUtil *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    }
+
     bool TLSUtil::set_crt_key(const std::string &cert, const std::string &key, int file_type) const
     {
         int err = 0;
@@ -159,10 +1139,29 @@ namespace soda
             ERR_print_errors_fp(stderr);
             return;
         }
+        SSL_CTX_set_app_data(m_ctx, this);
+
+        if (m_is_server)
+        {
+            // sessions are only resumed within the same context, needed when peers are verified
+            static const unsigned char sid_ctx[] = "soda";
+            SSL_CTX_set_session_id_context(m_ctx, sid_ctx, sizeof(sid_ctx) - 1);
+        }
+        else
+        {
+            // sessions are handed to new_session_cb and kept per peer
+            SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(m_ctx, &TLSUtil::new_session_cb);
+        }
     }
 
     void TLSUtil::cleanup()
     {
+        for (auto &&ele : m_peer_sessions)
+        {
+            SSL_SESSION_free(ele.second);
+        }
+        m_peer_sessions.clear();
         if (m_ctx)
         {
             SSL_CTX_free(m_ctx);
@@ -170,7 +1169,13 @@ namespace soda
         }
     }
 
-    TLSUtil::TLSUtil(bool is_server) : m_ctx(nullptr), m_is_server(is_server)
+    TLSUtil::TLSUtil(bool is_server) : m_ctx(nullptr),
+                                       m_is_server(is_server),
+                                       m_ticket_rotate_seconds(3600),
+                                       m_ticket_rotate_at(0),
+                                       m_full(0),
+                                       m_resumed(0),
+                                       m_failed(0)
     {
         init();
     }
@@ -1,16 +1,34 @@
 #pragma once
 
 // UDP server/client
+// datagrams are received in batches with recvmmsg into preallocated slots, optionally coalesced by UDP GRO;
+// batches are sent with sendmmsg, runs of equal sized datagrams to one peer as a single UDP GSO message
+// several shards: SO_REUSEPORT sockets on the same addr and port, each with its own receive thread,
+// flows are spread by the kernel's 4-tuple hash or a CBPF steering program
 
 #include <unordered_map>
+#include <vector>
+#include <algorithm>
 #include <mutex>
 #include <atomic>
 #include <functional>
 #include <thread>
+#include <memory>
 #include "socket_util.hpp"
+#include "../thread/thread_placement.hpp"
 
 namespace soda
 {
+    // one datagram of a batch; received data and peer are valid only during the callback
+    struct Datagram
+    {
+        const void *data;
+        size_t size;
+        // source when received, destination when sent
+        const sockaddr *peer;
+        socklen_t peer_size;
+    };
+
     class UDPServer
     {
         // callback for /source, fd, addr, port, data, size
@@ -21,28 +39,111 @@ namespace soda
                                              const void *data,
                                              size_t data_size)>;
 
+        // callback for all datagrams of one recvmmsg /source, fd, datagrams, count
+        using batch_cb_t = std::function<void(UDPServer &s,
+                                              int32_t fd,
+                                              const Datagram *dgrams,
+                                              size_t dgram_size)>;
+
+    public:
+        enum Steering
+        {
+            // the kernel hashes the 4-tuple, a flow stays on one shard
+            STEER_HASH,
+            // the shard placed on the CPU that received the datagram, with RSS/RPS a flow stays on one CPU and one shard;
+            // shards on no single CPU of their own get cpu % shard_size
+            STEER_CPU
+        };
+
+        static const size_t DEFAULT_BATCH_SIZE = 32;
+        static const size_t DEFAULT_SLOT_SIZE = 4096;
+        // a GRO slot holds a whole coalesced flow
+        static const size_t GRO_SLOT_SIZE = 65535;
+        // limits of one UDP_SEGMENT message
+        static const size_t GSO_MAX_SEGMENTS = 64;
+        static const size_t GSO_MAX_SIZE = 65000;
+
     private:
-        SocketUtil m_socket;
-        int32_t m_sockfd;
+        // one socket of the SO_REUSEPORT group and its receive thread
+        struct Shard
+        {
+            Shard(UDPServer *owner, const std::string &addr, uint16_t port) : owner(owner), socket(addr, port, SOCK_DGRAM, 0), fd(-1) {}
+
+            UDPServer *owner;
+            SocketUtil socket;
+            int32_t fd;
+            std::thread thread;
+        };
+
+        std::vector<std::unique_ptr<Shard>> m_shards;
         std::atomic_bool m_is_running;
-        std::thread m_rcv_t;
+        ThreadPlacement m_placement;
+        Steering m_steering;
+        // custom steering, empty for m_steering
+        std::vector<sock_filter> m_steering_prog;
         recv_cb_t m_callback_on_recv;
+        batch_cb_t m_callback_on_batch;
+
+        size_t m_batch_size;
+        size_t m_slot_size;
+        bool m_gro;
+        // cleared when the kernel or the route refuses UDP_SEGMENT
+        std::atomic_bool m_gso;
 
     public:
-        UDPServer(const std::string &addr, uint16_t port);
+        // shard_size: sockets bound to addr and port with SO_REUSEPORT, each received on by its own thread
+        UDPServer(const std::string &addr, uint16_t port, size_t shard_size = 1);
         ~UDPServer();
 
         void set_callback_on_recv(recv_cb_t cb);
 
+        // replaces the recv callback, one call per received batch
+        void set_callback_on_batch(batch_cb_t cb);
+
+        // call before start(); datagrams longer than slot_size are truncated
+        // gro: the kernel may hand a flow over as one buffer, slots grow to GRO_SLOT_SIZE; callbacks still see single datagrams
+        void set_batch(size_t batch_size, size_t slot_size = DEFAULT_SLOT_SIZE, bool gro = false);
+
+        // call before start(); the thread of shard n is placed as the n-th, e.g. PER_CPU pins each one to its own CPU
+        void set_placement(const ThreadPlacement &placement);
+
+        // call before start(); how datagrams are spread over the shards
+        void set_steering(Steering steering);
+
+        // call before start(); a classic BPF program run on each datagram, returning the shard index
+        void set_steering(const std::vector<sock_filter> &prog);
+
         // -1 if failed
         int start();
 
         void stop();
 
+        // sent from the socket of the calling receive thread, the first shard otherwise
         void send(const void *src, size_t size, const std::string &addr, uint16_t port, int flags = 0);
 
+        // consecutive datagrams of the same size to the same peer go out as one UDP_SEGMENT message if gso
+        // -1 if failed; the number of datagrams sent
+        int send_batch(const Datagram *dgrams, size_t dgram_size, bool gso = true);
+
     private:
-        void recv();
+        void recv(Shard &shard, size_t index);
+
+        // the segment size if the kernel coalesced msg with GRO, 0 otherwise
+        size_t gro_size(const msghdr &msg) const;
+
+        // dispatch one received batch to the callbacks
+        void on_batch(Shard &shard, const Datagram *dgrams, size_t dgram_size);
+
+        // the shard of the calling receive thread, the first one for other threads
+        Shard &sender();
+
+        // set on each receive thread, nullptr on others
+        static Shard *&local_shard();
+
+        // -1 if failed
+        int attach_steering();
+
+        std::vector<sock_filter> cpu_steering() const;
     };
 
     void UDPServer::set_callback_on_recv(recv_cb_t cb)
@@ -50,45 +151,177 @@ namespace soda
         m_callback_on_recv = std::move(cb);
     }
 
-    UDPServer::UDPServer(const std::string &addr, uint16_t port) : m_socket(addr, port, SOCK_DGRAM, 0),
-                                                                   m_sockfd(-1),
-                                                                   m_is_running(false),
-                                                                   m_rcv_t()
+    void UDPServer::set_callback_on_batch(batch_cb_t cb)
     {
+        m_callback_on_batch = std::move(cb);
     }
 
-    UDPServer::~UDPServer()
+    void UDPServer::set_batch(size_t batch_size, size_t slot_size, bool gro)
     {
-        stop();
-        if (m_rcv_t.joinable())
+        m_batch_size = batch_size > 0 ? batch_size : 1;
+        m_slot_size = slot_size > 0 ? slot_size : DEFAULT_SLOT_SIZE;
+        m_gro = gro;
+    }
+
+    void UDPServer::set_placement(const ThreadPlacement &placement)
+    {
+        m_placement = placement;
+    }
+
+    void UDPServer::set_steering(Steering steering)
+    {
+        m_steering = steering;
+        m_steering_prog.clear();
+    }
+
+    void UDPServer::set_steering(const std::vector<sock_filter> &prog)
+    {
+        m_steering_prog = prog;
+    }
+
+    UDPServer::UDPServer(const std::string &addr, uint16_t port, size_t shard_size) : m_is_running(false),
+                                                                                      m_steering(STEER_HASH),
+                                                                                      m_batch_size(DEFAULT_BATCH_SIZE),
+                                                                                      m_slot_size(DEFAULT_SLOT_SIZE),
+                                                                                      m_gro(false),
+                                                                                      m_gso(true)
+    {
+        for (size_t i = 0; i < (shard_size > 0 ? shard_size : 1); ++i)
         {
-            m_rcv_t.join();
+            m_shards.emplace_back(new Shard(this, addr, port));
         }
+    }
+
+    UDPServer::~UDPServer()
+    {
+        stop();
     };
 
-    void UDPServer::recv()
+    UDPServer::Shard &UDPServer::sender()
     {
-        if (!m_callback_on_recv)
+        Shard *shard = local_shard();
+        return shard && this == shard->owner ? *shard : *m_shards[0];
+    }
+
+    UDPServer::Shard *&UDPServer::local_shard()
+    {
+        static thread_local Shard *shard = nullptr;
+        return shard;
+    }
+
+    void UDPServer::recv(Shard &shard, size_t index)
+    {
+        m_placement.apply(index);
+        local_shard() = &shard;
+        if (!m_callback_on_recv && !m_callback_on_batch)
         {
             return;
         }
 
-        AddrInfo ai{};
-        uint8_t buf[4096];
-        int ret = -1;
+        // slots are set up once, only the lengths the kernel writes back are reset per batch
+        size_t slot_size = m_gro ? size_t(GRO_SLOT_SIZE) : m_slot_size;
+        std::vector<uint8_t> bufs(m_batch_size * slot_size);
+        std::vector<sockaddr_storage> peers(m_batch_size);
+        std::vector<iovec> iovs(m_batch_size);
+        std::vector<mmsghdr> msgs(m_batch_size);
+        const size_t control_size = CMSG_SPACE(sizeof(int));
+        std::vector<char> controls(m_gro ? m_batch_size * control_size : 0);
+        std::vector<Datagram> dgrams;
+        dgrams.reserve(m_batch_size);
+        for (size_t i = 0; i < m_batch_size; ++i)
+        {
+            iovs[i] = {bufs.data() + i * slot_size, slot_size};
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name = &peers[i];
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = m_gro ? controls.data() + i * control_size : nullptr;
+        }
+
         while (m_is_running)
         {
-            memset(buf, 0, sizeof(buf));
-            ret = m_socket.recv_from(m_sockfd, buf, sizeof(buf), &ai);
+            for (size_t i = 0; i < m_batch_size; ++i)
+            {
+                msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+                msgs[i].msg_hdr.msg_controllen = m_gro ? control_size : 0;
+            }
+
+            int ret = shard.socket.recv_batch(shard.fd, msgs.data(), m_batch_size, MSG_WAITFORONE);
+            if (!m_is_running)
+            {
+                // woken up by stop()
+                break;
+            }
+            if (-1 == ret)
+            {
+                DEBUG_PRINT("shard " << index << " stops receiving");
+                break;
+            }
 
-            if (ret >= 0)
+            dgrams.clear();
+            for (int i = 0; i < ret; ++i)
+            {
+                const msghdr &msg = msgs[i].msg_hdr;
+                const uint8_t *data = reinterpret_cast<const uint8_t *>(iovs[i].iov_base);
+                size_t size = msgs[i].msg_len;
+                if (msg.msg_flags & MSG_TRUNC)
+                {
+                    DEBUG_PRINT("datagram truncated to the slot size");
+                }
+
+                // a GRO buffer is split back into the datagrams the peer sent
+                size_t segment = m_gro ? gro_size(msg) : 0;
+                segment = segment > 0 ? segment : size;
+                size_t pos = 0;
+                do
+                {
+                    size_t len = size - pos < segment ? size - pos : segment;
+                    dgrams.push_back(Datagram{data + pos, len, reinterpret_cast<const sockaddr *>(msg.msg_name), msg.msg_namelen});
+                    pos += len;
+                } while (pos < size);
+            }
+            on_batch(shard, dgrams.data(), dgrams.size());
+        }
+    }
+
+    size_t UDPServer::gro_size(const msghdr &msg) const
+    {
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(const_cast<msghdr *>(&msg), cm))
+        {
+            if (SOL_UDP == cm->cmsg_level && UDP_GRO == cm->cmsg_type)
             {
-                m_callback_on_recv(*this, m_sockfd, ai.addr, ai.port, buf, ret);
+                int size = 0;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                return size > 0 ? size : 0;
             }
-            else
+        }
+        return 0;
+    }
+
+    void UDPServer::on_batch(Shard &shard, const Datagram *dgrams, size_t dgram_size)
+    {
+        if (0 == dgram_size)
+        {
+            return;
+        }
+        if (m_callback_on_batch)
+        {
+            m_callback_on_batch(*this, shard.fd, dgrams, dgram_size);
+            return;
+        }
+
+        // a flow often fills the batch, the address string is made once per run of the same peer
+        AddrInfo ai{};
+        const Datagram *last = nullptr;
+        for (size_t i = 0; i < dgram_size; ++i)
+        {
+            const Datagram &dgram = dgrams[i];
+            if (!last || last->peer_size != dgram.peer_size || 0 != memcmp(last->peer, dgram.peer, dgram.peer_size))
             {
-                stop();
+                ai = shard.socket.to_addrinfo(dgram.peer);
+                last = &dgram;
             }
+            m_callback_on_recv(*this, shard.fd, ai.addr, ai.port, dgram.data, dgram.size);
         }
     }
 
@@ -99,25 +332,205 @@ namespace soda
             return 0;
         }
 
-        if (-1 == m_socket.start_udp_server())
+        // bound in index order, the order steering programs refer to
+        bool reuseport = m_shards.size() > 1;
+        for (size_t i = 0; i < m_shards.size(); ++i)
         {
-            return -1;
+            Shard &shard = *m_shards[i];
+            if (-1 == shard.socket.start_udp_server(reuseport))
+            {
+                for (size_t k = 0; k <= i; ++k)
+                {
+                    m_shards[k]->socket.stop();
+                    m_shards[k]->fd = -1;
+                }
+                return -1;
+            }
+            shard.fd = shard.socket.get_sockfd();
+            if (m_gro && -1 == shard.socket.set_udp_gro(shard.fd))
+            {
+                // datagrams still arrive one per slot
+                m_gro = false;
+            }
+        }
+        if (reuseport && -1 == attach_steering())
+        {
+            DEBUG_PRINT("steering program refused, flows are spread by the 4-tuple hash");
         }
-        m_sockfd = m_socket.get_sockfd();
         m_is_running = true;
 
-        m_rcv_t = std::move(std::thread(std::bind(&UDPServer::recv, this)));
+        for (size_t i = 0; i < m_shards.size(); ++i)
+        {
+            m_shards[i]->thread = std::thread(std::bind(&UDPServer::recv, this, std::ref(*m_shards[i]), i));
+        }
         return 0;
     }
 
     void UDPServer::stop()
     {
-        m_is_running = false;
+        if (!m_is_running.exchange(false))
+        {
+            return;
+        }
+
+        // wakes up the threads blocked in recvmmsg; an unconnected socket reports ENOTCONN but is shut down anyway
+        for (auto &&shard : m_shards)
+        {
+            shutdown(shard->fd, SHUT_RD);
+        }
+        for (auto &&shard : m_shards)
+        {
+            if (!shard->thread.joinable())
+            {
+                continue;
+            }
+            if (std::this_thread::get_id() == shard->thread.get_id())
+            {
+                // stop() from a callback, the thread leaves once it returns
+                shard->thread.detach();
+                continue;
+            }
+            shard->thread.join();
+        }
+        for (auto &&shard : m_shards)
+        {
+            shard->socket.stop();
+            shard->fd = -1;
+        }
     }
 
     void UDPServer::send(const void *src, size_t size, const std::string &addr, uint16_t port, int flags)
     {
-        m_socket.send_to(src, size, addr, port, flags);
+        sender().socket.send_to(src, size, addr, port, flags);
+    }
+
+    int UDPServer::send_batch(const Datagram *dgrams, size_t dgram_size, bool gso)
+    {
+        // scratch of the calling thread, reused by its later batches
+        struct Scratch
+        {
+            std::vector<mmsghdr> msgs;
+            std::vector<iovec> iovs;
+            std::vector<char> controls;
+            // first datagram of each message
+            std::vector<size_t> firsts;
+        };
+        static thread_local Scratch scratch;
+        const size_t control_size = CMSG_SPACE(sizeof(uint16_t));
+
+        size_t sent = 0;
+        while (sent < dgram_size)
+        {
+            bool use_gso = gso && m_gso;
+            size_t count = dgram_size - sent;
+            scratch.msgs.resize(count);
+            scratch.iovs.resize(count);
+            scratch.controls.resize(count * control_size);
+            scratch.firsts.resize(count);
+
+            size_t msg_size = 0;
+            for (size_t i = sent; i < dgram_size;)
+            {
+                const Datagram &first = dgrams[i];
+                size_t n = 1;
+                size_t total = first.size;
+                // equal segments to one peer, only the last may be shorter
+                while (use_gso && i + n < dgram_size && n < GSO_MAX_SEGMENTS && first.size > 0 &&
+                       dgrams[i + n - 1].size == first.size && dgrams[i + n].size <= first.size &&
+                       total + dgrams[i + n].size <= GSO_MAX_SIZE &&
+                       dgrams[i + n].peer_size == first.peer_size &&
+                       0 == memcmp(dgrams[i + n].peer, first.peer, first.peer_size))
+                {
+                    total += dgrams[i + n].size;
+                    ++n;
+                }
+
+                iovec *iov = scratch.iovs.data() + (i - sent);
+                for (size_t k = 0; k < n; ++k)
+                {
+                    iov[k] = {const_cast<void *>(dgrams[i + k].data), dgrams[i + k].size};
+                }
+                mmsghdr &msg = scratch.msgs[msg_size];
+                msg = {};
+                msg.msg_hdr.msg_name = const_cast<sockaddr *>(first.peer);
+                msg.msg_hdr.msg_namelen = first.peer_size;
+                msg.msg_hdr.msg_iov = iov;
+                msg.msg_hdr.msg_iovlen = n;
+                if (n > 1)
+                {
+                    char *control = scratch.controls.data() + msg_size * control_size;
+                    memset(control, 0, control_size);
+                    msg.msg_hdr.msg_control = control;
+                    msg.msg_hdr.msg_controllen = control_size;
+                    cmsghdr *cm = CMSG_FIRSTHDR(&msg.msg_hdr);
+                    cm->cmsg_level = SOL_UDP;
+                    cm->cmsg_type = UDP_SEGMENT;
+                    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t segment = first.size;
+                    memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+                }
+                scratch.firsts[msg_size++] = i;
+                i += n;
+            }
+
+            Shard &shard = sender();
+            int ret = shard.socket.send_batch(shard.fd, scratch.msgs.data(), msg_size);
+            if (ret > 0)
+            {
+                // a short count stops at a full socket or an error, the next round tells which
+                sent = static_cast<size_t>(ret) < msg_size ? scratch.firsts[ret] : dgram_size;
+                continue;
+            }
+            if (-1 == ret && scratch.msgs[0].msg_hdr.msg_iovlen > 1)
+            {
+                // e.g. kernel before 4.18 or a segment over the route MTU, send them one by one from now on
+                DEBUG_PRINT("UDP_SEGMENT refused, sending datagrams one by one");
+                m_gso = false;
+                continue;
+            }
+            if (-1 == ret && 0 == sent)
+            {
+                return -1;
+            }
+            break;
+        }
+        return sent;
+    }
+
+    int UDPServer::attach_steering()
+    {
+        if (m_steering_prog.empty() && STEER_HASH == m_steering)
+        {
+            return 0;
+        }
+        // set on one socket, it applies to the whole group
+        Shard &shard = *m_shards[0];
+        return shard.socket.set_reuseport_cbpf(shard.fd, m_steering_prog.empty() ? cpu_steering() : m_steering_prog);
+    }
+
+    std::vector<sock_filter> UDPServer::cpu_steering() const
+    {
+        std::vector<sock_filter> prog;
+        prog.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU)));
+
+        // a shard pinned to one CPU gets what that CPU receives
+        const std::vector<std::vector<int>> &groups = m_placement.groups();
+        std::vector<int> mapped;
+        for (size_t i = 0; i < m_shards.size() && !groups.empty() && prog.size() + 4 < BPF_MAXINSNS; ++i)
+        {
+            const std::vector<int> &group = groups[i % groups.size()];
+            if (1 != group.size() || std::find(mapped.begin(), mapped.end(), group[0]) != mapped.end())
+            {
+                continue;
+            }
+            mapped.push_back(group[0]);
+            prog.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(group[0]), 0, 1));
+            prog.push_back(BPF_STMT(BPF_RET | BPF_K, static_cast<uint32_t>(i)));
+        }
+
+        prog.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, static_cast<uint32_t>(m_shards.size())));
+        prog.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+        return prog;
     }
 
 } // namespace soda
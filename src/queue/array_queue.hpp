@@ -0,0 +1,140 @@
+#pragma once
+
+// array queue - FIFO on a growable circular array; memory is reused, no allocation per element; non-thread safe
+
+#include <new>
+#include <utility>
+#include <type_traits>
+
+#include "../general/util.hpp"
+
+namespace soda
+{
+    template <typename T>
+    class ArrayQueue : Noncopyable
+    {
+    public:
+        // capacity 2^n, doubled when full
+        ArrayQueue(size_t capacity = 64);
+        ~ArrayQueue();
+
+        void push(T &&value);
+
+        // ! ! ! must not be empty
+        T pop();
+
+        // ! ! ! must not be empty
+        T &front();
+
+        bool empty() const;
+
+        size_t size() const;
+
+        void clear();
+
+    private:
+        using storage_type = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+        size_t m_capacity;
+        size_t m_head;
+        size_t m_tail;
+        storage_type *m_buffer;
+
+    private:
+        inline T *at(size_t pos);
+
+        void grow();
+    };
+
+    template <typename T>
+    ArrayQueue<T>::ArrayQueue(size_t capacity) : m_capacity(roundup_pow_of_two(capacity ? capacity : 1)),
+                                                 m_head(0),
+                                                 m_tail(0),
+                                                 m_buffer(new storage_type[m_capacity])
+    {
+    }
+
+    template <typename T>
+    ArrayQueue<T>::~ArrayQueue()
+    {
+        clear();
+        delete[] m_buffer;
+        m_buffer = nullptr;
+    }
+
+    template <typename T>
+    inline T *ArrayQueue<T>::at(size_t pos)
+    {
+        return reinterpret_cast<T *>(&m_buffer[pos & (m_capacity - 1)]);
+    }
+
+    template <typename T>
+    void ArrayQueue<T>::grow()
+    {
+        size_t capacity = m_capacity * 2;
+        storage_type *buffer = new storage_type[capacity];
+        size_t size = this->size();
+        for (size_t i = 0; i < size; ++i)
+        {
+            T *src = at(m_head + i);
+            new (&buffer[i]) T(std::move(*src));
+            src->~T();
+        }
+        delete[] m_buffer;
+        m_buffer = buffer;
+        m_capacity = capacity;
+        m_head = 0;
+        m_tail = size;
+    }
+
+    template <typename T>
+    void ArrayQueue<T>::push(T &&value)
+    {
+        if (size() == m_capacity)
+        {
+            grow();
+        }
+        new (at(m_tail)) T(std::move(value));
+        ++m_tail;
+    }
+
+    template <typename T>
+    T ArrayQueue<T>::pop()
+    {
+        T *ptr = at(m_head);
+        T ret(std::move(*ptr));
+        ptr->~T();
+        ++m_head;
+        return ret;
+    }
+
+    template <typename T>
+    T &ArrayQueue<T>::front()
+    {
+        return *at(m_head);
+    }
+
+    template <typename T>
+    bool ArrayQueue<T>::empty() const
+    {
+        return m_head == m_tail;
+    }
+
+    template <typename T>
+    size_t ArrayQueue<T>::size() const
+    {
+        return m_tail - m_head;
+    }
+
+    template <typename T>
+    void ArrayQueue<T>::clear()
+    {
+        while (!empty())
+        {
+            at(m_head)->~T();
+            ++m_head;
+        }
+        m_head = m_tail = 0;
+    }
+
+} // namespace soda
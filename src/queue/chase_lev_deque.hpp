@@ -0,0 +1,146 @@
+#pragma once
+
+// Chase-Lev work stealing deque - bounded; lock free; owner pushes/pops at bottom, thieves steal at top
+// ! ! ! push() and pop() must only be called by the owner thread; T must be trivially copyable (e.g. pointer)
+
+#include <atomic>
+#include <cstdint>
+
+#include "../general/util.hpp"
+
+namespace soda
+{
+    template <typename T>
+    class ChaseLevDeque : Noncopyable
+    {
+    public:
+        ChaseLevDeque(size_t capacity = 1024);
+        ~ChaseLevDeque();
+
+        // owner; false if full
+        bool push(T value);
+
+        // owner; false if empty
+        bool pop(T &dst);
+
+        // any thread; false if empty or lost the race to another thief/owner
+        bool steal(T &dst);
+
+        // snapshot
+        bool empty() const;
+
+        // snapshot
+        size_t size() const;
+
+    private:
+        // owner end; padded so owner and thieves do not share a cache line
+        std::atomic<int64_t> m_bottom;
+        uint8_t m_pad0[CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>)];
+        // thief end
+        std::atomic<int64_t> m_top;
+        uint8_t m_pad1[CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>)];
+        // capacity 2^n
+        int64_t m_capacity;
+        std::atomic<T> *m_buffer;
+    };
+
+    template <typename T>
+    ChaseLevDeque<T>::ChaseLevDeque(size_t capacity) : m_bottom(0),
+                                                       m_pad0{},
+                                                       m_top(0),
+                                                       m_pad1{},
+                                                       m_capacity(roundup_pow_of_two(capacity)),
+                                                       m_buffer(new std::atomic<T>[m_capacity])
+    {
+    }
+
+    template <typename T>
+    ChaseLevDeque<T>::~ChaseLevDeque()
+    {
+        if (m_buffer)
+        {
+            delete[] m_buffer;
+            m_buffer = nullptr;
+        }
+    }
+
+    template <typename T>
+    bool ChaseLevDeque<T>::push(T value)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        int64_t t = m_top.load(std::memory_order_acquire);
+        if (b - t >= m_capacity)
+        {
+            return false;
+        }
+
+        m_buffer[b & (m_capacity - 1)].store(value, std::memory_order_relaxed);
+        // the slot must be visible before thieves can see the new bottom
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    template <typename T>
+    bool ChaseLevDeque<T>::pop(T &dst)
+    {
+        int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(b, std::memory_order_relaxed);
+        // order the bottom store before the top load, pairs with the fence in steal()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            // empty, restore
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        dst = m_buffer[b & (m_capacity - 1)].load(std::memory_order_relaxed);
+        if (t == b)
+        {
+            // the last one, race with thieves for it
+            bool won = m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    template <typename T>
+    bool ChaseLevDeque<T>::steal(T &dst)
+    {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = m_bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+        {
+            return false;
+        }
+
+        T value = m_buffer[t & (m_capacity - 1)].load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        {
+            return false;
+        }
+        dst = value;
+        return true;
+    }
+
+    template <typename T>
+    bool ChaseLevDeque<T>::empty() const
+    {
+        return 0 == size();
+    }
+
+    template <typename T>
+    size_t ChaseLevDeque<T>::size() const
+    {
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        int64_t b = m_bottom.load(std::memory_order_relaxed);
+        return b > t ? static_cast<size_t>(b - t) : 0;
+    }
+
+} // namespace soda
@@ -2,17 +2,17 @@
 
 // multi-thread priority task queue
 
-#include <list>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
+#include <vector>
+#include <atomic>
 
 #include "../general/util.hpp"
+#include "task.hpp"
+#include "array_queue.hpp"
 
 namespace soda
 {
-    using TaskType = std::function<void()>;
-
     enum TaskPriority
     {
         HIGH,
@@ -23,7 +23,7 @@ namespace soda
     class PriorityTaskQueue : Noncopyable
     {
     public:
-        PriorityTaskQueue() : m_size(0) {}
+        PriorityTaskQueue() : m_size(0), m_waiting(0) {}
         ~PriorityTaskQueue() {}
 
         bool empty() const;
@@ -33,22 +33,44 @@ namespace soda
 
         void enqueue(TaskType task, TaskPriority pri = TaskPriority::NORMAL);
 
+        // one lock for all, wake min(batch, waiting) workers
+        void enqueue_bulk(std::vector<TaskType> &&tasks, TaskPriority pri = TaskPriority::NORMAL);
+
         TaskType dequeue();
 
     private:
         // low q
-        std::list<TaskType> m_queue_low;
+        ArrayQueue<TaskType> m_queue_low;
         // normal q
-        std::list<TaskType> m_queue_normal;
+        ArrayQueue<TaskType> m_queue_normal;
         // high q
-        std::list<TaskType> m_queue_high;
+        ArrayQueue<TaskType> m_queue_high;
 
         std::mutex m_mtx;
         std::condition_variable m_cv;
 
-        size_t m_size;
+        // read without the lock by size() and empty()
+        std::atomic_size_t m_size;
+        // workers blocked in dequeue()
+        size_t m_waiting;
+
+    private:
+        inline ArrayQueue<TaskType> &get_queue(TaskPriority pri);
     };
 
+    inline ArrayQueue<TaskType> &PriorityTaskQueue::get_queue(TaskPriority pri)
+    {
+        if (pri == TaskPriority::LOW)
+        {
+            return m_queue_low;
+        }
+        else if (pri == TaskPriority::HIGH)
+        {
+            return m_queue_high;
+        }
+        return m_queue_normal;
+    }
+
     bool PriorityTaskQueue::empty() const
     {
         return !m_size;
@@ -77,53 +99,63 @@ namespace soda
 
     void PriorityTaskQueue::enqueue(TaskType task, TaskPriority pri)
     {
-        std::list<TaskType> *queue = &m_queue_normal;
-        if (pri == TaskPriority::LOW)
-        {
-            queue = &m_queue_low;
-        }
-        else if (pri == TaskPriority::HIGH)
-        {
-            queue = &m_queue_high;
-        }
+        ArrayQueue<TaskType> &queue = get_queue(pri);
 
         std::lock_guard<std::mutex> lock(m_mtx);
-        queue->emplace_back(std::move(task));
+        queue.push(std::move(task));
         ++m_size;
 
         m_cv.notify_one();
     }
 
+    void PriorityTaskQueue::enqueue_bulk(std::vector<TaskType> &&tasks, TaskPriority pri)
+    {
+        ArrayQueue<TaskType> &queue = get_queue(pri);
+
+        std::lock_guard<std::mutex> lock(m_mtx);
+        for (auto &&task : tasks)
+        {
+            queue.push(std::move(task));
+        }
+        m_size += tasks.size();
+
+        if (tasks.size() >= m_waiting)
+        {
+            m_cv.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            m_cv.notify_one();
+        }
+    }
+
     TaskType PriorityTaskQueue::dequeue()
     {
         std::unique_lock<std::mutex> lock(m_mtx);
+        ++m_waiting;
         m_cv.wait(lock, [this]
                   { return !this->empty(); });
+        --m_waiting;
 
         --m_size;
         if (!m_queue_high.empty())
         {
             // libc++abi: terminating with uncaught exception of type std::__1::future_error: The state of the promise has already been set.
             // auto &ret = m_queue_high.front();
-            TaskType ret = std::move(m_queue_high.front());
-            m_queue_high.pop_front();
-            return ret;
+            return m_queue_high.pop();
         }
 
         if (!m_queue_normal.empty())
         {
-            TaskType ret = std::move(m_queue_normal.front());
-            m_queue_normal.pop_front();
-            return ret;
+            return m_queue_normal.pop();
         }
 
         if (!m_queue_low.empty())
         {
-            TaskType ret = std::move(m_queue_low.front());
-            m_queue_low.pop_front();
-            return ret;
+            return m_queue_low.pop();
         }
-        return std::move([] {});
+        return TaskType();
     }
 
 } // namespace soda
@@ -0,0 +1,351 @@
+#pragma once
+
+// task type - move only; small callables stored inline without allocation; promise task with pooled shared state
+
+#include <future>
+#include <functional>
+#include <memory>
+#include <new>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <atomic>
+#include <iterator>
+
+#include "../general/util.hpp"
+#include "../general/pool_allocator.hpp"
+
+namespace soda
+{
+    class Task
+    {
+    public:
+        // one cache line with the ops pointer
+        static const size_t INLINE_SIZE = 64 - sizeof(void *);
+
+        Task() noexcept : m_ops(nullptr) {}
+
+        template <typename F, typename = require<std::integral_constant<bool, !std::is_same<rm_cvref_t<F>, Task>::value>>>
+        Task(F &&f);
+
+        Task(Task &&other) noexcept;
+
+        Task &operator=(Task &&other) noexcept;
+
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+
+        ~Task();
+
+        void operator()();
+
+        explicit operator bool() const noexcept { return nullptr != m_ops; }
+
+    private:
+        struct Ops
+        {
+            void (*invoke)(void *storage);
+            // move construct into dst and destroy src
+            void (*move)(void *dst, void *src);
+            void (*destroy)(void *storage);
+        };
+
+        // callable lives in m_storage
+        template <typename F>
+        struct InlineOps
+        {
+            static void invoke(void *storage) { (*reinterpret_cast<F *>(storage))(); }
+            static void move(void *dst, void *src)
+            {
+                new (dst) F(std::move(*reinterpret_cast<F *>(src)));
+                reinterpret_cast<F *>(src)->~F();
+            }
+            static void destroy(void *storage) { reinterpret_cast<F *>(storage)->~F(); }
+            static const Ops ops;
+        };
+
+        // m_storage holds a pointer to the callable
+        template <typename F>
+        struct HeapOps
+        {
+            static void invoke(void *storage) { (**reinterpret_cast<F **>(storage))(); }
+            static void move(void *dst, void *src) { *reinterpret_cast<F **>(dst) = *reinterpret_cast<F **>(src); }
+            static void destroy(void *storage) { delete *reinterpret_cast<F **>(storage); }
+            static const Ops ops;
+        };
+
+        template <typename F>
+        using fits_inline = std::integral_constant<bool, sizeof(F) <= INLINE_SIZE &&
+                                                             alignof(F) <= alignof(std::max_align_t) &&
+                                                             std::is_nothrow_move_constructible<F>::value>;
+
+        template <typename F>
+        void init(F &&f, std::true_type);
+
+        template <typename F>
+        void init(F &&f, std::false_type);
+
+        void reset() noexcept;
+
+        alignas(std::max_align_t) unsigned char m_storage[INLINE_SIZE];
+        const Ops *m_ops;
+    };
+
+    template <typename F>
+    const Task::Ops Task::InlineOps<F>::ops = {&Task::InlineOps<F>::invoke, &Task::InlineOps<F>::move, &Task::InlineOps<F>::destroy};
+
+    template <typename F>
+    const Task::Ops Task::HeapOps<F>::ops = {&Task::HeapOps<F>::invoke, &Task::HeapOps<F>::move, &Task::HeapOps<F>::destroy};
+
+    template <typename F, typename>
+    Task::Task(F &&f) : m_ops(nullptr)
+    {
+        using func_type = typename std::decay<F>::type;
+        init(std::forward<F>(f), fits_inline<func_type>());
+    }
+
+    template <typename F>
+    void Task::init(F &&f, std::true_type)
+    {
+        using func_type = typename std::decay<F>::type;
+        new (m_storage) func_type(std::forward<F>(f));
+        m_ops = &InlineOps<func_type>::ops;
+    }
+
+    template <typename F>
+    void Task::init(F &&f, std::false_type)
+    {
+        using func_type = typename std::decay<F>::type;
+        *reinterpret_cast<func_type **>(m_storage) = new func_type(std::forward<F>(f));
+        m_ops = &HeapOps<func_type>::ops;
+    }
+
+    Task::Task(Task &&other) noexcept : m_ops(other.m_ops)
+    {
+        if (m_ops)
+        {
+            m_ops->move(m_storage, other.m_storage);
+            other.m_ops = nullptr;
+        }
+    }
+
+    Task &Task::operator=(Task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            if (other.m_ops)
+            {
+                m_ops = other.m_ops;
+                m_ops->move(m_storage, other.m_storage);
+                other.m_ops = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    Task::~Task()
+    {
+        reset();
+    }
+
+    void Task::reset() noexcept
+    {
+        if (m_ops)
+        {
+            m_ops->destroy(m_storage);
+            m_ops = nullptr;
+        }
+    }
+
+    void Task::operator()()
+    {
+        if (m_ops)
+        {
+            m_ops->invoke(m_storage);
+        }
+    }
+
+    using TaskType = Task;
+
+    // callable bound with a promise, the shared state of promise/future comes from SmallObjectPool
+    template <typename R, typename F>
+    class PromiseTask
+    {
+    public:
+        explicit PromiseTask(F &&func) : m_promise(std::allocator_arg, PoolAllocator<char>()),
+                                         m_func(std::move(func)) {}
+
+        PromiseTask(PromiseTask &&) = default;
+
+        std::future<R> get_future() { return m_promise.get_future(); }
+
+        void operator()()
+        {
+            try
+            {
+                set_value(std::is_void<R>());
+            }
+            catch (...)
+            {
+                m_promise.set_exception(std::current_exception());
+            }
+        }
+
+    private:
+        std::promise<R> m_promise;
+        F m_func;
+
+        void set_value(std::true_type)
+        {
+            m_func();
+            m_promise.set_value();
+        }
+
+        void set_value(std::false_type)
+        {
+            m_promise.set_value(m_func());
+        }
+    };
+
+    // bind f with args into a task and get its future
+    template <typename F, typename... Args>
+    auto make_promise_task(F &&f, Args &&...args)
+        -> std::pair<Task, std::future<decltype(std::forward<F>(f)(std::forward<Args>(args)...))>>
+    {
+        using ret_type = decltype(std::forward<F>(f)(std::forward<Args>(args)...));
+        using func_type = decltype(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        PromiseTask<ret_type, func_type> task(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+        std::future<ret_type> ret = task.get_future();
+        return std::make_pair(Task(std::move(task)), std::move(ret));
+    }
+
+    // completion of a batch, the future is ready when all tasks have run, with the first exception if any
+    class BatchState : Noncopyable
+    {
+    public:
+        explicit BatchState(size_t size) : m_remaining(size), m_failed(false) {}
+
+        std::future<void> get_future() { return m_promise.get_future(); }
+
+        void done()
+        {
+            // acq_rel so the last one sees the exception stored by any other
+            if (1 != m_remaining.fetch_sub(1, std::memory_order_acq_rel))
+            {
+                return;
+            }
+            if (m_failed)
+            {
+                m_promise.set_exception(m_error);
+            }
+            else
+            {
+                m_promise.set_value();
+            }
+        }
+
+        void fail(std::exception_ptr error)
+        {
+            if (!m_failed.exchange(true))
+            {
+                m_error = error;
+            }
+        }
+
+    private:
+        std::atomic_size_t m_remaining;
+        std::atomic_bool m_failed;
+        std::exception_ptr m_error;
+        std::promise<void> m_promise;
+    };
+
+    template <typename F>
+    class BatchTask
+    {
+    public:
+        BatchTask(const std::shared_ptr<BatchState> &state, F &&func) : m_state(state), m_func(std::move(func)) {}
+
+        void operator()()
+        {
+            try
+            {
+                m_func();
+            }
+            catch (...)
+            {
+                m_state->fail(std::current_exception());
+            }
+            m_state->done();
+        }
+
+    private:
+        std::shared_ptr<BatchState> m_state;
+        F m_func;
+    };
+
+    // one chunk [first, last) of a parallel_for
+    template <typename Index, typename F>
+    class RangeChunk
+    {
+    public:
+        RangeChunk(const std::shared_ptr<F> &func, Index first, Index last) : m_func(func), m_first(first), m_last(last) {}
+
+        void operator()() { (*m_func)(m_first, m_last); }
+
+    private:
+        std::shared_ptr<F> m_func;
+        Index m_first;
+        Index m_last;
+    };
+
+    // a task per element in [begin, end), elements are copied (use std::make_move_iterator to move them)
+    template <typename Iter>
+    std::pair<std::vector<Task>, std::future<void>> make_batch_tasks(Iter begin, Iter end)
+    {
+        using func_type = typename std::decay<decltype(*begin)>::type;
+        size_t size = std::distance(begin, end);
+        std::shared_ptr<BatchState> state = std::make_shared<BatchState>(size);
+        std::future<void> ret = state->get_future();
+
+        std::vector<Task> tasks;
+        tasks.reserve(size);
+        for (; begin != end; ++begin)
+        {
+            tasks.emplace_back(BatchTask<func_type>(state, func_type(*begin)));
+        }
+
+        if (0 == size)
+        {
+            std::promise<void> ready;
+            ready.set_value();
+            ret = ready.get_future();
+        }
+        return std::make_pair(std::move(tasks), std::move(ret));
+    }
+
+    // a task per chunk of at most grain indexes in [begin, end), each calls func(first, last)
+    template <typename Index, typename F>
+    std::pair<std::vector<Task>, std::future<void>> make_range_tasks(Index begin, Index end, Index grain, F &&func)
+    {
+        using func_type = typename std::decay<F>::type;
+        using chunk_type = RangeChunk<Index, func_type>;
+        grain = grain > 0 ? grain : 1;
+
+        std::vector<chunk_type> chunks;
+        if (begin < end)
+        {
+            std::shared_ptr<func_type> shared_func = std::make_shared<func_type>(std::forward<F>(func));
+            chunks.reserve((end - begin + grain - 1) / grain);
+            for (Index first = begin; first < end;)
+            {
+                Index last = end - first > grain ? first + grain : end;
+                chunks.emplace_back(shared_func, first, last);
+                first = last;
+            }
+        }
+        return make_batch_tasks(std::make_move_iterator(chunks.begin()), std::make_move_iterator(chunks.end()));
+    }
+
+} // namespace soda
@@ -2,21 +2,20 @@
 
 // multi-thread safe
 
-#include <list>
 #include <mutex>
 #include <condition_variable>
-#include <functional>
+#include <vector>
 
 #include "../general/util.hpp"
+#include "task.hpp"
+#include "array_queue.hpp"
 
 namespace soda
 {
-    using TaskType = std::function<void()>;
-
     class TaskQueue : Noncopyable
     {
     public:
-        TaskQueue() {}
+        TaskQueue() : m_waiting(0) {}
         ~TaskQueue() {}
 
         bool empty() const;
@@ -27,13 +26,18 @@ namespace soda
 
         void enqueue(TaskType task);
 
+        // one lock for all, wake min(batch, waiting) workers
+        void enqueue_bulk(std::vector<TaskType> &&tasks);
+
         TaskType dequeue();
 
     private:
-        std::list<TaskType> m_container;
+        ArrayQueue<TaskType> m_container;
 
         mutable std::mutex m_mtx;
         std::condition_variable m_cv;
+        // workers blocked in dequeue()
+        size_t m_waiting;
     };
 
     bool TaskQueue::empty() const
@@ -57,22 +61,40 @@ namespace soda
     void TaskQueue::enqueue(TaskType task)
     {
         std::unique_lock<std::mutex> lock(m_mtx);
-        m_container.emplace_back(std::move(task));
+        m_container.push(std::move(task));
 
         m_cv.notify_one();
     }
 
+    void TaskQueue::enqueue_bulk(std::vector<TaskType> &&tasks)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        for (auto &&task : tasks)
+        {
+            m_container.push(std::move(task));
+        }
+
+        if (tasks.size() >= m_waiting)
+        {
+            m_cv.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < tasks.size(); ++i)
+        {
+            m_cv.notify_one();
+        }
+    }
+
     TaskType TaskQueue::dequeue()
     {
         std::unique_lock<std::mutex> lock(m_mtx);
+        ++m_waiting;
         m_cv.wait(lock, [this]
                   { return !this->m_container.empty(); });
+        --m_waiting;
 
-        // package_task wrapped in std::function
         // libc++abi: terminating with uncaught exception of type std::__1::future_error: The state of the promise has already been set.
         // auto &ret = m_container_high.front();
-        TaskType ret = std::move(m_container.front());
-        m_container.pop_front();
-        return ret;
+        return m_container.pop();
     }
 } // namespace soda
@@ -0,0 +1,449 @@
+#pragma once
+
+// multi-thread work stealing priority task queue - per worker Chase-Lev deques and a global injection queue
+// a task enqueued by a worker goes to its local deque, others go to the global queue; idle workers steal from each other
+// a worker always takes HIGH before NORMAL before LOW, whichever deque or queue the task is in
+
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../general/util.hpp"
+#include "../general/pool_allocator.hpp"
+#include "priority_task_queue.hpp"
+#include "chase_lev_deque.hpp"
+#include "array_queue.hpp"
+
+namespace soda
+{
+    class WorkStealingTaskQueue : Noncopyable
+    {
+        // the maximum number of workers owning a local deque, the rest only use the global queue
+        static const size_t WS_MAX_WORKERS = 1024;
+        // rounds of looking for a task before sleeping
+        static const size_t WS_SPIN_BEFORE_SLEEP = 64;
+        static const size_t PRIORITY_SIZE = 3;
+
+    public:
+        WorkStealingTaskQueue();
+        ~WorkStealingTaskQueue();
+
+        bool empty() const;
+
+        size_t size() const;
+        size_t size(TaskPriority pri) const;
+
+        void enqueue(TaskType task, TaskPriority pri = TaskPriority::NORMAL);
+
+        // from a worker to its local deque, otherwise to the global queue under one lock; wake min(batch, sleepers) workers
+        void enqueue_bulk(std::vector<TaskType> &&tasks, TaskPriority pri = TaskPriority::NORMAL);
+
+        // block until a task is available
+        TaskType dequeue();
+
+        // bind the calling thread as a worker with a local deque; -1 if no slot left, it still can dequeue
+        int32_t register_worker();
+
+        // unbind the calling thread, tasks left in its local deque are moved to the global queue
+        void unregister_worker();
+
+    private:
+        struct WorkerSlot
+        {
+            // one per priority, overflow goes to the global queue
+            ChaseLevDeque<TaskType *> deques[PRIORITY_SIZE];
+            bool active;
+
+            WorkerSlot() : active(true) {}
+        };
+
+        struct WorkerContext
+        {
+            const WorkStealingTaskQueue *queue;
+            int32_t slot;
+            // where to start looking for a victim
+            size_t victim;
+        };
+
+        // created slots are kept until destruction and reused by new workers
+        std::atomic<WorkerSlot *> m_slots[WS_MAX_WORKERS];
+        std::atomic_size_t m_slot_size;
+        std::mutex m_slot_mtx;
+
+        // global injection queue
+        ArrayQueue<TaskType> m_global[PRIORITY_SIZE];
+        std::atomic_size_t m_global_size[PRIORITY_SIZE];
+        std::mutex m_global_mtx;
+
+        // tasks not yet taken per priority, wherever they are; increased before a task is visible so it may be transiently ahead
+        struct PendingCounter
+        {
+            std::atomic<int64_t> value;
+            // one cache line each
+            uint8_t pad[CACHE_LINE_SIZE - sizeof(std::atomic<int64_t>)];
+        };
+        PendingCounter m_pending[PRIORITY_SIZE];
+
+        std::atomic_size_t m_sleepers;
+        std::mutex m_sleep_mtx;
+        std::condition_variable m_cv;
+
+    private:
+        static WorkerContext &local_context();
+
+        // nullptr if the calling thread is not a worker with a slot of this queue
+        inline WorkerSlot *local_slot() const;
+
+        bool try_dequeue(TaskType &dst);
+
+        bool try_dequeue_global(TaskPriority pri, TaskType &dst);
+
+        bool try_steal(TaskPriority pri, TaskType &dst);
+
+        void push_global(TaskType task, TaskPriority pri);
+
+        void wakeup_sleeper(size_t size = 1);
+
+        // deques hold pointers, the tasks live in SmallObjectPool
+        static inline TaskType *new_task_node(TaskType &&task);
+
+        static inline void delete_task_node(TaskType *task);
+    };
+
+    inline TaskType *WorkStealingTaskQueue::new_task_node(TaskType &&task)
+    {
+        return new (SmallObjectPool::allocate(sizeof(TaskType))) TaskType(std::move(task));
+    }
+
+    inline void WorkStealingTaskQueue::delete_task_node(TaskType *task)
+    {
+        task->~TaskType();
+        SmallObjectPool::deallocate(task, sizeof(TaskType));
+    }
+
+    WorkStealingTaskQueue::WorkStealingTaskQueue() : m_slot_size(0), m_sleepers(0)
+    {
+        for (size_t i = 0; i < WS_MAX_WORKERS; ++i)
+        {
+            m_slots[i] = nullptr;
+        }
+        for (size_t i = 0; i < PRIORITY_SIZE; ++i)
+        {
+            m_global_size[i] = 0;
+            m_pending[i].value = 0;
+        }
+    }
+
+    WorkStealingTaskQueue::~WorkStealingTaskQueue()
+    {
+        for (size_t i = 0; i < m_slot_size; ++i)
+        {
+            WorkerSlot *slot = m_slots[i];
+            TaskType *task = nullptr;
+            for (auto &&deque : slot->deques)
+            {
+                while (deque.steal(task))
+                {
+                    delete_task_node(task);
+                }
+            }
+            delete slot;
+            m_slots[i] = nullptr;
+        }
+    }
+
+    WorkStealingTaskQueue::WorkerContext &WorkStealingTaskQueue::local_context()
+    {
+        static thread_local WorkerContext ctx{nullptr, -1, 0};
+        return ctx;
+    }
+
+    inline WorkStealingTaskQueue::WorkerSlot *WorkStealingTaskQueue::local_slot() const
+    {
+        WorkerContext &ctx = local_context();
+        if (this != ctx.queue || -1 == ctx.slot)
+        {
+            return nullptr;
+        }
+        return m_slots[ctx.slot].load(std::memory_order_relaxed);
+    }
+
+    bool WorkStealingTaskQueue::empty() const
+    {
+        for (size_t i = 0; i < PRIORITY_SIZE; ++i)
+        {
+            if (m_pending[i].value > 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t WorkStealingTaskQueue::size() const
+    {
+        return size(HIGH) + size(NORMAL) + size(LOW);
+    }
+
+    size_t WorkStealingTaskQueue::size(TaskPriority pri) const
+    {
+        int64_t size = m_pending[pri].value;
+        return size > 0 ? static_cast<size_t>(size) : 0;
+    }
+
+    int32_t WorkStealingTaskQueue::register_worker()
+    {
+        WorkerContext &ctx = local_context();
+        std::lock_guard<std::mutex> lock(m_slot_mtx);
+
+        int32_t idx = -1;
+        size_t slot_size = m_slot_size;
+        for (size_t i = 0; i < slot_size; ++i)
+        {
+            WorkerSlot *slot = m_slots[i];
+            if (!slot->active)
+            {
+                slot->active = true;
+                idx = static_cast<int32_t>(i);
+                break;
+            }
+        }
+
+        if (-1 == idx && slot_size < WS_MAX_WORKERS)
+        {
+            m_slots[slot_size].store(new WorkerSlot(), std::memory_order_release);
+            m_slot_size.store(slot_size + 1, std::memory_order_release);
+            idx = static_cast<int32_t>(slot_size);
+        }
+
+        ctx.queue = this;
+        ctx.slot = idx;
+        ctx.victim = idx > 0 ? idx : 0;
+        return idx;
+    }
+
+    void WorkStealingTaskQueue::unregister_worker()
+    {
+        WorkerSlot *slot = local_slot();
+        WorkerContext &ctx = local_context();
+        if (this == ctx.queue)
+        {
+            ctx.queue = nullptr;
+            ctx.slot = -1;
+        }
+        if (!slot)
+        {
+            return;
+        }
+
+        // hand the local tasks over, pending counters stay as they are
+        TaskType *task = nullptr;
+        for (size_t i = 0; i < PRIORITY_SIZE; ++i)
+        {
+            while (slot->deques[i].pop(task))
+            {
+                push_global(std::move(*task), static_cast<TaskPriority>(i));
+                delete_task_node(task);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_slot_mtx);
+        slot->active = false;
+    }
+
+    void WorkStealingTaskQueue::enqueue(TaskType task, TaskPriority pri)
+    {
+        m_pending[pri].value.fetch_add(1);
+
+        WorkerSlot *slot = local_slot();
+        TaskType *local = slot ? new_task_node(std::move(task)) : nullptr;
+        if (!local || !slot->deques[pri].push(local))
+        {
+            if (local)
+            {
+                // local deque is full
+                task = std::move(*local);
+                delete_task_node(local);
+            }
+            push_global(std::move(task), pri);
+        }
+
+        wakeup_sleeper();
+    }
+
+    void WorkStealingTaskQueue::enqueue_bulk(std::vector<TaskType> &&tasks, TaskPriority pri)
+    {
+        if (tasks.empty())
+        {
+            return;
+        }
+        m_pending[pri].value.fetch_add(tasks.size());
+
+        size_t idx = 0;
+        WorkerSlot *slot = local_slot();
+        if (slot)
+        {
+            for (; idx < tasks.size(); ++idx)
+            {
+                TaskType *local = new_task_node(std::move(tasks[idx]));
+                if (!slot->deques[pri].push(local))
+                {
+                    // local deque is full
+                    tasks[idx] = std::move(*local);
+                    delete_task_node(local);
+                    break;
+                }
+            }
+        }
+
+        if (idx < tasks.size())
+        {
+            std::lock_guard<std::mutex> lock(m_global_mtx);
+            for (size_t i = idx; i < tasks.size(); ++i)
+            {
+                m_global[pri].push(std::move(tasks[i]));
+            }
+            m_global_size[pri] += tasks.size() - idx;
+        }
+
+        wakeup_sleeper(tasks.size());
+    }
+
+    TaskType WorkStealingTaskQueue::dequeue()
+    {
+        TaskType task;
+        size_t spin = 0;
+        while (!try_dequeue(task))
+        {
+            if (++spin < WS_SPIN_BEFORE_SLEEP)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            spin = 0;
+
+            std::unique_lock<std::mutex> lock(m_sleep_mtx);
+            // pairs with the pending increase in enqueue(): either the task is seen here or the sleeper is seen there
+            m_sleepers.fetch_add(1);
+            if (empty())
+            {
+                m_cv.wait(lock);
+            }
+            m_sleepers.fetch_sub(1);
+        }
+        return task;
+    }
+
+    bool WorkStealingTaskQueue::try_dequeue(TaskType &dst)
+    {
+        WorkerSlot *slot = local_slot();
+        for (size_t i = 0; i < PRIORITY_SIZE; ++i)
+        {
+            if (m_pending[i].value.load(std::memory_order_relaxed) <= 0)
+            {
+                continue;
+            }
+
+            TaskPriority pri = static_cast<TaskPriority>(i);
+            TaskType *task = nullptr;
+            bool found = false;
+            if (slot && slot->deques[i].pop(task))
+            {
+                dst = std::move(*task);
+                delete_task_node(task);
+                found = true;
+            }
+            else
+            {
+                found = try_dequeue_global(pri, dst) || try_steal(pri, dst);
+            }
+
+            if (found)
+            {
+                m_pending[i].value.fetch_sub(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool WorkStealingTaskQueue::try_dequeue_global(TaskPriority pri, TaskType &dst)
+    {
+        if (0 == m_global_size[pri].load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(m_global_mtx);
+        if (m_global[pri].empty())
+        {
+            return false;
+        }
+        dst = m_global[pri].pop();
+        --m_global_size[pri];
+        return true;
+    }
+
+    bool WorkStealingTaskQueue::try_steal(TaskPriority pri, TaskType &dst)
+    {
+        size_t slot_size = m_slot_size.load(std::memory_order_acquire);
+        if (0 == slot_size)
+        {
+            return false;
+        }
+
+        WorkerContext &ctx = local_context();
+        int32_t self = this == ctx.queue ? ctx.slot : -1;
+        size_t start = ctx.victim % slot_size;
+        for (size_t i = 0; i < slot_size; ++i)
+        {
+            size_t idx = (start + i) % slot_size;
+            if (static_cast<int32_t>(idx) == self)
+            {
+                continue;
+            }
+
+            TaskType *task = nullptr;
+            WorkerSlot *slot = m_slots[idx].load(std::memory_order_acquire);
+            if (slot->deques[pri].steal(task))
+            {
+                dst = std::move(*task);
+                delete_task_node(task);
+                // a victim with work is likely to have more
+                ctx.victim = idx;
+                return true;
+            }
+        }
+        ctx.victim = start + 1;
+        return false;
+    }
+
+    void WorkStealingTaskQueue::push_global(TaskType task, TaskPriority pri)
+    {
+        std::lock_guard<std::mutex> lock(m_global_mtx);
+        m_global[pri].push(std::move(task));
+        ++m_global_size[pri];
+    }
+
+    void WorkStealingTaskQueue::wakeup_sleeper(size_t size)
+    {
+        size_t sleepers = m_sleepers.load();
+        if (0 == sleepers)
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(m_sleep_mtx);
+        if (size >= sleepers)
+        {
+            m_cv.notify_all();
+            return;
+        }
+        for (size_t i = 0; i < size; ++i)
+        {
+            m_cv.notify_one();
+        }
+    }
+
+} // namespace soda
@@ -24,6 +24,14 @@ namespace soda
         auto insert_task(F &&f, Args &&...args)
             -> std::future<decltype(std::forward<F>(f)(std::forward<Args>(args)...))>;
 
+        // a task per callable in [begin, end) enqueued at once, the future is ready when all of them have run
+        template <typename Iter>
+        std::future<void> insert_tasks(Iter begin, Iter end);
+
+        // split [begin, end) into chunks of grain indexes, func(first, last) is called once per chunk
+        template <typename Index, typename F>
+        std::future<void> parallel_for(Index begin, Index end, Index grain, F &&func);
+
         void stop();
 
         size_t size() const;
@@ -49,7 +57,7 @@ namespace soda
         void init();
     };
 
-    SimpleThreadPool::SimpleThreadPool(size_t size) : m_size(size), m_stop(false)
+    SimpleThreadPool::SimpleThreadPool(size_t size) : m_size(size), m_busy_size(0), m_stop(false)
     {
         init();
     }
@@ -87,13 +95,26 @@ namespace soda
     auto SimpleThreadPool::insert_task(F &&f, Args &&...args)
         -> std::future<decltype(std::forward<F>(f)(std::forward<Args>(args)...))>
     {
-        using ret_type = decltype(std::forward<F>(f)(std::forward<Args>(args)...));
-        // packaged_task is noncopyable，but std::function requires copyable one，so wrapped in ptr
-        std::shared_ptr<std::packaged_task<ret_type()>> task = std::make_shared<std::packaged_task<ret_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-        std::future<ret_type> ret = task->get_future();
-        m_task_queue.enqueue([task]()
-                             { (*task)(); });
-        return ret;
+        // small callables are stored inline and the promise state is pooled, no allocation in steady state
+        auto task = make_promise_task(std::forward<F>(f), std::forward<Args>(args)...);
+        m_task_queue.enqueue(std::move(task.first));
+        return std::move(task.second);
+    }
+
+    template <typename Iter>
+    std::future<void> SimpleThreadPool::insert_tasks(Iter begin, Iter end)
+    {
+        auto batch = make_batch_tasks(begin, end);
+        m_task_queue.enqueue_bulk(std::move(batch.first));
+        return std::move(batch.second);
+    }
+
+    template <typename Index, typename F>
+    std::future<void> SimpleThreadPool::parallel_for(Index begin, Index end, Index grain, F &&func)
+    {
+        auto batch = make_range_tasks(begin, end, grain, std::forward<F>(func));
+        m_task_queue.enqueue_bulk(std::move(batch.first));
+        return std::move(batch.second);
     }
 
     size_t SimpleThreadPool::size() const
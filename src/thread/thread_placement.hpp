@@ -0,0 +1,305 @@
+#pragma once
+
+// thread placement - CPU affinity, round robin across NUMA nodes and thread names for the threads of a pool or a loop
+// the n-th thread calls apply(n) on itself; NUMA nodes are read from /sys, one node with every allowed CPU if not available
+
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "../general/util.hpp"
+
+namespace soda
+{
+    class ThreadPlacement
+    {
+    public:
+        enum Mode
+        {
+            // no affinity, only the name
+            NONE,
+            // every thread may run on any CPU of the set
+            CPU_SET,
+            // thread n is pinned to one CPU, consecutive threads go to different NUMA nodes
+            PER_CPU,
+            // thread n may run on any CPU of NUMA node n % nodes
+            PER_NODE
+        };
+
+        // cpus: restrict to these CPUs, empty for all CPUs the process may run on
+        // name: threads are named "<name>-<n>", truncated to 15 characters; empty to keep the name
+        ThreadPlacement(Mode mode = NONE, const std::vector<int> &cpus = {}, const std::string &name = "");
+
+        // place the calling thread as the index-th one; -1 if failed
+        int apply(size_t index) const;
+
+        Mode mode() const { return m_mode; }
+
+        const std::string &name() const { return m_name; }
+
+        // CPU groups handed out round robin
+        const std::vector<std::vector<int>> &groups() const { return m_groups; }
+
+        // CPUs of each NUMA node, restricted to the CPUs the process may run on
+        static std::vector<std::vector<int>> numa_nodes();
+
+        // CPUs the process may run on
+        static std::vector<int> allowed_cpus();
+
+        // -1 if failed
+        static int set_affinity(pthread_t thread, const std::vector<int> &cpus);
+
+        // -1 if failed; at most 15 characters are kept
+        static int set_name(pthread_t thread, const std::string &name);
+
+    private:
+        Mode m_mode;
+        std::string m_name;
+        std::vector<std::vector<int>> m_groups;
+
+    private:
+        // "0-3,8,10-11"
+        static std::vector<int> parse_cpulist(const std::string &list);
+    };
+
+    // apply a placement to the calling thread and restore its affinity and name when destroyed, e.g. for a loop borrowing a pool thread
+    class ThreadPlacementGuard : Noncopyable
+    {
+    public:
+        ThreadPlacementGuard(const ThreadPlacement &placement, size_t index);
+        ~ThreadPlacementGuard();
+
+    private:
+        cpu_set_t m_cpus;
+        char m_name[16];
+        bool m_restore_cpus;
+        bool m_restore_name;
+    };
+
+    ThreadPlacement::ThreadPlacement(Mode mode, const std::vector<int> &cpus, const std::string &name) : m_mode(mode), m_name(name)
+    {
+        if (NONE == m_mode)
+        {
+            return;
+        }
+
+        std::vector<int> allowed = cpus.empty() ? allowed_cpus() : cpus;
+        std::sort(allowed.begin(), allowed.end());
+        if (CPU_SET == m_mode)
+        {
+            m_groups.push_back(allowed);
+            return;
+        }
+
+        std::vector<std::vector<int>> nodes;
+        for (auto &&node : numa_nodes())
+        {
+            std::vector<int> group;
+            for (int cpu : node)
+            {
+                if (std::binary_search(allowed.begin(), allowed.end(), cpu))
+                {
+                    group.push_back(cpu);
+                }
+            }
+            if (!group.empty())
+            {
+                nodes.push_back(std::move(group));
+            }
+        }
+
+        if (PER_NODE == m_mode)
+        {
+            m_groups = std::move(nodes);
+            return;
+        }
+
+        // interleave the nodes: n0c0, n1c0, n0c1, n1c1, ...
+        for (size_t i = 0, found = 1; found; ++i)
+        {
+            found = 0;
+            for (auto &&node : nodes)
+            {
+                if (i < node.size())
+                {
+                    m_groups.push_back({node[i]});
+                    found = 1;
+                }
+            }
+        }
+    }
+
+    int ThreadPlacement::apply(size_t index) const
+    {
+        int ret = 0;
+        if (!m_name.empty() && -1 == set_name(pthread_self(), m_name + "-" + std::to_string(index)))
+        {
+            ret = -1;
+        }
+        if (!m_groups.empty() && -1 == set_affinity(pthread_self(), m_groups[index % m_groups.size()]))
+        {
+            ret = -1;
+        }
+        return ret;
+    }
+
+    std::vector<std::vector<int>> ThreadPlacement::numa_nodes()
+    {
+        std::vector<int> allowed = allowed_cpus();
+        std::vector<std::pair<int, std::vector<int>>> nodes;
+
+        DIR *dir = opendir("/sys/devices/system/node");
+        if (dir)
+        {
+            while (dirent *entry = readdir(dir))
+            {
+                int id = -1;
+                if (1 != sscanf(entry->d_name, "node%d", &id))
+                {
+                    continue;
+                }
+
+                std::ifstream file(std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist");
+                std::string list;
+                std::getline(file, list);
+                std::vector<int> node;
+                for (int cpu : parse_cpulist(list))
+                {
+                    if (std::binary_search(allowed.begin(), allowed.end(), cpu))
+                    {
+                        node.push_back(cpu);
+                    }
+                }
+                if (!node.empty())
+                {
+                    nodes.emplace_back(id, std::move(node));
+                }
+            }
+            closedir(dir);
+        }
+
+        std::sort(nodes.begin(), nodes.end());
+        std::vector<std::vector<int>> ret;
+        for (auto &&node : nodes)
+        {
+            ret.push_back(std::move(node.second));
+        }
+        if (ret.empty() && !allowed.empty())
+        {
+            ret.push_back(std::move(allowed));
+        }
+        return ret;
+    }
+
+    std::vector<int> ThreadPlacement::allowed_cpus()
+    {
+        std::vector<int> ret;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (-1 == sched_getaffinity(0, sizeof(set), &set))
+        {
+            perror("sched_getaffinity");
+            return ret;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                ret.push_back(cpu);
+            }
+        }
+        return ret;
+    }
+
+    int ThreadPlacement::set_affinity(pthread_t thread, const std::vector<int> &cpus)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus)
+        {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &set);
+            }
+        }
+
+        // pthread functions return the error instead of setting errno
+        int err = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (0 != err)
+        {
+            ERROR_PRINT("pthread_setaffinity_np: " << strerror(err) << std::endl);
+            return -1;
+        }
+        return 0;
+    }
+
+    int ThreadPlacement::set_name(pthread_t thread, const std::string &name)
+    {
+        // the kernel keeps 16 bytes with the terminating null
+        int err = pthread_setname_np(thread, name.substr(0, 15).c_str());
+        if (0 != err)
+        {
+            ERROR_PRINT("pthread_setname_np: " << strerror(err) << std::endl);
+            return -1;
+        }
+        return 0;
+    }
+
+    ThreadPlacementGuard::ThreadPlacementGuard(const ThreadPlacement &placement, size_t index) : m_name{},
+                                                                                                 m_restore_cpus(false),
+                                                                                                 m_restore_name(false)
+    {
+        CPU_ZERO(&m_cpus);
+        if (!placement.groups().empty())
+        {
+            m_restore_cpus = 0 == pthread_getaffinity_np(pthread_self(), sizeof(m_cpus), &m_cpus);
+        }
+        if (!placement.name().empty())
+        {
+            m_restore_name = 0 == pthread_getname_np(pthread_self(), m_name, sizeof(m_name));
+        }
+        placement.apply(index);
+    }
+
+    ThreadPlacementGuard::~ThreadPlacementGuard()
+    {
+        if (m_restore_cpus)
+        {
+            pthread_setaffinity_np(pthread_self(), sizeof(m_cpus), &m_cpus);
+        }
+        if (m_restore_name)
+        {
+            pthread_setname_np(pthread_self(), m_name);
+        }
+    }
+
+    std::vector<int> ThreadPlacement::parse_cpulist(const std::string &list)
+    {
+        std::vector<int> ret;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ','))
+        {
+            int first = -1;
+            int last = -1;
+            int size = sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (size < 1)
+            {
+                continue;
+            }
+            last = size == 2 ? last : first;
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                ret.push_back(cpu);
+            }
+        }
+        return ret;
+    }
+
+} // namespace soda
@@ -1,6 +1,7 @@
 #pragma once
 
-// thread pool - automatically scale within min and max size; priority task
+// thread pool - automatically scale within min and max size; priority task; optional work stealing scheduler
+// grows on insertion when queued tasks outnumber idle workers, shrinks when workers stay idle for the idle timeout
 
 #include <functional>
 #include <queue>
@@ -12,21 +13,31 @@
 #include <condition_variable>
 #include <future>
 #include <atomic>
+#include <memory>
+#include <chrono>
+#include <cstdint>
 
 #include "../general/util.hpp"
 #include "../queue/priority_task_queue.hpp"
+#include "../queue/work_stealing_task_queue.hpp"
+#include "thread_placement.hpp"
 
 namespace soda
 {
-
-    // ms
-    constexpr size_t MONITOR_SLEEP_TIME = 5000;
-    constexpr size_t MAX_IDLE_DURATION_TO_CLOSE_WORKER = 600000;
-
     class ThreadPool : Noncopyable
     {
+        // ms
+        static const size_t DEFAULT_IDLE_TIMEOUT = 60000;
+        // idle workers are sampled this many times per idle timeout
+        static const size_t IDLE_SAMPLE_SIZE = 10;
+
     public:
-        ThreadPool(size_t min_size = 1, size_t max_size = std::thread::hardware_concurrency());
+        // work_stealing: per worker deques instead of the single locked queue, tasks inserted by a worker stay on it
+        // placement: affinity and name of the workers, a worker keeps the lowest free index so placement stays balanced while scaling
+        ThreadPool(size_t min_size = 1,
+                   size_t max_size = std::thread::hardware_concurrency(),
+                   bool work_stealing = false,
+                   const ThreadPlacement &placement = ThreadPlacement());
         ~ThreadPool();
 
         // for restart mainly, constructor will start automaticlly
@@ -40,6 +51,12 @@ namespace soda
 
         void add_new_worker(size_t num);
 
+        // ms; workers idle for the whole time are closed, down to min size
+        void set_idle_timeout(size_t timeout);
+
+        // grow when queued tasks exceed idle workers by more than this, 0 grows as soon as a task has to wait
+        void set_spawn_threshold(size_t size);
+
         template <typename F, typename... Args>
         auto insert_task(TaskPriority pri, F &&f, Args &&...args)
             -> std::future<decltype(std::forward<F>(f)(std::forward<Args>(args)...))>;
@@ -56,6 +73,14 @@ namespace soda
         auto insert_task_low(F &&f, Args &&...args)
             -> std::future<decltype(std::forward<F>(f)(std::forward<Args>(args)...))>;
 
+        // a task per callable in [begin, end) enqueued at once, the future is ready when all of them have run
+        template <typename Iter>
+        std::future<void> insert_tasks(Iter begin, Iter end, TaskPriority pri = TaskPriority::NORMAL);
+
+        // split [begin, end) into chunks of grain indexes, func(first, last) is called once per chunk
+        template <typename Index, typename F>
+        std::future<void> parallel_for(Index begin, Index end, Index grain, F &&func, TaskPriority pri = TaskPriority::NORMAL);
+
         size_t size() const;
 
         size_t busy_size() const;
@@ -68,6 +93,8 @@ namespace soda
                       << " exp_close: " << tp.m_reduce_size
                       << " min: " << tp.m_min_size
                       << " max: " << tp.m_max_size
+                      << " idle_timeout: " << tp.m_idle_timeout
+                      << " spawn_threshold: " << tp.m_spawn_threshold
                       << std::endl;
         }
 
@@ -78,19 +105,32 @@ namespace soda
         // the number of worker threads need to be reduced
         std::atomic_size_t m_reduce_size;
         std::atomic_size_t m_worker_size;
-        bool m_stop;
+        std::atomic_bool m_stop;
+        std::atomic_size_t m_idle_timeout;
+        std::atomic_size_t m_spawn_threshold;
+        // the fewest idle workers seen since m_window_start, only touched by the manager
+        size_t m_window_idle;
+        std::chrono::steady_clock::time_point m_window_start;
         std::unordered_map<std::thread::id, std::thread> m_workers;
         // thread to be joined
         std::list<std::thread> m_closed_workers;
         std::thread m_mgr;
         PriorityTaskQueue m_task_queue;
+        // nullptr if not work stealing
+        std::unique_ptr<WorkStealingTaskQueue> m_ws_queue;
+        ThreadPlacement m_placement;
+        // placement indexes taken by living workers
+        std::vector<bool> m_worker_index;
 
         std::mutex m_mtx;
+        // the manager sleeps on it between samples, notified by stop() and new settings
+        std::mutex m_mgr_mtx;
+        std::condition_variable m_mgr_cv;
 
     private:
-        void worker_exit();
+        void worker_exit(size_t index);
 
-        void worker_proc();
+        void worker_proc(size_t index);
 
         void add_worker_thread(size_t num);
 
@@ -108,42 +148,124 @@ namespace soda
         void wakeup_worker(size_t num);
 
         void check_scale();
+
+        // called after insertion, spawn workers if tasks have to wait
+        inline void check_grow();
+
+        // take one from m_reduce_size, false if nothing to reduce
+        inline bool try_reduce();
+
+        inline void enqueue(TaskType task, TaskPriority pri);
+
+        inline void enqueue_bulk(std::vector<TaskType> &&tasks, TaskPriority pri);
+
+        inline TaskType dequeue();
+
+        inline bool queue_empty() const;
+
+        inline size_t queue_size() const;
     };
 
+    inline void ThreadPool::enqueue(TaskType task, TaskPriority pri)
+    {
+        if (m_ws_queue)
+        {
+            m_ws_queue->enqueue(std::move(task), pri);
+            return;
+        }
+        m_task_queue.enqueue(std::move(task), pri);
+    }
+
+    inline void ThreadPool::enqueue_bulk(std::vector<TaskType> &&tasks, TaskPriority pri)
+    {
+        if (m_ws_queue)
+        {
+            m_ws_queue->enqueue_bulk(std::move(tasks), pri);
+            return;
+        }
+        m_task_queue.enqueue_bulk(std::move(tasks), pri);
+    }
+
+    inline TaskType ThreadPool::dequeue()
+    {
+        return m_ws_queue ? m_ws_queue->dequeue() : m_task_queue.dequeue();
+    }
+
+    inline bool ThreadPool::queue_empty() const
+    {
+        return m_ws_queue ? m_ws_queue->empty() : m_task_queue.empty();
+    }
+
+    inline size_t ThreadPool::queue_size() const
+    {
+        return m_ws_queue ? m_ws_queue->size() : m_task_queue.size();
+    }
+
     void ThreadPool::check_scale()
     {
-        static size_t exp_close = 0;
-        static size_t idle_duration = 0;
-        // close some workers if idle size remains for certain time
-        //  2->3->3 close 2
-        //  2->1->3 count from 1
-        size_t idle_size = m_worker_size - m_busy_size;
-        if (exp_close > idle_size)
+        // close the workers that stayed idle during a whole idle timeout
+        //  idle 2->3->3 close 2
+        //  idle 2->1->3 close 1
+        size_t worker_size = m_worker_size;
+        size_t busy_size = m_busy_size;
+        size_t idle_size = worker_size > busy_size ? worker_size - busy_size : 0;
+        m_window_idle = std::min(m_window_idle, idle_size);
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - m_window_start >= std::chrono::milliseconds(m_idle_timeout))
         {
-            idle_duration = 0;
-            exp_close = idle_size;
+            // workers asked to close but not gone yet are not idle ones to close again
+            size_t reduce_size = m_reduce_size;
+            size_t keep_size = m_min_size + reduce_size;
+            size_t close_size = worker_size > keep_size ? std::min(m_window_idle, worker_size - keep_size) : 0;
+            if (close_size > 0)
+            {
+                m_reduce_size += close_size;
+                wakeup_worker(close_size);
+            }
+            m_window_idle = SIZE_MAX;
+            m_window_start = now;
         }
-        else if (idle_duration + MONITOR_SLEEP_TIME >= MAX_IDLE_DURATION_TO_CLOSE_WORKER)
+
+        if (busy_size >= worker_size && worker_size >= m_max_size && !queue_empty())
         {
-            m_reduce_size = std::min(exp_close, m_worker_size - m_min_size);
-            exp_close = 0;
-            idle_duration = 0;
-            wakeup_worker(m_reduce_size);
-            m_reduce_size = 0;
+            full_load();
         }
-        else if (MONITOR_SLEEP_TIME == (idle_duration += MONITOR_SLEEP_TIME))
+    }
+
+    inline void ThreadPool::check_grow()
+    {
+        size_t worker_size = m_worker_size.load(std::memory_order_relaxed);
+        if (worker_size >= m_max_size || m_stop)
         {
-            exp_close = idle_size;
+            return;
         }
 
-        if (m_busy_size == m_worker_size && m_worker_size < m_max_size && !m_task_queue.empty())
+        size_t busy_size = m_busy_size.load(std::memory_order_relaxed);
+        size_t idle_size = worker_size > busy_size ? worker_size - busy_size : 0;
+        size_t queued_size = queue_size();
+        if (queued_size <= idle_size + m_spawn_threshold)
         {
-            add_worker_thread(std::min(m_max_size - m_worker_size, m_task_queue.size()));
+            return;
         }
-        else if (m_worker_size == m_busy_size && m_worker_size == m_max_size && !m_task_queue.empty())
+
+        // busy again, keep the workers about to close instead of spawning new ones
+        size_t need_size = queued_size - idle_size;
+        size_t reduce_size = m_reduce_size.exchange(0);
+        add_worker_thread(need_size > reduce_size ? need_size - reduce_size : 0);
+    }
+
+    inline bool ThreadPool::try_reduce()
+    {
+        size_t reduce_size = m_reduce_size;
+        while (reduce_size > 0)
         {
-            full_load();
+            if (m_reduce_size.compare_exchange_weak(reduce_size, reduce_size - 1))
+            {
+                return true;
+            }
         }
+        return false;
     }
 
     void ThreadPool::set_min_size(size_t size)
@@ -164,12 +286,32 @@ namespace soda
         m_max_size += num;
     }
 
-    ThreadPool::ThreadPool(size_t min_size, size_t max_size) : m_max_size(max_size),
+    void ThreadPool::set_idle_timeout(size_t timeout)
+    {
+        m_idle_timeout = timeout > 0 ? timeout : 1;
+        std::lock_guard<std::mutex> lock(m_mgr_mtx);
+        m_mgr_cv.notify_all();
+    }
+
+    void ThreadPool::set_spawn_threshold(size_t size)
+    {
+        m_spawn_threshold = size;
+    }
+
+    ThreadPool::ThreadPool(size_t min_size,
+                           size_t max_size,
+                           bool work_stealing,
+                           const ThreadPlacement &placement) : m_max_size(max_size),
                                                                m_min_size(std::min(min_size, max_size)),
                                                                m_busy_size(0),
                                                                m_reduce_size(0),
                                                                m_worker_size(0),
-                                                               m_stop(false)
+                                                               m_stop(false),
+                                                               m_idle_timeout(DEFAULT_IDLE_TIMEOUT),
+                                                               m_spawn_threshold(0),
+                                                               m_window_idle(SIZE_MAX),
+                                                               m_ws_queue(work_stealing ? new WorkStealingTaskQueue() : nullptr),
+                                                               m_placement(placement)
     {
         init();
     }
@@ -189,7 +331,11 @@ namespace soda
 
     void ThreadPool::stop()
     {
-        m_stop = true;
+        {
+            std::lock_guard<std::mutex> lock(m_mgr_mtx);
+            m_stop = true;
+            m_mgr_cv.notify_all();
+        }
         if (m_mgr.joinable())
         {
             m_mgr.join();
@@ -206,43 +352,59 @@ namespace soda
         return m_busy_size;
     }
 
-    void ThreadPool::worker_exit()
+    void ThreadPool::worker_exit(size_t index)
     {
         std::lock_guard<std::mutex> lock(m_mtx);
+        m_worker_index[index] = false;
         m_closed_workers.emplace_back(std::move(m_workers.at(std::this_thread::get_id())));
         m_workers.erase(std::this_thread::get_id());
     }
 
-    void ThreadPool::worker_proc()
+    void ThreadPool::worker_proc(size_t index)
     {
+        m_placement.apply(index);
+        if (m_ws_queue)
+        {
+            m_ws_queue->register_worker();
+        }
+
         while (!m_stop)
         {
-            TaskType task = m_task_queue.dequeue();
+            TaskType task = dequeue();
             ++m_busy_size;
 
             //!!! thread can't go out when loop in tsak
             task();
 
-            if (m_reduce_size > 0)
+            --m_busy_size;
+            if (try_reduce())
             {
-                worker_exit();
-                --m_reduce_size;
-                --m_worker_size;
-                --m_busy_size;
                 break;
             }
-            --m_busy_size;
         }
-        worker_exit();
+
+        if (m_ws_queue)
+        {
+            m_ws_queue->unregister_worker();
+        }
+        worker_exit(index);
         --m_worker_size;
     }
 
     void ThreadPool::add_worker_thread(size_t num)
     {
         std::lock_guard<std::mutex> lock(m_mtx);
-        for (size_t i = 0; i < num; ++i)
+        // recheck, insertions may race to grow
+        num = std::min(num, m_max_size > m_worker_size ? m_max_size - m_worker_size : 0);
+        for (size_t i = 0; i < num && !m_stop; ++i)
         {
-            std::thread t(&ThreadPool::worker_proc, this);
+            size_t index = std::find(m_worker_index.begin(), m_worker_index.end(), false) - m_worker_index.begin();
+            if (index == m_worker_index.size())
+            {
+                m_worker_index.push_back(true);
+            }
+            m_worker_index[index] = true;
+            std::thread t(&ThreadPool::worker_proc, this, index);
             m_workers.emplace(t.get_id(), std::move(t));
             ++m_worker_size;
         }
@@ -251,10 +413,22 @@ namespace soda
     void ThreadPool::manager_proc()
     {
         add_worker_thread(m_min_size);
+        m_window_idle = SIZE_MAX;
+        m_window_start = std::chrono::steady_clock::now();
 
         while (!m_stop)
         {
-            std::this_thread::sleep_for(std::chrono::milliseconds(MONITOR_SLEEP_TIME));
+            {
+                std::unique_lock<std::mutex> lock(m_mgr_mtx);
+                if (!m_stop)
+                {
+                    m_mgr_cv.wait_for(lock, std::chrono::milliseconds(std::max<size_t>(m_idle_timeout / IDLE_SAMPLE_SIZE, 1)));
+                }
+            }
+            if (m_stop)
+            {
+                break;
+            }
 
             check_scale();
             wait_closed_workers();
@@ -264,21 +438,37 @@ namespace soda
 
     void ThreadPool::wait_closed_workers()
     {
+        // workers keep appending themselves, join a snapshot
+        std::list<std::thread> closed_workers;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            closed_workers.swap(m_closed_workers);
+        }
 
-        for (std::thread &worker : m_closed_workers)
+        for (std::thread &worker : closed_workers)
         {
             if (worker.joinable())
             {
                 worker.join();
             }
         }
-        std::lock_guard<std::mutex> lock(m_mtx);
-        m_closed_workers.clear();
     }
 
     void ThreadPool::wait_all_workers()
     {
-        wakeup_worker(m_max_size);
+        size_t worker_size = 0;
+        {
+            // add_worker_thread checks m_stop under it, no worker is added after this count
+            std::lock_guard<std::mutex> lock(m_mtx);
+            worker_size = m_worker_size;
+        }
+        wakeup_worker(worker_size);
+        // a worker is counted until it has moved itself to the closed list
+        while (m_worker_size > 0)
+        {
+            wait_closed_workers();
+            std::this_thread::yield();
+        }
         wait_closed_workers();
 
         std::lock_guard<std::mutex> lock(m_mtx);
@@ -301,14 +491,11 @@ namespace soda
     auto ThreadPool::insert_task(TaskPriority pri, F &&f, Args &&...args)
         -> std::future<decltype(std::forward<F>(f)(std::forward<Args>(args)...))>
     {
-        using ret_type = decltype(std::forward<F>(f)(std::forward<Args>(args)...));
-        // packaged_task is noncopyable，but std::function requires copyable one，so wrapped in ptr
-        std::shared_ptr<std::packaged_task<ret_type()>> task = std::make_shared<std::packaged_task<ret_type()>>(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
-        std::future<ret_type> ret = task->get_future();
-        m_task_queue.enqueue([task]()
-                             { (*task)(); },
-                             pri);
-        return ret;
+        // small callables are stored inline and the promise state is pooled, no allocation in steady state
+        auto task = make_promise_task(std::forward<F>(f), std::forward<Args>(args)...);
+        enqueue(std::move(task.first), pri);
+        check_grow();
+        return std::move(task.second);
     }
 
     template <typename F, typename... Args>
@@ -332,11 +519,29 @@ namespace soda
         return insert_task(TaskPriority::LOW, std::forward<F>(f), std::forward<Args>(args)...);
     }
 
+    template <typename Iter>
+    std::future<void> ThreadPool::insert_tasks(Iter begin, Iter end, TaskPriority pri)
+    {
+        auto batch = make_batch_tasks(begin, end);
+        enqueue_bulk(std::move(batch.first), pri);
+        check_grow();
+        return std::move(batch.second);
+    }
+
+    template <typename Index, typename F>
+    std::future<void> ThreadPool::parallel_for(Index begin, Index end, Index grain, F &&func, TaskPriority pri)
+    {
+        auto batch = make_range_tasks(begin, end, grain, std::forward<F>(func));
+        enqueue_bulk(std::move(batch.first), pri);
+        check_grow();
+        return std::move(batch.second);
+    }
+
     void ThreadPool::wakeup_worker(size_t num)
     {
         for (size_t i = 0; i < num; ++i)
         {
-            m_task_queue.enqueue([] {});
+            enqueue([] {}, TaskPriority::NORMAL);
         }
     }
 